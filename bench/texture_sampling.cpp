@@ -0,0 +1,109 @@
+//Texture sampling throughput of the row major Image against the tiled layout
+//	(see TiledImage) in the formats the textures use: float4 texels as in
+//	Image, RGB8 (the PNG textures) and R8 (the bump maps). On one thread. 
+//	Build with "make bench", run as
+//	bench/texture_sampling [texture size, default 4096]
+//Two access patterns, each with bilinear lookups of the top level and with
+//	footprint (trilinear / anisotropic) lookups:
+//	vertical - lines running along y, the worst case for the row major layout
+//	random - uniformly distributed positions
+//The rates are the best of 7 runs, in Msamples/s
+
+#include "stdafx.h"
+#include "rt/texture.h"
+#include "core/util.h"
+
+namespace texture_sampling_internal
+{
+	enum {SAMPLE_COUNT = 1 << 22, RUNS = 7};
+
+	struct Rates
+	{
+		double bilinear, footprint;
+	};
+
+	Rates measure(const Texture &_texture, const std::vector<float2> &_positions, uint _size, float &_checksum)
+	{
+		float2 dPosdx(1.5f / (float)_size, 0.4f / (float)_size), dPosdy(0.f, 1.6f / (float)_size);
+		double bilinear = 1e9, footprint = 1e9;
+
+		for(int run = 0; run < RUNS; run++)
+		{
+			float4 sum = float4::rep(0.f);
+
+			double start = wallClock();
+			for(size_t i = 0; i < _positions.size(); i++)
+				sum += _texture.sample(_positions[i]);
+			bilinear = std::min(bilinear, wallClock() - start);
+
+			start = wallClock();
+			for(size_t i = 0; i < _positions.size(); i++)
+				sum += _texture.sample(_positions[i], dPosdx, dPosdy);
+			footprint = std::min(footprint, wallClock() - start);
+
+			//Keeps the lookups from being optimized away
+			_checksum += sum.x;
+		}
+
+		Rates ret = {_positions.size() / bilinear / 1e6, _positions.size() / footprint / 1e6};
+		return ret;
+	}
+}
+
+using namespace texture_sampling_internal;
+
+int main(int argc, char* argv[])
+{
+	uint size = argc > 1 ? (uint)atoi(argv[1]) : 4096;
+	if(size == 0)
+	{
+		std::cerr << "Usage: texture_sampling [texture size]" << std::endl;
+		return 1;
+	}
+
+	//A pattern without large flat areas, so that the lookups cannot be cached
+	SmartPtr<Image> img = new Image(size, size);
+	for(uint y = 0; y < size; y++)
+		for(uint x = 0; x < size; x++)
+			(*img)(x, y) = float4((x * 7 + y * 13) % 256 / 255.f, (x ^ y) % 256 / 255.f, (x * y) % 256 / 255.f, 1.f);
+
+	//The first one stays row major
+	enum {LAYOUTS = 4};
+	const char *layoutNames[LAYOUTS] = {"row major", "RGBA32F", "RGB8", "R8"};
+	TiledImage::Format formats[LAYOUTS] = {TiledImage::TF_RGBA32F, TiledImage::TF_RGBA32F, TiledImage::TF_RGB8, TiledImage::TF_R8};
+	Texture textures[LAYOUTS];
+	for(int i = 0; i < LAYOUTS; i++)
+	{
+		textures[i].addRef();
+		textures[i].image = img;
+		textures[i].filterMode = TextureBase::TFM_Bilinear;
+		textures[i].generateMipMaps();
+		if(i > 0)
+			textures[i].generateTiledLayout(formats[i]);
+	}
+
+	std::vector<float2> vertical(SAMPLE_COUNT), random(SAMPLE_COUNT);
+	srand(1);
+	for(int i = 0; i < SAMPLE_COUNT; i++)
+	{
+		uint line = (uint)i / size;
+		vertical[i] = float2((float)((line * 97) % size + 0.21f) / (float)size, ((float)(i % size) + 0.37f) / (float)size);
+		random[i] = float2((float)rand() / (float)RAND_MAX, (float)rand() / (float)RAND_MAX);
+	}
+
+	const char *names[2] = {"vertical", "random"};
+	const std::vector<float2> *positions[2] = {&vertical, &random};
+	float checksum = 0.f;
+
+	std::cout << size << "^2 texture, " << SAMPLE_COUNT << " samples, Msamples/s" << std::endl;
+	printf("%-10s %-10s %10s %10s\n", "", "", "bilinear", "footprint");
+	for(int i = 0; i < 2; i++)
+		for(int j = 0; j < LAYOUTS; j++)
+		{
+			Rates rates = measure(textures[j], *positions[i], size, checksum);
+			printf("%-10s %-10s %10.1f %10.1f\n", j == 0 ? names[i] : "", layoutNames[j], rates.bilinear, rates.footprint);
+		}
+	std::cout << "(checksum " << checksum << ")" << std::endl;
+
+	return 0;
+}
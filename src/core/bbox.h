@@ -61,6 +61,32 @@ struct BBox
 		max = *(Point*)&newMax;
 	}
 
+	//Shrinks the bounding box to its intersection with another bounding box.
+	//	The result is "empty" (min > max) if the boxes do not overlap
+	void clip(const BBox &_bbox)
+	{
+		float4 newMin = float4::max(float4(min), _bbox.min);
+		float4 newMax = float4::min(float4(max), _bbox.max);
+		min = *(Point*)&newMin;
+		max = *(Point*)&newMax;
+	}
+
+	//True if the box contains no points (min > max in some dimension)
+	bool isEmpty() const
+	{
+		return min.x > max.x || min.y > max.y || min.z > max.z;
+	}
+
+	//The surface area of the box. 0 for empty boxes
+	float area() const
+	{
+		if(isEmpty())
+			return 0.f;
+
+		Vector d = diagonal();
+		return 2.f * (d.x * d.y + d.y * d.z + d.z * d.x);
+	}
+
 	//Returns an "empty" bounding box. Extending such a bounding
 	//	box with a point will always create a bbox around the point
 	//	and with a bbox - will simply copy the bbox.
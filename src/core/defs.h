@@ -18,13 +18,19 @@ typedef unsigned long   ulong;
 //_FORCE_INLINE - force the compiler to inline a function if it supports it
 //_ALIGNOF - gets the alignment of a variable/structure
 
+//_HAS_SSE2 - defined if the SSE2 intrinsics (emmintrin.h) can be used
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define _HAS_SSE2
+#endif
+
 #ifdef __unix
 #define _THREAD_LOCAL __thread
 #define _FORCE_INLINE
 #define _ALIGNOF __alignof__
 #define modf modff
-#define _InterlockedIncrement(_X) __sync_fetch_and_add(_X, 1)
-#define _InterlockedDecrement(_X) __sync_fetch_and_sub(_X, 1)
+#define _InterlockedIncrement(_X) __sync_add_and_fetch(_X, 1)
+#define _InterlockedDecrement(_X) __sync_sub_and_fetch(_X, 1)
+#define _InterlockedCompareExchange(_X, _Exchange, _Comparand) __sync_val_compare_and_swap(_X, _Comparand, _Exchange)
 #else
 #define _THREAD_LOCAL __declspec(thread)
 #define _FORCE_INLINE __forceinline
@@ -0,0 +1,374 @@
+#ifndef __GRADIENT_NOISE_INCLUDED
+#define __GRADIENT_NOISE_INCLUDED
+
+#include "defs.h"
+
+#ifdef _HAS_SSE2
+#include <emmintrin.h>
+#endif
+
+// gradient noise (as in Perlin's improved noise) in 2D and 3D, summed over
+// octaves like Perlin does with its smoothed random grids.
+// the gradients come from a hash of the lattice point, so there are no
+// tables: nothing to generate and no memory growing with the octaves.
+// octave i has the frequency 2^i and repeats every width * 2^i lattice
+// cells, so the sum tiles at width in every direction.
+// with SSE2 four noise values are computed at once - four points of a batch,
+// or four octaves of a single point
+class GradientNoise
+{
+	enum {_MAX_OCTAVES = 32};
+
+	// per octave, padded to a multiple of 4 with zero frequencies and amplitudes
+	float frequency[_MAX_OCTAVES], period[_MAX_OCTAVES], invPeriod[_MAX_OCTAVES], amplitude[_MAX_OCTAVES];
+	uint octaveSeed[_MAX_OCTAVES];
+	int n_octaves;
+
+public:
+	uint width;
+
+	// same parameters as Perlin. _seed selects another noise
+	GradientNoise(uint _width, float _persistence, int _n_octaves, uint _seed = 0)
+	{
+		width = _width;
+		n_octaves = std::min(std::max(_n_octaves, 0), (int)_MAX_OCTAVES);
+		float f = 1, a = 1;
+		for(int i = 0; i < _MAX_OCTAVES; i++) {
+			frequency[i] = i < n_octaves ? f : 0.f;
+			period[i] = (float)width * f;
+			invPeriod[i] = 1.f / period[i];
+			amplitude[i] = i < n_octaves ? a : 0.f;
+			octaveSeed[i] = mix(_seed + (uint)i * 0x9E3779B9u);
+			f *= 2;
+			a *= _persistence;
+		}
+	}
+
+	float sample(float x, float y) const
+	{
+#ifdef _HAS_SSE2
+		// one octave per lane
+		__m128 total = _mm_setzero_ps();
+		for(int i = 0; i < n_octaves; i += 4) {
+			__m128 f = _mm_loadu_ps(frequency + i);
+			__m128 n = noise(_mm_mul_ps(_mm_set1_ps(x), f), _mm_mul_ps(_mm_set1_ps(y), f),
+				_mm_loadu_ps(period + i), _mm_loadu_ps(invPeriod + i), _mm_loadu_si128((const __m128i*)(octaveSeed + i)));
+			total = _mm_add_ps(total, _mm_mul_ps(n, _mm_loadu_ps(amplitude + i)));
+		}
+		return horizontalSum(total);
+#else
+		float total = 0;
+		for(int i = 0; i < n_octaves; i++)
+			total += noise(x * frequency[i], y * frequency[i], period[i], octaveSeed[i]) * amplitude[i];
+		return total;
+#endif
+	}
+
+	float sample(float x, float y, float z) const
+	{
+#ifdef _HAS_SSE2
+		__m128 total = _mm_setzero_ps();
+		for(int i = 0; i < n_octaves; i += 4) {
+			__m128 f = _mm_loadu_ps(frequency + i);
+			__m128 n = noise(_mm_mul_ps(_mm_set1_ps(x), f), _mm_mul_ps(_mm_set1_ps(y), f), _mm_mul_ps(_mm_set1_ps(z), f),
+				_mm_loadu_ps(period + i), _mm_loadu_ps(invPeriod + i), _mm_loadu_si128((const __m128i*)(octaveSeed + i)));
+			total = _mm_add_ps(total, _mm_mul_ps(n, _mm_loadu_ps(amplitude + i)));
+		}
+		return horizontalSum(total);
+#else
+		float total = 0;
+		for(int i = 0; i < n_octaves; i++)
+			total += noise(x * frequency[i], y * frequency[i], z * frequency[i], period[i], octaveSeed[i]) * amplitude[i];
+		return total;
+#endif
+	}
+
+	// samples _count points at once, _ret[i] = sample(_x[i], _y[i])
+	// up to rounding. four points share each evaluation of an octave
+	void sample(const float *_x, const float *_y, float *_ret, size_t _count) const
+	{
+#ifdef _HAS_SSE2
+		for(size_t i = 0; i < _count; i += 4) {
+			float x[4] = {0, 0, 0, 0}, y[4] = {0, 0, 0, 0}, ret[4];
+			size_t n = std::min(_count - i, (size_t)4);
+			std::copy(_x + i, _x + i + n, x);
+			std::copy(_y + i, _y + i + n, y);
+
+			__m128 px = _mm_loadu_ps(x), py = _mm_loadu_ps(y);
+			__m128 total = _mm_setzero_ps();
+			for(int o = 0; o < n_octaves; o++) {
+				__m128 f = _mm_set1_ps(frequency[o]);
+				__m128 n = noise(_mm_mul_ps(px, f), _mm_mul_ps(py, f),
+					_mm_set1_ps(period[o]), _mm_set1_ps(invPeriod[o]), _mm_set1_epi32((int)octaveSeed[o]));
+				total = _mm_add_ps(total, _mm_mul_ps(n, _mm_set1_ps(amplitude[o])));
+			}
+
+			_mm_storeu_ps(ret, total);
+			std::copy(ret, ret + n, _ret + i);
+		}
+#else
+		for(size_t i = 0; i < _count; i++)
+			_ret[i] = sample(_x[i], _y[i]);
+#endif
+	}
+
+	// the same in 3D
+	void sample(const float *_x, const float *_y, const float *_z, float *_ret, size_t _count) const
+	{
+#ifdef _HAS_SSE2
+		for(size_t i = 0; i < _count; i += 4) {
+			float x[4] = {0, 0, 0, 0}, y[4] = {0, 0, 0, 0}, z[4] = {0, 0, 0, 0}, ret[4];
+			size_t n = std::min(_count - i, (size_t)4);
+			std::copy(_x + i, _x + i + n, x);
+			std::copy(_y + i, _y + i + n, y);
+			std::copy(_z + i, _z + i + n, z);
+
+			__m128 px = _mm_loadu_ps(x), py = _mm_loadu_ps(y), pz = _mm_loadu_ps(z);
+			__m128 total = _mm_setzero_ps();
+			for(int o = 0; o < n_octaves; o++) {
+				__m128 f = _mm_set1_ps(frequency[o]);
+				__m128 n = noise(_mm_mul_ps(px, f), _mm_mul_ps(py, f), _mm_mul_ps(pz, f),
+					_mm_set1_ps(period[o]), _mm_set1_ps(invPeriod[o]), _mm_set1_epi32((int)octaveSeed[o]));
+				total = _mm_add_ps(total, _mm_mul_ps(n, _mm_set1_ps(amplitude[o])));
+			}
+
+			_mm_storeu_ps(ret, total);
+			std::copy(ret, ret + n, _ret + i);
+		}
+#else
+		for(size_t i = 0; i < _count; i++)
+			_ret[i] = sample(_x[i], _y[i], _z[i]);
+#endif
+	}
+
+private:
+	// hash constants of the lattice coordinates
+	static const uint _HASH_X = 0x8DA6B343u, _HASH_Y = 0xD8163841u, _HASH_Z = 0xCB1AB31Fu;
+
+	// scales one octave to about the spread of Perlin's smoothed random grids,
+	// so that the customize() functions of Perlin keep working
+	static float noiseScale2() { return 0.4f; }
+	static float noiseScale3() { return 0.71f; }
+
+	// murmur3 finalizer
+	static uint mix(uint h)
+	{
+		h ^= h >> 16;
+		h *= 0x85EBCA6Bu;
+		h ^= h >> 13;
+		h *= 0xC2B2AE35u;
+		return h ^ (h >> 16);
+	}
+
+	static float fade(float t)
+	{
+		return t * t * t * (t * (t * 6 - 15) + 10);
+	}
+
+	static float lerp(float t, float a, float b)
+	{
+		return a + t * (b - a);
+	}
+
+	// dot product with one of the gradients (+-1, +-2), (+-2, +-1),
+	// picked by the top bits of the hash
+	static float grad(uint hash, float x, float y)
+	{
+		uint g = hash >> 28;
+		float u = (g & 4) ? y : x, v = (g & 4) ? x : y;
+		return ((g & 1) ? -u : u) + ((g & 2) ? -2 * v : 2 * v);
+	}
+
+	// one of the 12 edge directions of a cube (and 4 repeated ones)
+	static float grad(uint hash, float x, float y, float z)
+	{
+		uint g = hash >> 28;
+		float u = g < 8 ? x : y;
+		float v = g < 4 ? y : ((g & 13) == 12 ? x : z);
+		return ((g & 1) ? -u : u) + ((g & 2) ? -v : v);
+	}
+
+	// the lattice cell of x wrapped to [0, period), the next one and the offset in it
+	static void cell(float x, float period, uint &lo, uint &hi, float &frac)
+	{
+		float fl = floor(x);
+		frac = x - fl;
+		float l = fl - period * floor(fl / period);
+		if(l >= period)
+			l -= period;
+		if(l < 0)
+			l += period;
+		lo = (uint)l;
+		hi = l + 1 < period ? lo + 1 : 0;
+	}
+
+	static float noise(float x, float y, float period, uint seed)
+	{
+		uint x0, x1, y0, y1;
+		float fx, fy;
+		cell(x, period, x0, x1, fx);
+		cell(y, period, y0, y1, fy);
+		uint hx0 = x0 * _HASH_X, hx1 = x1 * _HASH_X;
+		uint hy0 = seed ^ y0 * _HASH_Y, hy1 = seed ^ y1 * _HASH_Y;
+
+		float u = fade(fx), v = fade(fy);
+		return lerp(v,
+			lerp(u, grad(mix(hx0 ^ hy0), fx, fy), grad(mix(hx1 ^ hy0), fx - 1, fy)),
+			lerp(u, grad(mix(hx0 ^ hy1), fx, fy - 1), grad(mix(hx1 ^ hy1), fx - 1, fy - 1))) * noiseScale2();
+	}
+
+	static float noise(float x, float y, float z, float period, uint seed)
+	{
+		uint x0, x1, y0, y1, z0, z1;
+		float fx, fy, fz;
+		cell(x, period, x0, x1, fx);
+		cell(y, period, y0, y1, fy);
+		cell(z, period, z0, z1, fz);
+		uint hx0 = x0 * _HASH_X, hx1 = x1 * _HASH_X;
+		uint hy0 = y0 * _HASH_Y, hy1 = y1 * _HASH_Y;
+		uint hz0 = seed ^ z0 * _HASH_Z, hz1 = seed ^ z1 * _HASH_Z;
+
+		float u = fade(fx), v = fade(fy), w = fade(fz);
+		float n0 = lerp(v,
+			lerp(u, grad(mix(hx0 ^ hy0 ^ hz0), fx, fy, fz), grad(mix(hx1 ^ hy0 ^ hz0), fx - 1, fy, fz)),
+			lerp(u, grad(mix(hx0 ^ hy1 ^ hz0), fx, fy - 1, fz), grad(mix(hx1 ^ hy1 ^ hz0), fx - 1, fy - 1, fz)));
+		float n1 = lerp(v,
+			lerp(u, grad(mix(hx0 ^ hy0 ^ hz1), fx, fy, fz - 1), grad(mix(hx1 ^ hy0 ^ hz1), fx - 1, fy, fz - 1)),
+			lerp(u, grad(mix(hx0 ^ hy1 ^ hz1), fx, fy - 1, fz - 1), grad(mix(hx1 ^ hy1 ^ hz1), fx - 1, fy - 1, fz - 1)));
+		return lerp(w, n0, n1) * noiseScale3();
+	}
+
+#ifdef _HAS_SSE2
+	// the same for four lanes. the integer maths wraps around like uint
+	static __m128i mullo(__m128i a, __m128i b)
+	{
+		__m128i even = _mm_mul_epu32(a, b);
+		__m128i odd = _mm_mul_epu32(_mm_srli_si128(a, 4), _mm_srli_si128(b, 4));
+		return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+	}
+
+	static __m128i mix(__m128i h)
+	{
+		h = _mm_xor_si128(h, _mm_srli_epi32(h, 16));
+		h = mullo(h, _mm_set1_epi32((int)0x85EBCA6Bu));
+		h = _mm_xor_si128(h, _mm_srli_epi32(h, 13));
+		h = mullo(h, _mm_set1_epi32((int)0xC2B2AE35u));
+		return _mm_xor_si128(h, _mm_srli_epi32(h, 16));
+	}
+
+	static __m128 select(__m128 mask, __m128 a, __m128 b)
+	{
+		return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+	}
+
+	// only for |x| < 2^31
+	static __m128 floorLanes(__m128 x)
+	{
+		__m128 truncated = _mm_cvtepi32_ps(_mm_cvttps_epi32(x));
+		return _mm_sub_ps(truncated, _mm_and_ps(_mm_cmpgt_ps(truncated, x), _mm_set1_ps(1.f)));
+	}
+
+	static __m128 fade(__m128 t)
+	{
+		__m128 inner = _mm_add_ps(_mm_mul_ps(t, _mm_sub_ps(_mm_mul_ps(t, _mm_set1_ps(6.f)), _mm_set1_ps(15.f))), _mm_set1_ps(10.f));
+		return _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(t, t), t), inner);
+	}
+
+	static __m128 lerp(__m128 t, __m128 a, __m128 b)
+	{
+		return _mm_add_ps(a, _mm_mul_ps(t, _mm_sub_ps(b, a)));
+	}
+
+	// flips the sign of x where bit _BIT of g is set
+	template<int _BIT>
+	static __m128 flipSign(__m128i g, __m128 x)
+	{
+		return _mm_xor_ps(x, _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(g, _mm_set1_epi32(1 << _BIT)), 31 - _BIT)));
+	}
+
+	static __m128 grad(__m128i hash, __m128 x, __m128 y)
+	{
+		__m128i g = _mm_srli_epi32(hash, 28);
+		__m128 swap = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(g, _mm_set1_epi32(4)), _mm_set1_epi32(4)));
+		__m128 u = flipSign<0>(g, select(swap, y, x));
+		__m128 v = flipSign<1>(g, select(swap, x, y));
+		return _mm_add_ps(u, _mm_add_ps(v, v));
+	}
+
+	static __m128 grad(__m128i hash, __m128 x, __m128 y, __m128 z)
+	{
+		__m128i g = _mm_srli_epi32(hash, 28);
+		__m128 below8 = _mm_castsi128_ps(_mm_cmplt_epi32(g, _mm_set1_epi32(8)));
+		__m128 below4 = _mm_castsi128_ps(_mm_cmplt_epi32(g, _mm_set1_epi32(4)));
+		__m128 useX = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(g, _mm_set1_epi32(13)), _mm_set1_epi32(12)));
+		__m128 u = flipSign<0>(g, select(below8, x, y));
+		__m128 v = flipSign<1>(g, select(below4, y, select(useX, x, z)));
+		return _mm_add_ps(u, v);
+	}
+
+	static void cell(__m128 x, __m128 period, __m128 invPeriod, __m128i &lo, __m128i &hi, __m128 &frac)
+	{
+		__m128 fl = floorLanes(x);
+		frac = _mm_sub_ps(x, fl);
+		__m128 l = _mm_sub_ps(fl, _mm_mul_ps(period, floorLanes(_mm_mul_ps(fl, invPeriod))));
+		// the reciprocal can be off by one period
+		l = _mm_sub_ps(l, _mm_and_ps(_mm_cmpge_ps(l, period), period));
+		l = _mm_add_ps(l, _mm_and_ps(_mm_cmplt_ps(l, _mm_setzero_ps()), period));
+		__m128 h = _mm_add_ps(l, _mm_set1_ps(1.f));
+		h = _mm_andnot_ps(_mm_cmpge_ps(h, period), h);
+		lo = _mm_cvttps_epi32(l);
+		hi = _mm_cvttps_epi32(h);
+	}
+
+	static __m128 noise(__m128 x, __m128 y, __m128 period, __m128 invPeriod, __m128i seed)
+	{
+		__m128i x0, x1, y0, y1;
+		__m128 fx, fy;
+		cell(x, period, invPeriod, x0, x1, fx);
+		cell(y, period, invPeriod, y0, y1, fy);
+		__m128i hx0 = mullo(x0, _mm_set1_epi32((int)_HASH_X)), hx1 = mullo(x1, _mm_set1_epi32((int)_HASH_X));
+		__m128i hy0 = _mm_xor_si128(seed, mullo(y0, _mm_set1_epi32((int)_HASH_Y)));
+		__m128i hy1 = _mm_xor_si128(seed, mullo(y1, _mm_set1_epi32((int)_HASH_Y)));
+		__m128 fx1 = _mm_sub_ps(fx, _mm_set1_ps(1.f)), fy1 = _mm_sub_ps(fy, _mm_set1_ps(1.f));
+
+		__m128 u = fade(fx), v = fade(fy);
+		__m128 ret = lerp(v,
+			lerp(u, grad(mix(_mm_xor_si128(hx0, hy0)), fx, fy), grad(mix(_mm_xor_si128(hx1, hy0)), fx1, fy)),
+			lerp(u, grad(mix(_mm_xor_si128(hx0, hy1)), fx, fy1), grad(mix(_mm_xor_si128(hx1, hy1)), fx1, fy1)));
+		return _mm_mul_ps(ret, _mm_set1_ps(noiseScale2()));
+	}
+
+	static __m128 noise(__m128 x, __m128 y, __m128 z, __m128 period, __m128 invPeriod, __m128i seed)
+	{
+		__m128i x0, x1, y0, y1, z0, z1;
+		__m128 fx, fy, fz;
+		cell(x, period, invPeriod, x0, x1, fx);
+		cell(y, period, invPeriod, y0, y1, fy);
+		cell(z, period, invPeriod, z0, z1, fz);
+		__m128i hx0 = mullo(x0, _mm_set1_epi32((int)_HASH_X)), hx1 = mullo(x1, _mm_set1_epi32((int)_HASH_X));
+		__m128i hy0 = mullo(y0, _mm_set1_epi32((int)_HASH_Y)), hy1 = mullo(y1, _mm_set1_epi32((int)_HASH_Y));
+		__m128i hz0 = _mm_xor_si128(seed, mullo(z0, _mm_set1_epi32((int)_HASH_Z)));
+		__m128i hz1 = _mm_xor_si128(seed, mullo(z1, _mm_set1_epi32((int)_HASH_Z)));
+		__m128 fx1 = _mm_sub_ps(fx, _mm_set1_ps(1.f)), fy1 = _mm_sub_ps(fy, _mm_set1_ps(1.f)), fz1 = _mm_sub_ps(fz, _mm_set1_ps(1.f));
+		__m128i h00 = _mm_xor_si128(hx0, hy0), h10 = _mm_xor_si128(hx1, hy0);
+		__m128i h01 = _mm_xor_si128(hx0, hy1), h11 = _mm_xor_si128(hx1, hy1);
+
+		__m128 u = fade(fx), v = fade(fy), w = fade(fz);
+		__m128 n0 = lerp(v,
+			lerp(u, grad(mix(_mm_xor_si128(h00, hz0)), fx, fy, fz), grad(mix(_mm_xor_si128(h10, hz0)), fx1, fy, fz)),
+			lerp(u, grad(mix(_mm_xor_si128(h01, hz0)), fx, fy1, fz), grad(mix(_mm_xor_si128(h11, hz0)), fx1, fy1, fz)));
+		__m128 n1 = lerp(v,
+			lerp(u, grad(mix(_mm_xor_si128(h00, hz1)), fx, fy, fz1), grad(mix(_mm_xor_si128(h10, hz1)), fx1, fy, fz1)),
+			lerp(u, grad(mix(_mm_xor_si128(h01, hz1)), fx, fy1, fz1), grad(mix(_mm_xor_si128(h11, hz1)), fx1, fy1, fz1)));
+		return _mm_mul_ps(lerp(w, n0, n1), _mm_set1_ps(noiseScale3()));
+	}
+
+	static float horizontalSum(__m128 v)
+	{
+		__m128 pairs = _mm_add_ps(v, _mm_movehl_ps(v, v));
+		return _mm_cvtss_f32(_mm_add_ss(pairs, _mm_shuffle_ps(pairs, pairs, 1)));
+	}
+#endif
+};
+
+#endif //__GRADIENT_NOISE_INCLUDED
@@ -243,12 +243,23 @@ public:
 #else
 		long ret = --m_refCnt;
 #endif
-		if(m_refCnt == 0)
+		//Not m_refCnt: another thread may release its reference in between
+		if(ret == 0)
 			delete this;
 
 		return ret;
 	}
 
+	//The current number of references. Read atomically, other threads
+	//	may add or release references at the same time
+	long getRefCount() const
+	{
+		long ret;
+#pragma omp atomic read
+		ret = m_refCnt;
+		return ret;
+	}
+
 	RefCntBase& operator=(const RefCntBase& _other)
 	{
 		return *this;
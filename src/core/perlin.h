@@ -3,6 +3,7 @@
 
 #include "../core/array2.h"
 #include "memory.h"
+#include "gradient_noise.h"
 
 // 2D smoothed noise
 // to 2 mimic pseudo generating functions we save random values in an 2d array
@@ -51,39 +52,70 @@ public:
 		return corners + sides + center;
 	}
 
+	// writes smoothedSample(x, y) for x, y in [0, width] row by row,
+	// (width + 1) values per row. lookups in the result take one read
+	// instead of nine
+	void smooth(float *_grid) const
+	{
+		for(uint y = 0; y <= width; y++)
+			for(uint x = 0; x <= width; x++)
+				_grid[y * (width + 1) + x] = smoothedSample(x, y);
+	}
 };
 
 
 class Perlin: public RefCntBase
 {
+public:
+	// the noise added up over the octaves
+	enum Basis
+	{
+		PB_SmoothedValue, // a grid of smoothed random values per octave, see SmoothNoise
+		PB_Gradient, // GradientNoise, without grids. noise() is not called then
+	};
+
 private:
+	enum {_CACHE_LINE_FLOATS = 16};
+
 	float persistence;
-	std::vector<SmoothNoise> noises;
+	// the smoothed noise of all octaves in one block, see SmoothNoise::smooth.
+	// octave i starts at gridOffsets[i], on a cache line, and has rows of
+	// gridWidths[i] values
+	std::vector<float> grids;
+	std::vector<size_t> gridOffsets;
+	std::vector<uint> gridWidths;
 	int n_octaves;
+	Basis basis;
+	// the smoothed random grids have features of about four cells, gradient
+	// noise of about one. so that both look alike, the gradient lattice is
+	// four times coarser, still repeating at width
+	GradientNoise gradient;
+	float gradientScale;
 public:
 	uint width;
 
 	// how many samplas we want - it grows quadratically
 	// persistence determines frequency and amplitude
 	// _n_octaves - how many functions we want to add
-	Perlin(uint _width, float _persistence, int _n_octaves) 
+	Perlin(uint _width, float _persistence, int _n_octaves, Basis _basis = PB_SmoothedValue) 
+		: gradient(std::max(_width / 4, 1u), _persistence, _n_octaves)
 	{
 		width = _width;
 		n_octaves = _n_octaves;
 		persistence = _persistence;
-		uint w = width;
-		// we generate n_octaves noises
-		for(int i = 1; i <= n_octaves; i++) {
-			noises.push_back(SmoothNoise(w));
-			w *= 2;
-		}
-		
+		basis = _basis;
+		gradientScale = (float)gradient.width / (float)width;
+		if(basis == PB_SmoothedValue)
+			generateGrids();
 	}
 	
 	// main method, for taking samples. we add functions
 	// of different frequencies and amplitudes
 	float sample(float x, float y) const
 	{
+		if(basis == PB_Gradient)
+			return customize(x, y, gradient.sample(x * gradientScale, y * gradientScale));
+
 		float frequency = 1;
 		float amplitude = 1;
 		float total = 0.0f;
@@ -95,6 +127,26 @@ public:
 		return customize(x, y, total);
 	}
 
+	// _ret[i] = sample(_x[i], _y[i]). with PB_Gradient the octaves are
+	// evaluated for four points at once
+	void sample(const float *_x, const float *_y, float *_ret, size_t _count) const
+	{
+		if(basis == PB_Gradient && _count > 0) {
+			std::vector<float> x(_x, _x + _count), y(_y, _y + _count);
+			for(size_t i = 0; i < _count; i++) {
+				x[i] *= gradientScale;
+				y[i] *= gradientScale;
+			}
+			gradient.sample(&x[0], &y[0], _ret, _count);
+			for(size_t i = 0; i < _count; i++)
+				_ret[i] = customize(_x[i], _y[i], _ret[i]);
+			return;
+		}
+
+		for(size_t i = 0; i < _count; i++)
+			_ret[i] = sample(_x[i], _y[i]);
+	}
+
 protected:
 
 	// just a wrapper, children could override it
@@ -109,6 +161,31 @@ protected:
 		return (total + 1.0) / 2.0;
 	}
 	
+	// the random values of each octave are only kept until they are smoothed
+	void generateGrids()
+	{
+		size_t size = _CACHE_LINE_FLOATS;
+		uint w = width;
+		for(int i = 0; i < n_octaves; i++) {
+			gridOffsets.push_back(size);
+			gridWidths.push_back(w + 1);
+			size += ((size_t)(w + 1) * (w + 1) + _CACHE_LINE_FLOATS - 1) / _CACHE_LINE_FLOATS * _CACHE_LINE_FLOATS;
+			w *= 2;
+		}
+
+		grids.resize(size);
+		size_t misalignment = ((size_t)&grids[0] / sizeof(float)) % _CACHE_LINE_FLOATS;
+		size_t shift = misalignment == 0 ? 0 : _CACHE_LINE_FLOATS - misalignment;
+
+		// we generate n_octaves noises
+		w = width;
+		for(int i = 0; i < n_octaves; i++) {
+			gridOffsets[i] -= shift;
+			SmoothNoise(w).smooth(&grids[gridOffsets[i]]);
+			w *= 2;
+		}
+	}
+
 	float linearInterpolation(float fx, float fy, float fraction) const
 	{
 		return (1 - fraction) * fx + fraction * fy;
@@ -121,8 +198,12 @@ protected:
 		int y = (int)fy;
 		float fractionx = fx - x;
 		float fractiony = fy - y;
-		float l1 = linearInterpolation(noises[noise_i].smoothedSample(x, y), noises[noise_i].smoothedSample(x + 1, y), fractionx);
-		float l2 = linearInterpolation(noises[noise_i].smoothedSample(x, y + 1), noises[noise_i].smoothedSample(x + 1, y + 1), fractionx);
+		uint gridWidth = gridWidths[noise_i];
+		_ASSERT(x >= 0 && y >= 0 && (uint)x + 1 < gridWidth && (uint)y + 1 < gridWidth);
+		const float *row0 = &grids[gridOffsets[noise_i] + (size_t)y * gridWidth + x];
+		const float *row1 = row0 + gridWidth;
+		float l1 = linearInterpolation(row0[0], row0[1], fractionx);
+		float l2 = linearInterpolation(row1[0], row1[1], fractionx);
 		float li = linearInterpolation(l1, l2, fractiony);	
 		return li;
 	}
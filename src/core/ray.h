@@ -6,20 +6,51 @@
 
 #include "algebra.h"
 
+//The change of ~_v when _v changes by _dv
+inline Vector normalizedDifferential(const Vector &_v, const Vector &_dv)
+{
+	float len2 = _v * _v;
+	return (len2 * _dv - (_v * _dv) * _v) / (len2 * sqrtf(len2));
+}
+
 //A ray class
 struct Ray
 {
 	Point o; //origin
 	Vector d; //direction
 
-	Ray() {}
+	//Optional ray differentials: the change of the origin and of the direction 
+	//	from one pixel to the next in x and y. Used to estimate the footprint 
+	//	of a pixel on the surfaces, e.g. for texture filtering
+	bool hasDifferentials;
+	Vector dodx, dody, dddx, dddy;
+
+	Ray() : hasDifferentials(false) {}
 	Ray(const Point &_o, const Vector &_d)
-		: o(_o), d(_d) {}
+		: o(_o), d(_d), hasDifferentials(false) {}
 
 	Point getPoint(float _distance)
 	{
 		return o + _distance * d;
 	}
+
+	//Transfers the differentials to the hit point at _distance, on a surface
+	//	with the (not necessarily normalized) normal _normal. Returns the change 
+	//	of the hit point from one pixel to the next in x and y
+	//Details: Igehy - Tracing Ray Differentials, SIGGRAPH 1999
+	void transferDifferentials(float _distance, const Vector &_normal, Vector &_dPdx, Vector &_dPdy) const
+	{
+		_dPdx = dodx + _distance * dddx;
+		_dPdy = dody + _distance * dddy;
+
+		//Move the points back onto the plane of the surface
+		float dn = d * _normal;
+		if(dn != 0.f)
+		{
+			_dPdx -= (_dPdx * _normal / dn) * d;
+			_dPdy -= (_dPdy * _normal / dn) * d;
+		}
+	}
 };
 
 
@@ -0,0 +1,193 @@
+#include "stdafx.h"
+#include "tile_cache.h"
+
+#ifdef __unix
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace tile_cache_internal
+{
+#ifdef __unix
+	//Advises the kernel about the whole pages in [_begin, _end)
+	void adviseRange(const void *_begin, const void *_end, int _advice)
+	{
+		size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+		size_t begin = ((size_t)_begin + pageSize - 1) / pageSize * pageSize;
+		size_t end = (size_t)_end / pageSize * pageSize;
+		if(begin < end)
+			madvise((void*)begin, end - begin, _advice);
+	}
+#endif
+}
+
+using namespace tile_cache_internal;
+
+TileCache::TileCache(size_t _residentBudget) : m_useCounter(1)
+{
+	memset(&m_stats, 0, sizeof(m_stats));
+	m_stats.residentBudget = _residentBudget;
+}
+
+TileCache::~TileCache()
+{
+#ifdef __unix
+	for(size_t i = 0; i < m_mappings.size(); i++)
+		munmap(m_mappings[i].first, m_mappings[i].second);
+#endif
+}
+
+const byte* TileCache::mapFile(const std::string &_fileName, size_t &_size)
+{
+	_size = 0;
+
+#ifdef __unix
+	int fd = open(_fileName.c_str(), O_RDONLY);
+	if(fd < 0)
+		return NULL;
+
+	struct stat st;
+	void *mapping = MAP_FAILED;
+	if(fstat(fd, &st) == 0 && st.st_size > 0)
+		mapping = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if(mapping == MAP_FAILED)
+		return NULL;
+
+	//The blocks are paged in on demand, in no particular order
+	adviseRange(mapping, (const byte*)mapping + st.st_size, MADV_RANDOM);
+	_size = (size_t)st.st_size;
+
+#pragma omp critical (TileCache)
+	m_mappings.push_back(std::make_pair(mapping, _size));
+
+	return (const byte*)mapping;
+#else
+	std::ifstream input(_fileName.c_str(), std::ios_base::in | std::ios_base::binary);
+	if(input.fail())
+		return NULL;
+
+	std::vector<byte> contents((std::istreambuf_iterator<char>(input)), std::istreambuf_iterator<char>());
+	if(contents.empty())
+		return NULL;
+
+	const byte *ret = NULL;
+#pragma omp critical (TileCache)
+	{
+		m_fileContents.push_back(std::vector<byte>());
+		m_fileContents.back().swap(contents);
+		ret = &m_fileContents.back().front();
+		_size = m_fileContents.back().size();
+	}
+	return ret;
+#endif
+}
+
+size_t TileCache::addBlocks(const byte *_blocks, size_t _blockCount, size_t _blockBytes)
+{
+	size_t ret;
+
+#pragma omp critical (TileCache)
+	{
+		ret = m_lastUse.size();
+		BlockRange range = {_blocks, ret, _blockBytes};
+		m_ranges.push_back(range);
+		m_lastUse.resize(ret + _blockCount, 0);
+	}
+
+	return ret;
+}
+
+const byte* TileCache::getBlock(size_t _block, size_t &_bytes) const
+{
+	//The last range starting at or before _block
+	size_t lo = 0, hi = m_ranges.size();
+	while(hi - lo > 1)
+	{
+		size_t mid = (lo + hi) / 2;
+		if(m_ranges[mid].firstBlock <= _block)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	_bytes = m_ranges[lo].blockBytes;
+	return m_ranges[lo].data + (_block - m_ranges[lo].firstBlock) * _bytes;
+}
+
+void TileCache::pageIn(size_t _block)
+{
+#pragma omp critical (TileCache)
+	{
+		//The entries only change from and to 0 here and in evict()
+		if(m_lastUse[_block] == 0)
+		{
+			size_t bytes;
+			const byte *data = getBlock(_block, bytes);
+#ifdef __unix
+			adviseRange(data, data + bytes, MADV_WILLNEED);
+#endif
+			m_stats.misses++;
+			m_stats.residentBytes += bytes;
+			m_resident.push_back(_block);
+
+			long useCounter = m_useCounter + 1;
+#pragma omp atomic write
+			m_useCounter = useCounter;
+#pragma omp atomic write
+			m_lastUse[_block] = useCounter;
+
+			if(m_stats.residentBytes > m_stats.residentBudget)
+				evict();
+		}
+		else
+		{
+#pragma omp atomic write
+			m_lastUse[_block] = m_useCounter;
+#pragma omp atomic
+			m_stats.hits++;
+		}
+	}
+}
+
+//Releases the least recently used blocks until a quarter of the budget
+//	is free. Freeing more than needed keeps the sort off most misses.
+//	The block which was just paged in, the last one in m_resident, stays.
+//	The lookups keep updating m_lastUse, so the order is that of a snapshot.
+void TileCache::evict()
+{
+	size_t newBlock = m_resident.back();
+	std::vector<std::pair<long, size_t> > byLastUse(m_resident.size() - 1);
+	for(size_t i = 0; i < byLastUse.size(); i++)
+	{
+		long lastUse;
+#pragma omp atomic read
+		lastUse = m_lastUse[m_resident[i]];
+		byLastUse[i] = std::make_pair(lastUse, m_resident[i]);
+	}
+	std::sort(byLastUse.begin(), byLastUse.end());
+
+	size_t target = m_stats.residentBudget / 4 * 3;
+	size_t released = 0;
+	while(m_stats.residentBytes > target && released < byLastUse.size())
+	{
+		size_t block = byLastUse[released++].second;
+		size_t bytes;
+		const byte *data = getBlock(block, bytes);
+#ifdef __unix
+		adviseRange(data, data + bytes, MADV_DONTNEED);
+#endif
+#pragma omp atomic write
+		m_lastUse[block] = 0;
+		m_stats.residentBytes -= bytes;
+		m_stats.evictions++;
+	}
+
+	m_resident.clear();
+	for(size_t i = released; i < byLastUse.size(); i++)
+		m_resident.push_back(byLastUse[i].second);
+	m_resident.push_back(newBlock);
+}
@@ -0,0 +1,101 @@
+#ifndef __INCLUDE_GUARD_49BE4F3C_DA5D_4BAB_9A53_62F40030AD58
+#define __INCLUDE_GUARD_49BE4F3C_DA5D_4BAB_9A53_62F40030AD58
+#ifdef _MSC_VER
+	#pragma once
+#endif
+
+#include "defs.h"
+#include "memory.h"
+
+//Memory mapped, read-only files of blocks (e.g. the texture tiles, see
+//	Texture::writeTiles) with one LRU of the resident blocks of all files.
+//	When the resident blocks exceed the budget, the pages of the least
+//	recently used ones are released. The mappings stay valid: a lookup
+//	of a released block gets its pages back from the file.
+class TileCache : public RefCntBase
+{
+public:
+	struct Stats
+	{
+		size_t hits; // lookups of resident blocks
+		size_t misses; // lookups which paged a block in
+		size_t evictions;
+		size_t residentBytes, residentBudget;
+
+		void print() const
+		{
+			std::cout << "Tile cache: " << hits << " hits, " << misses << " misses, "
+				<< evictions << " evictions, " << residentBytes / 1024 << " of " << residentBudget / 1024
+				<< " KB resident" << std::endl;
+		}
+	};
+
+	explicit TileCache(size_t _residentBudget);
+	~TileCache();
+
+	//Maps a whole file. NULL if it cannot be opened. The mapping lives as long as the cache
+	const byte* mapFile(const std::string &_fileName, size_t &_size);
+
+	//Adds _blockCount blocks of _blockBytes bytes each, starting at _blocks in one
+	//	of the mappings. Returns the id of the first one, the others follow.
+	//	Not while other threads do lookups
+	size_t addBlocks(const byte *_blocks, size_t _blockCount, size_t _blockBytes);
+
+	//Called on every lookup in a block
+	void touch(size_t _block)
+	{
+		//A stale read only means an extra trip through pageIn(), or
+		//	counting a hit on a block which was just released
+		long lastUse, useCounter;
+#pragma omp atomic read
+		lastUse = m_lastUse[_block];
+
+		if(lastUse != 0)
+		{
+#pragma omp atomic read
+			useCounter = m_useCounter;
+			//Fails if the block was released in the meantime, a plain store 
+			//	would mark it resident again without paging it in
+			if(useCounter != lastUse)
+				_InterlockedCompareExchange(&m_lastUse[_block], useCounter, lastUse);
+#pragma omp atomic
+			m_stats.hits++;
+		}
+		else
+			pageIn(_block);
+	}
+
+	const Stats& getStats() const { return m_stats; }
+
+private:
+	struct BlockRange
+	{
+		const byte *data;
+		size_t firstBlock, blockBytes;
+	};
+
+	//Sorted by firstBlock
+	std::vector<BlockRange> m_ranges;
+	//Per block, 0 if it is not resident. Otherwise the value of m_useCounter
+	//	at the last lookup. The counter only advances on misses: the order
+	//	of blocks used between two misses does not matter. The lookups 
+	//	update the entries without the lock, only atomically
+	std::vector<long> m_lastUse;
+	std::vector<size_t> m_resident;
+	long m_useCounter;
+	Stats m_stats;
+
+	std::vector<std::pair<void*, size_t> > m_mappings;
+	//Without mmap the files are read into memory, the cache only keeps the statistics
+	std::vector<std::vector<byte> > m_fileContents;
+
+	void pageIn(size_t _block);
+	void evict();
+	const byte* getBlock(size_t _block, size_t &_bytes) const;
+
+	TileCache(const TileCache&);
+	TileCache& operator=(const TileCache&);
+};
+
+
+#endif //__INCLUDE_GUARD_49BE4F3C_DA5D_4BAB_9A53_62F40030AD58
@@ -0,0 +1,316 @@
+#ifndef __INCLUDE_GUARD_4792ABDA_2095_48CA_9A24_F029A0EBA9CC
+#define __INCLUDE_GUARD_4792ABDA_2095_48CA_9A24_F029A0EBA9CC
+#ifdef _MSC_VER
+	#pragma once
+#endif
+
+#include "image.h"
+#include "tile_cache.h"
+
+//A read-only copy of an image in square tiles of TILE_SIZE x TILE_SIZE texels, 
+//	for texture lookups. Texels close to each other in x or in y are close 
+//	in memory, so lookups which run along y do not touch a new cache line 
+//	for every texel, as they do in the row major Image.
+//Inside a tile the texels are in Morton (Z) order. With float4 texels each 
+//	2x2 block aligned to even coordinates fills one 64 byte cache line, 
+//	with 8 bit RGBA texels a whole tile does.
+//The texels can be stored with less precision than float4, see Format. 
+//	The lookups convert them back to float4.
+//The tiles are grouped into square blocks, stored one after the other in row 
+//	major order. A block is a whole number of 4 KB pages for every format, so 
+//	an image mapped from a file can be paged in and out block by block, 
+//	see TileCache.
+class TiledImage : public RefCntBase
+{
+public:
+	enum {TILE_SIZE = 4, TILE_TEXELS = TILE_SIZE * TILE_SIZE, BLOCK_ALIGNMENT = 4096};
+
+	//How the texels are stored
+	enum Format
+	{
+		TF_RGBA32F, //float4, as in Image
+		TF_RGBA16F, //Half floats, for HDR images. Values below 2^-14 become 0
+		TF_RGBA8, //8 bits per component, for values in 0..1
+		TF_RGB8, //The same without .w, which is 0 on lookup
+		TF_R8, //Only .x, returned in .x, .y and .z. For bump maps
+		TF_RG16F, //Half floats in .x and .y, .z and .w are 0. For derivative maps
+	};
+
+private:
+	enum {_CACHE_LINE = 64};
+
+	std::vector<byte> m_storage;
+	//The first block, aligned to a cache line within m_storage or in a mapped file
+	const byte *m_blocks;
+	Format m_format;
+	uint m_texelSize;
+	uint m_width, m_height;
+	//A block has (1 << m_blockShift)^2 texels
+	uint m_blockShift;
+	uint m_blocksX, m_blocksY;
+	size_t m_blockBytes;
+
+	//Only for images in a mapped file: the cache which keeps the file 
+	//	mapped, and the id of the first block there. The lookups update it
+	mutable SmartPtr<TileCache> m_cache;
+	size_t m_firstCacheBlock;
+
+	//m_blocks points into m_storage
+	TiledImage(const TiledImage&);
+	TiledImage& operator=(const TiledImage&);
+
+	void init(uint _width, uint _height, Format _format)
+	{
+		m_format = _format;
+		m_texelSize = texelSize(_format);
+		m_width = _width;
+		m_height = _height;
+		m_blockShift = blockShift(_format);
+		m_blocksX = (_width + (1 << m_blockShift) - 1) >> m_blockShift;
+		m_blocksY = (_height + (1 << m_blockShift) - 1) >> m_blockShift;
+		m_blockBytes = (size_t)m_texelSize << (2 * m_blockShift);
+		m_firstCacheBlock = 0;
+	}
+
+public:
+	TiledImage() : m_blocks(NULL)
+	{
+		init(0, 0, TF_RGBA32F);
+	}
+
+	//The image is padded to whole blocks by repeating its last column and row
+	explicit TiledImage(const Image &_image, Format _format = TF_RGBA32F)
+	{
+		init(_image.width(), _image.height(), _format);
+
+		m_storage.resize(byteSize() + _CACHE_LINE - 1);
+		size_t misalignment = (size_t)&m_storage[0] % _CACHE_LINE;
+		byte *blocks = &m_storage[0] + (misalignment == 0 ? 0 : _CACHE_LINE - misalignment);
+		m_blocks = blocks;
+
+		if(m_width == 0 || m_height == 0)
+			return;
+
+		for(uint y = 0; y < m_blocksY << m_blockShift; y++)
+			for(uint x = 0; x < m_blocksX << m_blockShift; x++)
+				storeTexel(blocks + rowOffset(y) + columnOffset(x), 
+					_image(std::min(x, m_width - 1), std::min(y, m_height - 1)));
+	}
+
+	//An image in a file mapped by _cache, as written from getBlocks(). 
+	//	_cache pages its blocks in and out
+	TiledImage(const byte *_blocks, uint _width, uint _height, Format _format, TileCache *_cache)
+		: m_blocks(_blocks), m_cache(_cache)
+	{
+		init(_width, _height, _format);
+		m_firstCacheBlock = _cache->addBlocks(_blocks, (size_t)m_blocksX * m_blocksY, m_blockBytes);
+	}
+
+	uint width() const {return m_width;}
+	uint height() const {return m_height;}
+	Format format() const {return m_format;}
+
+	//The blocks, byteSize() bytes, including the padding
+	const byte* getBlocks() const {return m_blocks;}
+	size_t byteSize() const {return (size_t)m_blocksX * m_blocksY * m_blockBytes;}
+
+	float4 operator() (uint _x, uint _y) const
+	{
+		_ASSERT(_x < m_width && _y < m_height);
+		if(m_cache.data() != NULL)
+			m_cache->touch(m_firstCacheBlock + blockIndex(_x, _y));
+
+		return loadTexel(m_blocks + rowOffset(_y) + columnOffset(_x));
+	}
+
+	//The 2x2 texels of a bilinear lookup, (_x[0], _y[0]), (_x[1], _y[0]), 
+	//	(_x[0], _y[1]) and (_x[1], _y[1]). Cheaper than four lookups: the 
+	//	offsets are computed once per column and row, the cache is touched 
+	//	once per block and the format is the same for all four
+	void quad(const uint _x[2], const uint _y[2], float4 _texels[4]) const
+	{
+		_ASSERT(_x[0] < m_width && _x[1] < m_width && _y[0] < m_height && _y[1] < m_height);
+		if(m_cache.data() != NULL)
+		{
+			size_t lastBlock = (size_t)-1;
+			for(int i = 0; i < 4; i++)
+			{
+				size_t block = blockIndex(_x[i & 1], _y[i >> 1]);
+				if(block != lastBlock)
+					m_cache->touch(m_firstCacheBlock + block);
+				lastBlock = block;
+			}
+		}
+
+		size_t columns[2] = {columnOffset(_x[0]), columnOffset(_x[1])};
+		const byte *rows[2] = {m_blocks + rowOffset(_y[0]), m_blocks + rowOffset(_y[1])};
+		const byte *texels[4] = {rows[0] + columns[0], rows[0] + columns[1], rows[1] + columns[0], rows[1] + columns[1]};
+
+		if(m_format == TF_RGBA32F)
+		{
+			for(int i = 0; i < 4; i++)
+				_texels[i] = *(const float4*)texels[i];
+			return;
+		}
+
+		for(int i = 0; i < 4; i++)
+			_texels[i] = loadTexel(texels[i]);
+	}
+
+	static uint texelSize(Format _format)
+	{
+		switch(_format)
+		{
+		case TF_RGBA32F: return sizeof(float4);
+		case TF_RGBA16F: return 4 * sizeof(ushort);
+		case TF_RGBA8: return 4;
+		case TF_RGB8: return 3;
+		case TF_RG16F: return 2 * sizeof(ushort);
+		default: return 1;
+		}
+	}
+
+	//IEEE 754 half precision. Rounds to nearest, flushes denormals to 0
+	static ushort floatToHalf(float _value)
+	{
+		union {float f; uint u;} bits;
+		bits.f = _value;
+		uint sign = (bits.u >> 16) & 0x8000;
+		uint mantissa = bits.u & 0x7FFFFF;
+		int exponent = (int)((bits.u >> 23) & 0xFF) - 127 + 15;
+
+		if(((bits.u >> 23) & 0xFF) == 0xFF) //Infinity or NaN
+			return (ushort)(sign | 0x7C00 | (mantissa != 0 ? 0x200 : 0));
+		if(exponent <= 0)
+			return (ushort)sign;
+		if(exponent >= 31)
+			return (ushort)(sign | 0x7C00);
+
+		//A carry out of the mantissa correctly increments the exponent
+		uint ret = sign | ((uint)exponent << 10) | (mantissa >> 13);
+		if((mantissa & 0x1000) != 0)
+			ret++;
+		return (ushort)ret;
+	}
+
+	static float halfToFloat(ushort _value)
+	{
+		union {float f; uint u;} bits;
+		uint sign = (uint)(_value & 0x8000) << 16;
+		uint exponent = (_value >> 10) & 0x1F, mantissa = _value & 0x3FF;
+
+		if(exponent == 0)
+			bits.u = sign;
+		else if(exponent == 31)
+			bits.u = sign | 0x7F800000 | (mantissa << 13);
+		else
+			bits.u = sign | ((exponent - 15 + 127) << 23) | (mantissa << 13);
+		return bits.f;
+	}
+
+	//log2 of the block size in texels: 64 x 64 texels for formats of up to 3 
+	//	bytes, 32 x 32 for the others. Either way a multiple of BLOCK_ALIGNMENT bytes
+	static uint blockShift(Format _format)
+	{
+		return texelSize(_format) < 4 ? 6 : 5;
+	}
+
+private:
+	size_t blockIndex(uint _x, uint _y) const
+	{
+		return (size_t)(_y >> m_blockShift) * m_blocksX + (_x >> m_blockShift);
+	}
+
+	//The byte offset of a texel from m_blocks is the sum of a part which 
+	//	depends only on x and one which depends only on y: the blocks are 
+	//	in row major order, so are the tiles in a block, and the Morton 
+	//	order interleaves the bits of x and y
+	size_t columnOffset(uint _x) const
+	{
+		uint inBlock = _x & ((1 << m_blockShift) - 1);
+		uint inTile = (_x & 1) | ((_x & 2) << 1);
+		return (size_t)(_x >> m_blockShift) * m_blockBytes 
+			+ (size_t)((inBlock / TILE_SIZE) * TILE_TEXELS + inTile) * m_texelSize;
+	}
+
+	size_t rowOffset(uint _y) const
+	{
+		uint inBlock = _y & ((1 << m_blockShift) - 1);
+		uint inTile = ((_y & 1) << 1) | ((_y & 2) << 2);
+		return (size_t)(_y >> m_blockShift) * m_blocksX * m_blockBytes 
+			+ (size_t)(((inBlock / TILE_SIZE) << (m_blockShift - 2)) * TILE_TEXELS + inTile) * m_texelSize;
+	}
+
+	//Values which do not fit the format are clamped
+	static byte toByte(float _value)
+	{
+		return (byte)(std::min(std::max(_value, 0.f), 1.f) * 255.f + 0.5f);
+	}
+
+	float4 loadTexel(const byte *_texel) const
+	{
+		switch(m_format)
+		{
+		case TF_RGBA32F:
+			return *(const float4*)_texel;
+		case TF_RGBA16F:
+			{
+				const ushort *half = (const ushort*)_texel;
+				return float4(halfToFloat(half[0]), halfToFloat(half[1]), halfToFloat(half[2]), halfToFloat(half[3]));
+			}
+		case TF_RGBA8:
+			return float4((float)_texel[0] / 255.f, (float)_texel[1] / 255.f, (float)_texel[2] / 255.f, (float)_texel[3] / 255.f);
+		case TF_RGB8:
+			return float4((float)_texel[0] / 255.f, (float)_texel[1] / 255.f, (float)_texel[2] / 255.f, 0.f);
+		case TF_RG16F:
+			{
+				const ushort *half = (const ushort*)_texel;
+				return float4(halfToFloat(half[0]), halfToFloat(half[1]), 0.f, 0.f);
+			}
+		default:
+			{
+				float value = (float)_texel[0] / 255.f;
+				return float4(value, value, value, 0.f);
+			}
+		}
+	}
+
+	void storeTexel(byte *_texel, const float4 &_value) const
+	{
+		switch(m_format)
+		{
+		case TF_RGBA32F:
+			*(float4*)_texel = _value;
+			break;
+		case TF_RGBA16F:
+			{
+				ushort *half = (ushort*)_texel;
+				half[0] = floatToHalf(_value.x);
+				half[1] = floatToHalf(_value.y);
+				half[2] = floatToHalf(_value.z);
+				half[3] = floatToHalf(_value.w);
+				break;
+			}
+		case TF_RGBA8:
+			_texel[0] = toByte(_value.x);
+			_texel[1] = toByte(_value.y);
+			_texel[2] = toByte(_value.z);
+			_texel[3] = toByte(_value.w);
+			break;
+		case TF_RGB8:
+			_texel[0] = toByte(_value.x);
+			_texel[1] = toByte(_value.y);
+			_texel[2] = toByte(_value.z);
+			break;
+		case TF_RG16F:
+			((ushort*)_texel)[0] = floatToHalf(_value.x);
+			((ushort*)_texel)[1] = floatToHalf(_value.y);
+			break;
+		default:
+			_texel[0] = toByte(_value.x);
+		}
+	}
+};
+
+
+#endif //__INCLUDE_GUARD_4792ABDA_2095_48CA_9A24_F029A0EBA9CC
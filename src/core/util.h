@@ -5,6 +5,7 @@
 #endif
 
 #include "../core/algebra.h"
+#include "../core/bbox.h"
 
 //This routine intersects a ray with a triangle
 //Returns:
@@ -39,4 +40,167 @@ inline float4 intersectTriangle(
 	return ret;
 }
 
+//The ray differentials transferred to a hit on a triangle, see Ray::hasDifferentials
+struct TriangleHitDifferentials
+{
+	//The change of the hit point from one pixel to the next in x and y
+	Vector dPdx, dPdy;
+	//The same as the change of the weights of the second and the third vertex
+	float2 dBdx, dBdy;
+
+	//For a hit of _ray at _distance. All zero if the ray has no differentials
+	TriangleHitDifferentials(
+		const Point &_p1, const Point &_p2, const Point &_p3,
+		const Ray &_ray, float _distance)
+		: dPdx(0, 0, 0), dPdy(0, 0, 0), dBdx(0, 0), dBdy(0, 0)
+	{
+		Vector e1 = _p2 - _p1;
+		Vector e2 = _p3 - _p1;
+		float e11 = e1 * e1, e12 = e1 * e2, e22 = e2 * e2;
+		float det = e11 * e22 - e12 * e12;
+		if(!_ray.hasDifferentials || det == 0.f)
+			return;
+
+		_ray.transferDifferentials(_distance, e1 % e2, dPdx, dPdy);
+
+		//Solve dP = u * e1 + v * e2 in the plane of the triangle
+		float p1 = e1 * dPdx, p2 = e2 * dPdx;
+		dBdx = float2(e22 * p1 - e12 * p2, e11 * p2 - e12 * p1) / det;
+		p1 = e1 * dPdy; p2 = e2 * dPdy;
+		dBdy = float2(e22 * p1 - e12 * p2, e11 * p2 - e12 * p1) / det;
+	}
+
+	//The change of a value interpolated from the vertices, for a change _dB
+	//	of the weights (dBdx or dBdy). E.g. texture coordinates or normals
+	template<class T>
+	T differential(const T &_v1, const T &_v2, const T &_v3, const float2 &_dB) const
+	{
+		return (_v2 - _v1) * _dB.x + (_v3 - _v1) * _dB.y;
+	}
+};
+
+//The directions in which the texture coordinates u (_tangent) and v 
+//	(_bitangent) grow on a triangle, normalized. The texture coordinates 
+//	of the vertices are _t1, _t2 and _t3. Returns false if they are 
+//	degenerate, the directions are undefined then
+inline bool getTextureTangents(
+	const Point &_p1, const Point &_p2, const Point &_p3,
+	const float2 &_t1, const float2 &_t2, const float2 &_t3,
+	Vector &_tangent, Vector &_bitangent)
+{
+	Vector e1 = _p2 - _p1;
+	Vector e2 = _p3 - _p1;
+	float2 d1 = _t2 - _t1;
+	float2 d2 = _t3 - _t1;
+
+	//Solve e = dP/du * d.x + dP/dv * d.y for both edges
+	float det = d1.x * d2.y - d2.x * d1.y;
+	if(det == 0.f)
+		return false;
+
+	_tangent = ~((e1 * d2.y - e2 * d1.y) / det);
+	_bitangent = ~((e2 * d1.x - e1 * d2.x) / det);
+	return true;
+}
+
+//A unit vector in 4 bytes: the octahedral mapping, 16 bits per coordinate.
+//	A zero or undefined vector is stored as (0, 0, 1)
+//Details: Cigolle et al. - A Survey of Efficient Representations for 
+//	Independent Unit Vectors, JCGT 2014
+struct PackedUnitVector
+{
+	short x, y;
+
+	PackedUnitVector() {}
+
+	explicit PackedUnitVector(const Vector &_v)
+	{
+		float len = fabs(_v.x) + fabs(_v.y) + fabs(_v.z);
+		x = y = 0;
+		if(!(len > 0.f))
+			return;
+
+		//The lower half of the octahedron is folded over the upper one
+		float u = _v.x / len, v = _v.y / len;
+		if(_v.z < 0.f)
+		{
+			float fu = (1.f - fabs(v)) * (u >= 0.f ? 1.f : -1.f);
+			v = (1.f - fabs(u)) * (v >= 0.f ? 1.f : -1.f);
+			u = fu;
+		}
+		x = (short)floor(u * 32767.f + 0.5f);
+		y = (short)floor(v * 32767.f + 0.5f);
+	}
+
+	Vector unpack() const
+	{
+		float u = x / 32767.f, v = y / 32767.f;
+		Vector ret(u, v, 1.f - fabs(u) - fabs(v));
+		if(ret.z < 0.f)
+		{
+			ret.x = (1.f - fabs(v)) * (u >= 0.f ? 1.f : -1.f);
+			ret.y = (1.f - fabs(u)) * (v >= 0.f ? 1.f : -1.f);
+		}
+		return ~ret;
+	}
+};
+
+//Clips a triangle against an axis aligned box (Sutherland-Hodgman)
+//Returns the bounding box of the part of the triangle inside _box,
+//	or an empty box if the triangle does not overlap _box
+inline BBox clipTriangle(
+	const Point &_p1, const Point &_p2, const Point &_p3,
+	const BBox &_box)
+{
+	//Each clipping plane adds at most one vertex
+	Point poly[2][9];
+	poly[0][0] = _p1;
+	poly[0][1] = _p2;
+	poly[0][2] = _p3;
+	int count = 3, cur = 0;
+
+	for(int plane = 0; plane < 6 && count > 0; plane++)
+	{
+		int dim = plane % 3;
+		bool maxPlane = plane >= 3;
+		float bound = maxPlane ? _box.max[dim] : _box.min[dim];
+
+		int newCount = 0;
+		for(int i = 0; i < count; i++)
+		{
+			const Point &a = poly[cur][i];
+			const Point &b = poly[cur][(i + 1) % count];
+			//Positive on the inner side of the plane
+			float da = maxPlane ? bound - a[dim] : a[dim] - bound;
+			float db = maxPlane ? bound - b[dim] : b[dim] - bound;
+
+			if(da >= 0)
+				poly[1 - cur][newCount++] = a;
+			if((da >= 0) != (db >= 0))
+				poly[1 - cur][newCount++] = a + (b - a) * (da / (da - db));
+		}
+
+		cur = 1 - cur;
+		count = newCount;
+	}
+
+	BBox ret = BBox::empty();
+	for(int i = 0; i < count; i++)
+		ret.extend(poly[cur][i]);
+
+	//Intersection points can be slightly outside because of rounding
+	ret.clip(_box);
+	return ret;
+}
+
+//Wall clock time in seconds, for measuring build times
+inline double wallClock()
+{
+#ifdef _OPENMP
+	return omp_get_wtime();
+#else
+	return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
 #endif //__UTIL_H_INCLUDED_6DEB3409_AA7C_48E0_AEDC_5A40687E23E6
@@ -14,6 +14,9 @@
 struct BasicPrimitiveHitPoint : public RefCntBase
 {
 	Point hit;
+	//Sphere only: for the ray differentials
+	Ray ray;
+	float distance;
 };
 
 //An infinite plane
@@ -99,6 +102,8 @@ struct Sphere : public Primitive
 
 			SmartPtr<BasicPrimitiveHitPoint> hit = new BasicPrimitiveHitPoint;
 			hit->hit = _ray.o + _ray.d * dist;
+			hit->ray = _ray;
+			hit->distance = dist;
 			ret.hitInfo = hit;
 			ret.distance = dist;
 		}
@@ -115,6 +120,14 @@ struct Sphere : public Primitive
 		ret->setPosition(hit->hit);
 		ret->setNormal(hit->hit - center);
 
+		//The normal is (hit - center) / radius
+		if(hit->ray.hasDifferentials)
+		{
+			Vector dPdx, dPdy;
+			hit->ray.transferDifferentials(hit->distance, hit->hit - center, dPdx, dPdy);
+			ret->setRayDifferentials(hit->ray, dPdx, dPdy, dPdx / radius, dPdy / radius);
+		}
+
 		return ret;
 	}
 
@@ -0,0 +1,246 @@
+#include "stdafx.h"
+#include "fractallandscape.h"
+#include "perspective_camera.h"
+
+void FractalLandscape::enableLOD(const PerspectiveCamera &_camera, float _pixelsPerSquare, size_t _cacheBudget)
+{
+	if(minMaxLevels.empty() && number_of_squares_in_one_axis >= 2 * MINMAX_BLOCK_SQUARES)
+		generateMinMaxLevels();
+
+	//Too small for patches
+	if(minMaxLevels.empty())
+		return;
+
+	lodPatchSquares = std::min((uint)LOD_PATCH_SQUARES, number_of_squares_in_one_axis);
+	lodLevel = 0;
+	while((uint)(MINMAX_BLOCK_SQUARES << lodLevel) < lodPatchSquares)
+		lodLevel++;
+
+	uint patches = number_of_squares_in_one_axis / lodPatchSquares;
+	lodStrides.resize(patches * patches);
+	lodCache.assign(patches * patches, (LODPatch*)NULL);
+	lodResident.clear();
+	lodPatches.clear();
+	lodFree.clear();
+	lodCacheBytes = 0;
+	lodCacheBudget = _cacheBudget;
+
+	const Point &eye = _camera.getCenter();
+	float pixelAngle = _camera.getPixelAngle();
+	float patchWidth = lodPatchSquares * one_square_width;
+
+	for(uint py = 0; py < patches; py++)
+		for(uint px = 0; px < patches; px++)
+		{
+			const std::pair<float, float> &heightRange = minMaxLevels[lodLevel](px, py);
+			Point boxMin(corner[0] + px * patchWidth, corner[1] + py * patchWidth, corner[2] + heightRange.first);
+			Point boxMax(boxMin[0] + patchWidth, boxMin[1] + patchWidth, corner[2] + heightRange.second);
+
+			//Distance from the eye to the closest point of the patch
+			Vector toPatch(0, 0, 0);
+			for(int dim = 0; dim < 3; dim++)
+				toPatch[dim] = std::max(std::max(boxMin[dim] - eye[dim], eye[dim] - boxMax[dim]), 0.f);
+			float distance = toPatch.len();
+
+			//The coarsest stride whose squares do not exceed _pixelsPerSquare pixels
+			uint stride = 1;
+			while(stride < lodPatchSquares && 2 * stride * one_square_width <= _pixelsPerSquare * pixelAngle * distance)
+				stride *= 2;
+
+			lodStrides[py * patches + px] = stride;
+		}
+}
+
+size_t FractalLandscape::getLODTriangleCount() const
+{
+	size_t ret = 0;
+	for(std::vector<uint>::const_iterator it = lodStrides.begin(); it != lodStrides.end(); it++)
+		ret += 2 * (lodPatchSquares / *it) * (lodPatchSquares / *it);
+	return ret;
+}
+
+//A hit takes no lock. It reads the slot, references the patch and reads the 
+//	slot again: if the patch is still there, it was not evicted before the 
+//	reference was taken. The patches are never deleted while the LOD mode is 
+//	on, so referencing a stale pointer is safe, and an evicted patch is only 
+//	reused once nothing references it.
+SmartPtr<FractalLandscape::LODPatch> FractalLandscape::getLODPatch(uint _px, uint _py)
+{
+	size_t index = _py * (number_of_squares_in_one_axis / lodPatchSquares) + _px;
+
+	LODPatch *cached;
+#pragma omp atomic read
+	cached = lodCache[index];
+
+	if(cached != NULL)
+	{
+		SmartPtr<LODPatch> ret = cached;
+
+		LODPatch *current;
+#pragma omp atomic read
+		current = lodCache[index];
+
+		if(current == cached)
+		{
+			size_t useCounter;
+#pragma omp atomic read
+			useCounter = lodUseCounter;
+#pragma omp atomic write
+			cached->lastUse = useCounter;
+			return ret;
+		}
+	}
+
+	SmartPtr<LODPatch> ret;
+
+#pragma omp critical (FractalLandscapeLODCache)
+	{
+		ret = lodCache[index];
+		if(ret.data() == NULL)
+		{
+			for(size_t i = 0; i < lodFree.size() && ret.data() == NULL; i++)
+			{
+				//Only lodPatches
+				if(lodFree[i]->getRefCount() == 1)
+				{
+					ret = lodFree[i];
+					lodFree[i] = lodFree.back();
+					lodFree.pop_back();
+				}
+			}
+			if(ret.data() == NULL)
+			{
+				ret = new LODPatch;
+				lodPatches.push_back(ret);
+			}
+
+			tessellatePatch(_px, _py, *ret);
+			lodResident.push_back(index);
+			lodCacheBytes += ret->bytes();
+
+			size_t useCounter = lodUseCounter + 1;
+#pragma omp atomic write
+			lodUseCounter = useCounter;
+			ret->lastUse = useCounter;
+
+			//The tessellation has to be visible before the patch is
+#pragma omp flush
+			LODPatch *patch = ret.data();
+#pragma omp atomic write
+			lodCache[index] = patch;
+
+			evictLODPatches(index);
+		}
+		else
+		{
+#pragma omp atomic write
+			ret->lastUse = lodUseCounter;
+		}
+	}
+
+	return ret;
+}
+
+//Drops the least recently used patches until a quarter of the budget is free,
+//	so that the sort is not needed on most misses. The hits keep updating 
+//	lastUse, the order is that of a snapshot. Rays which still use a dropped
+//	patch keep their reference to it, its memory is released or reused once
+//	they are done.
+void FractalLandscape::evictLODPatches(size_t _keep)
+{
+	if(lodCacheBytes <= lodCacheBudget)
+		return;
+
+	std::vector<std::pair<size_t, size_t> > byLastUse;
+	byLastUse.reserve(lodResident.size());
+	for(size_t i = 0; i < lodResident.size(); i++)
+		if(lodResident[i] != _keep)
+		{
+			size_t lastUse;
+#pragma omp atomic read
+			lastUse = lodCache[lodResident[i]]->lastUse;
+			byLastUse.push_back(std::make_pair(lastUse, lodResident[i]));
+		}
+	std::sort(byLastUse.begin(), byLastUse.end());
+
+	size_t target = lodCacheBudget / 4 * 3;
+	size_t released = 0;
+	while(lodCacheBytes > target && released < byLastUse.size())
+	{
+		size_t index = byLastUse[released++].second;
+		LODPatch *patch = lodCache[index];
+		lodCacheBytes -= patch->bytes();
+#pragma omp atomic write
+		lodCache[index] = (LODPatch*)NULL;
+		lodFree.push_back(patch);
+	}
+
+	lodResident.clear();
+	for(size_t i = released; i < byLastUse.size(); i++)
+		lodResident.push_back(byLastUse[i].second);
+	lodResident.push_back(_keep);
+
+	//A hit references the patch before it reads the slot again, here the slot
+	//	is cleared before the references are read. So either the hit sees the 
+	//	empty slot and does not use the patch, or its reference is seen here
+#pragma omp flush
+	for(size_t i = 0; i < lodFree.size(); i++)
+	{
+		if(lodFree[i]->getRefCount() == 1 && !lodFree[i]->heights.empty())
+		{
+			std::vector<float>().swap(lodFree[i]->heights);
+			std::vector<Vector>().swap(lodFree[i]->normals);
+		}
+	}
+}
+
+//Samples the height map with the stride of the patch. Where a neighbour patch
+//	is coarser, the vertices on the common border are moved onto the straight
+//	edges of the neighbour's squares, so there are no cracks between the patches.
+void FractalLandscape::tessellatePatch(uint _px, uint _py, LODPatch &_patch) const
+{
+	uint patches = number_of_squares_in_one_axis / lodPatchSquares;
+
+	LODPatch *patch = &_patch;
+	patch->x = _px * lodPatchSquares;
+	patch->y = _py * lodPatchSquares;
+	patch->stride = lodStrides[_py * patches + _px];
+	patch->size = lodPatchSquares / patch->stride + 1;
+	patch->heights.resize(patch->size * patch->size);
+	patch->normals.resize(patch->size * patch->size);
+
+	//Strides of the left, right, bottom and top neighbours
+	uint neighbourStride[4] = {
+		_px > 0 ? lodStrides[_py * patches + _px - 1] : 1,
+		_px + 1 < patches ? lodStrides[_py * patches + _px + 1] : 1,
+		_py > 0 ? lodStrides[(_py - 1) * patches + _px] : 1,
+		_py + 1 < patches ? lodStrides[(_py + 1) * patches + _px] : 1
+	};
+
+	for(uint j = 0; j < patch->size; j++)
+		for(uint i = 0; i < patch->size; i++)
+		{
+			uint x = patch->x + i * patch->stride, y = patch->y + j * patch->stride;
+			float height = getHeight(x, y);
+
+			//On a vertical border the neighbour's vertices are every s-th in y, and vice versa
+			int border = i == 0 ? 0 : i == patch->size - 1 ? 1 : j == 0 ? 2 : j == patch->size - 1 ? 3 : -1;
+			if(border != -1 && neighbourStride[border] > patch->stride)
+			{
+				uint s = neighbourStride[border];
+				if(border < 2)
+				{
+					uint y0 = y - y % s;
+					height = getHeight(x, y0) + (getHeight(x, y0 + s) - getHeight(x, y0)) * (float)(y - y0) / (float)s;
+				}
+				else
+				{
+					uint x0 = x - x % s;
+					height = getHeight(x0, y) + (getHeight(x0 + s, y) - getHeight(x0, y)) * (float)(x - x0) / (float)s;
+				}
+			}
+
+			patch->heights[j * patch->size + i] = height;
+			patch->normals[j * patch->size + i] = computeVertexNormal(x, y, patch->stride);
+		}
+}
@@ -25,7 +25,20 @@ SmartPtr<Shader> FractalLandscape::Face::getShader(IntRet _intData) const
 		m_fractal->textCoords(vert2x, vert2y) * hit->intResult.y +  
 		m_fractal->textCoords(vert3x, vert3y) * hit->intResult.z;
 
-	shader->setTextureCoord(texPos);
+	TriangleHitDifferentials diff(m_fractal->vertices(vert1x, vert1y), m_fractal->vertices(vert2x, vert2y), 
+		m_fractal->vertices(vert3x, vert3y), hit->ray, hit->intResult.w);
+	if(hit->ray.hasDifferentials)
+	{
+		const Vector &n1 = m_fractal->vertexNormals(vert1x, vert1y), &n2 = m_fractal->vertexNormals(vert2x, vert2y), 
+			&n3 = m_fractal->vertexNormals(vert3x, vert3y);
+		shader->setRayDifferentials(hit->ray, diff.dPdx, diff.dPdy, 
+			normalizedDifferential(norm, diff.differential(n1, n2, n3, diff.dBdx)), 
+			normalizedDifferential(norm, diff.differential(n1, n2, n3, diff.dBdy)));
+	}
+
+	const float2 &t1 = m_fractal->textCoords(vert1x, vert1y), &t2 = m_fractal->textCoords(vert2x, vert2y), 
+		&t3 = m_fractal->textCoords(vert3x, vert3y);
+	shader->setTextureCoord(texPos, diff.differential(t1, t2, t3, diff.dBdx), diff.differential(t1, t2, t3, diff.dBdy));
 
 
 	return shader;
@@ -49,6 +62,7 @@ Primitive::IntRet FractalLandscape::Face::intersect(const Ray& _ray, float _prev
 		SmartPtr<ExtHitPoint> hit = new ExtHitPoint;
 		ret.hitInfo = hit;
 		hit->intResult = inter;
+		hit->ray = _ray;
 	}
 
 	return ret;
@@ -63,4 +77,414 @@ BBox FractalLandscape::Face::getBBox() const
 	ret.extend(m_fractal->vertices(vert2x, vert2y));
 	ret.extend(m_fractal->vertices(vert3x, vert3y));
 	return ret;
+}
+
+BBox FractalLandscape::Face::clipBBox(const BBox &_box) const
+{
+	return clipTriangle(m_fractal->vertices(vert1x, vert1y), m_fractal->vertices(vert2x, vert2y),
+		m_fractal->vertices(vert3x, vert3y), _box);
+}
+
+BBox FractalLandscape::HeightField::getBBox() const
+{
+	BBox ret;
+	ret.min = Point(m_fractal->corner[0], m_fractal->corner[1], m_fractal->corner[2] + m_fractal->minHeight);
+	ret.max = Point(m_fractal->corner[0] + m_fractal->width, m_fractal->corner[1] + m_fractal->width, 
+		m_fractal->corner[2] + m_fractal->maxHeight);
+	return ret;
+}
+
+namespace fractal_internal
+{
+	enum {_MAX_QUADTREE_LEVELS = 32};
+
+	//Ray - box slab test. Unlike BBox::intersect, copes with rays parallel
+	//	to a slab which start exactly on its border, which is common on the 
+	//	block borders of the grid
+	std::pair<float, float> intersectBox(const Ray &_ray, const Point &_min, const Point &_max)
+	{
+		std::pair<float, float> ret(-FLT_MAX, FLT_MAX);
+		for(int dim = 0; dim < 3; dim++)
+		{
+			if(_ray.d[dim] == 0.f)
+			{
+				if(_ray.o[dim] < _min[dim] || _ray.o[dim] > _max[dim])
+					return std::make_pair(FLT_MAX, -FLT_MAX);
+				continue;
+			}
+
+			float t1 = (_min[dim] - _ray.o[dim]) / _ray.d[dim];
+			float t2 = (_max[dim] - _ray.o[dim]) / _ray.d[dim];
+			ret.first = std::max(ret.first, std::min(t1, t2));
+			ret.second = std::min(ret.second, std::max(t1, t2));
+		}
+		return ret;
+	}
+
+	struct QuadtreeNode
+	{
+		uint level, x, y;
+		float tMin, tMax;
+	};
+
+	//A regular grid of heights in row major order, either the whole 
+	//	height map or the tessellation of a LOD patch
+	struct GridView
+	{
+		const float *heights;
+		size_t rowSize;
+		//The position of vertex 0, 0 at height 0
+		Point origin;
+		float squareWidth;
+
+		float height(int _x, int _y) const { return heights[_y * rowSize + _x]; }
+
+		Point vertex(int _x, int _y) const 
+		{ 
+			return Point(origin[0] + _x * squareWidth, origin[1] + _y * squareWidth, origin[2] + height(_x, _y)); 
+		}
+	};
+
+	struct GridHit
+	{
+		float4 intResult;
+		int x, y;
+		bool secondTriangle;
+	};
+
+	//Walks the grid squares [_x1, _x2) x [_y1, _y2) along the projection of the ray 
+	//	to the XY plane (2D DDA). The squares are visited in the order of the ray, 
+	//	so the first square with a hit contains the closest one.
+	bool intersectGrid(const GridView &_grid, const Ray& _ray, float _tMin, float _tMax, 
+		int _x1, int _y1, int _x2, int _y2, float _previousBestDistance, GridHit &_hit)
+	{
+		const int squareMin[2] = {_x1, _y1}, squareMax[2] = {_x2 - 1, _y2 - 1};
+		const float squareWidth = _grid.squareWidth;
+
+		//Tolerance of the height test of a square, covers the rounding of the ray heights
+		const float _EPS = 0.0001f * squareWidth + 0.0001f * std::max(1.f, fabs(_tMax)) * fabs(_ray.d[2]);
+
+		int sq[2], step[2];
+		float tNext[2], tDelta[2];
+		for(int dim = 0; dim < 2; dim++)
+		{
+			float entry = _ray.o[dim] + _tMin * _ray.d[dim] - _grid.origin[dim];
+			sq[dim] = std::min(std::max((int)floor(entry / squareWidth), squareMin[dim]), squareMax[dim]);
+
+			if(_ray.d[dim] > 0.f)
+			{
+				step[dim] = 1;
+				tDelta[dim] = squareWidth / _ray.d[dim];
+				tNext[dim] = (_grid.origin[dim] + (sq[dim] + 1) * squareWidth - _ray.o[dim]) / _ray.d[dim];
+			}
+			else if(_ray.d[dim] < 0.f)
+			{
+				step[dim] = -1;
+				tDelta[dim] = -squareWidth / _ray.d[dim];
+				tNext[dim] = (_grid.origin[dim] + sq[dim] * squareWidth - _ray.o[dim]) / _ray.d[dim];
+			}
+			else
+			{
+				step[dim] = 0;
+				tDelta[dim] = FLT_MAX;
+				tNext[dim] = FLT_MAX;
+			}
+		}
+
+		float tEnter = _tMin;
+		for(;;)
+		{
+			float tExit = std::min(std::min(tNext[0], tNext[1]), _tMax);
+			int x = sq[0], y = sq[1];
+
+			//Skip the square if the ray passes completely above or below it
+			float z1 = _ray.o[2] + tEnter * _ray.d[2] - _grid.origin[2];
+			float z2 = _ray.o[2] + tExit * _ray.d[2] - _grid.origin[2];
+			float h1 = _grid.height(x, y), h2 = _grid.height(x + 1, y);
+			float h3 = _grid.height(x, y + 1), h4 = _grid.height(x + 1, y + 1);
+			float squareLow = std::min(std::min(h1, h2), std::min(h3, h4));
+			float squareHigh = std::max(std::max(h1, h2), std::max(h3, h4));
+
+			if(std::max(z1, z2) >= squareLow - _EPS && std::min(z1, z2) <= squareHigh + _EPS)
+			{
+				Point p1 = _grid.vertex(x, y), p3 = _grid.vertex(x + 1, y + 1);
+				float4 inter[2] = {
+					intersectTriangle(p1, _grid.vertex(x + 1, y), p3, _ray),
+					intersectTriangle(p1, _grid.vertex(x, y + 1), p3, _ray)
+				};
+
+				int best = -1;
+				for(int i = 0; i < 2; i++)
+					if(inter[i].w > Primitive::INTEPS() && inter[i].w < _previousBestDistance &&
+						(best == -1 || inter[i].w < inter[best].w))
+						best = i;
+
+				if(best != -1)
+				{
+					_hit.intResult = inter[best];
+					_hit.x = x;
+					_hit.y = y;
+					_hit.secondTriangle = best == 1;
+					return true;
+				}
+			}
+
+			if(tExit >= _tMax)
+				break;
+
+			int dim = tNext[0] < tNext[1] ? 0 : 1;
+			sq[dim] += step[dim];
+			if(sq[dim] < squareMin[dim] || sq[dim] > squareMax[dim])
+				break;
+
+			tEnter = tNext[dim];
+			tNext[dim] += tDelta[dim];
+		}
+
+		return false;
+	}
+}
+
+using namespace fractal_internal;
+
+//Descends the min/max quadtree front to back. Blocks which the ray misses,
+//	or which start behind the closest hit so far, are skipped. In the blocks 
+//	of level 0 the squares are walked by intersectSquares, in the LOD mode
+//	the patch tessellations are walked by intersectPatch instead. In the 
+//	out-of-core mode the squares of the tiles are walked by intersectTile.
+Primitive::IntRet FractalLandscape::HeightField::intersect(const Ray& _ray, float _previousBestDistance) const
+{
+	const FractalLandscape &f = *m_fractal;
+	IntRet ret;
+
+	//The range is widened a bit, so hits exactly on the bounding box
+	//	(e.g. on a flat part at the lowest height) are not lost
+	BBox bbox = getBBox();
+	std::pair<float, float> range = intersectBox(_ray, bbox.min, bbox.max);
+	float rangeEps = 0.0001f * std::max(1.f, fabs(range.second));
+	range.first = std::max(range.first - rangeEps, 0.f);
+	range.second = std::min(range.second + rangeEps, _previousBestDistance);
+	if(range.first > range.second)
+		return ret;
+
+	if(f.minMaxLevels.empty())
+		return intersectSquares(_ray, range.first, range.second, 0, 0, 
+			f.number_of_squares_in_one_axis, f.number_of_squares_in_one_axis, _previousBestDistance);
+
+	_ASSERT(f.minMaxLevels.size() <= _MAX_QUADTREE_LEVELS);
+
+	//Each visited node pushes at most 4 children, one of them is popped right away
+	QuadtreeNode stack[3 * _MAX_QUADTREE_LEVELS + 1];
+	int stackSize = 0;
+
+	QuadtreeNode root = {(uint)f.minMaxLevels.size() - 1, 0, 0, range.first, range.second};
+	stack[stackSize++] = root;
+
+	float bestDistance = _previousBestDistance;
+	const float zEps = 0.0001f * f.one_square_width;
+	const uint leafLevel = f.lodPatchSquares != 0 ? f.lodLevel : f.tileData != NULL ? f.tileLevel : 0;
+
+	while(stackSize > 0)
+	{
+		QuadtreeNode node = stack[--stackSize];
+		if(node.tMin > bestDistance)
+			continue;
+
+		uint blockSquares = MINMAX_BLOCK_SQUARES << node.level;
+		if(node.level == leafLevel)
+		{
+			IntRet cur = f.lodPatchSquares != 0 ?
+				intersectPatch(_ray, node.tMin, std::min(node.tMax, bestDistance), node.x, node.y, bestDistance) :
+				f.tileData != NULL ?
+				intersectTile(_ray, node.tMin, std::min(node.tMax, bestDistance), node.x, node.y, bestDistance) :
+				intersectSquares(_ray, node.tMin, std::min(node.tMax, bestDistance), 
+					node.x * blockSquares, node.y * blockSquares, 
+					(node.x + 1) * blockSquares, (node.y + 1) * blockSquares, bestDistance);
+
+			if(cur.distance < bestDistance)
+			{
+				ret = cur;
+				bestDistance = cur.distance;
+			}
+			continue;
+		}
+
+		//Children which the ray hits, sorted by their entry distance
+		QuadtreeNode children[4];
+		int childCnt = 0;
+		const Array2<std::pair<float, float> > &childLevel = f.minMaxLevels[node.level - 1];
+		float childWidth = (blockSquares / 2) * f.one_square_width;
+
+		for(uint i = 0; i < 4; i++)
+		{
+			QuadtreeNode child = {node.level - 1, 2 * node.x + (i & 1), 2 * node.y + (i >> 1), 0.f, 0.f};
+			const std::pair<float, float> &heightRange = childLevel(child.x, child.y);
+
+			Point boxMin(f.corner[0] + child.x * childWidth, f.corner[1] + child.y * childWidth, 
+				f.corner[2] + heightRange.first - zEps);
+			Point boxMax(boxMin[0] + childWidth, boxMin[1] + childWidth, f.corner[2] + heightRange.second + zEps);
+
+			std::pair<float, float> childRange = intersectBox(_ray, boxMin, boxMax);
+			child.tMin = std::max(childRange.first - rangeEps, node.tMin);
+			child.tMax = std::min(childRange.second + rangeEps, node.tMax);
+			if(child.tMin > child.tMax || child.tMin > bestDistance)
+				continue;
+
+			int pos = childCnt++;
+			for(; pos > 0 && children[pos - 1].tMin > child.tMin; pos--)
+				children[pos] = children[pos - 1];
+			children[pos] = child;
+		}
+
+		//The nearest child ends on top of the stack
+		for(int i = childCnt - 1; i >= 0; i--)
+			stack[stackSize++] = children[i];
+	}
+
+	return ret;
+}
+
+Primitive::IntRet FractalLandscape::HeightField::intersectSquares(const Ray& _ray, float _tMin, float _tMax, 
+	uint _x1, uint _y1, uint _x2, uint _y2, float _previousBestDistance) const
+{
+	const FractalLandscape &f = *m_fractal;
+	IntRet ret;
+
+	GridView grid;
+	grid.heights = &f.heights(0, 0);
+	grid.rowSize = f.number_of_vertices_in_one_axis;
+	grid.origin = f.corner;
+	grid.squareWidth = f.one_square_width;
+
+	GridHit gridHit;
+	if(intersectGrid(grid, _ray, _tMin, _tMax, _x1, _y1, _x2, _y2, _previousBestDistance, gridHit))
+	{
+		SmartPtr<ExtHitPoint> hit = new ExtHitPoint;
+		hit->intResult = gridHit.intResult;
+		hit->squareX = gridHit.x;
+		hit->squareY = gridHit.y;
+		hit->stride = 1;
+		hit->secondTriangle = gridHit.secondTriangle;
+		hit->ray = _ray;
+		ret.hitInfo = hit;
+		ret.distance = gridHit.intResult.w;
+	}
+
+	return ret;
+}
+
+Primitive::IntRet FractalLandscape::HeightField::intersectPatch(const Ray& _ray, float _tMin, float _tMax, 
+	uint _px, uint _py, float _previousBestDistance) const
+{
+	const FractalLandscape &f = *m_fractal;
+	IntRet ret;
+
+	SmartPtr<LODPatch> patch = m_fractal->getLODPatch(_px, _py);
+
+	GridView grid;
+	grid.heights = &patch->heights[0];
+	grid.rowSize = patch->size;
+	grid.origin = Point(f.corner[0] + patch->x * f.one_square_width, f.corner[1] + patch->y * f.one_square_width, f.corner[2]);
+	grid.squareWidth = patch->stride * f.one_square_width;
+
+	GridHit gridHit;
+	if(intersectGrid(grid, _ray, _tMin, _tMax, 0, 0, patch->size - 1, patch->size - 1, _previousBestDistance, gridHit))
+	{
+		SmartPtr<ExtHitPoint> hit = new ExtHitPoint;
+		hit->intResult = gridHit.intResult;
+		hit->squareX = patch->x + gridHit.x * patch->stride;
+		hit->squareY = patch->y + gridHit.y * patch->stride;
+		hit->stride = patch->stride;
+		hit->secondTriangle = gridHit.secondTriangle;
+		hit->ray = _ray;
+		hit->patch = patch;
+		ret.hitInfo = hit;
+		ret.distance = gridHit.intResult.w;
+	}
+
+	return ret;
+}
+
+Primitive::IntRet FractalLandscape::HeightField::intersectTile(const Ray& _ray, float _tMin, float _tMax, 
+	uint _tx, uint _ty, float _previousBestDistance) const
+{
+	const FractalLandscape &f = *m_fractal;
+	IntRet ret;
+
+	GridView grid;
+	grid.heights = m_fractal->getTile(_tx, _ty);
+	grid.rowSize = STREAM_TILE_SQUARES + 1;
+	grid.origin = Point(f.corner[0] + _tx * STREAM_TILE_SQUARES * f.one_square_width, 
+		f.corner[1] + _ty * STREAM_TILE_SQUARES * f.one_square_width, f.corner[2]);
+	grid.squareWidth = f.one_square_width;
+
+	GridHit gridHit;
+	if(intersectGrid(grid, _ray, _tMin, _tMax, 0, 0, STREAM_TILE_SQUARES, STREAM_TILE_SQUARES, _previousBestDistance, gridHit))
+	{
+		SmartPtr<ExtHitPoint> hit = new ExtHitPoint;
+		hit->intResult = gridHit.intResult;
+		hit->squareX = _tx * STREAM_TILE_SQUARES + gridHit.x;
+		hit->squareY = _ty * STREAM_TILE_SQUARES + gridHit.y;
+		hit->stride = 1;
+		hit->secondTriangle = gridHit.secondTriangle;
+		hit->ray = _ray;
+		ret.hitInfo = hit;
+		ret.distance = gridHit.intResult.w;
+	}
+
+	return ret;
+}
+
+SmartPtr<Shader> FractalLandscape::HeightField::getShader(IntRet _intData) const
+{
+	SmartPtr<ExtHitPoint> hit = _intData.hitInfo;
+
+	//Same vertex order as the faces
+	uint s = hit->stride;
+	uint vx[3] = {hit->squareX, hit->secondTriangle ? hit->squareX : hit->squareX + s, hit->squareX + s};
+	uint vy[3] = {hit->squareY, hit->secondTriangle ? hit->squareY + s : hit->squareY, hit->squareY + s};
+
+	Point pos[3];
+	Vector norm[3];
+	for(int i = 0; i < 3; i++)
+	{
+		if(hit->patch.data() != NULL)
+		{
+			//The patch vertices can differ from the height map on the patch border
+			const LODPatch &patch = *hit->patch;
+			size_t idx = (vy[i] - patch.y) / s * patch.size + (vx[i] - patch.x) / s;
+			pos[i] = Point(m_fractal->corner[0] + vx[i] * m_fractal->one_square_width, 
+				m_fractal->corner[1] + vy[i] * m_fractal->one_square_width, m_fractal->corner[2] + patch.heights[idx]);
+			norm[i] = patch.normals[idx];
+		}
+		else
+		{
+			pos[i] = m_fractal->computeVertex(vx[i], vy[i]);
+			norm[i] = m_fractal->computeVertexNormal(vx[i], vy[i]);
+		}
+	}
+
+	SmartPtr<PluggableShader> shader = m_fractal->shader->clone();
+
+	shader->setPosition(Point::lerp(pos[0], pos[1], pos[2], hit->intResult.x, hit->intResult.y));
+
+	Vector normal = norm[0] * hit->intResult.x + norm[1] * hit->intResult.y + norm[2] * hit->intResult.z;
+	shader->setNormal(normal);
+
+	TriangleHitDifferentials diff(pos[0], pos[1], pos[2], hit->ray, hit->intResult.w);
+	if(hit->ray.hasDifferentials)
+		shader->setRayDifferentials(hit->ray, diff.dPdx, diff.dPdy, 
+			normalizedDifferential(normal, diff.differential(norm[0], norm[1], norm[2], diff.dBdx)), 
+			normalizedDifferential(normal, diff.differential(norm[0], norm[1], norm[2], diff.dBdy)));
+
+	float2 texCoord[3];
+	for(int i = 0; i < 3; i++)
+		texCoord[i] = m_fractal->computeTextureCoord(vx[i], vy[i]);
+
+	float2 texPos = texCoord[0] * hit->intResult.x + texCoord[1] * hit->intResult.y + texCoord[2] * hit->intResult.z;
+
+	shader->setTextureCoord(texPos, diff.differential(texCoord[0], texCoord[1], texCoord[2], diff.dBdx), 
+		diff.differential(texCoord[0], texCoord[1], texCoord[2], diff.dBdy));
+
+	return shader;
 }
\ No newline at end of file
@@ -0,0 +1,234 @@
+//Out-of-core mode of FractalLandscape: the height map in a file of tiles,
+//	paged in by the height field through an LRU tile cache
+#include "stdafx.h"
+#include "fractallandscape.h"
+
+namespace fractal_streaming_internal
+{
+	//Increase when the layout of the file or the generator changes
+	enum {_TILES_VERSION = 1, _TILES_MAGIC = 0x534C4954 /*TILS*/};
+
+	//The tiles start on a page boundary, so they can be paged in and out one by one
+	enum {_TILES_OFFSET = 4096};
+
+	//File layout: the header, the tiles in row major order (each one with
+	//	(STREAM_TILE_SQUARES + 1)^2 heights in row major order), then the levels
+	//	of the min/max quadtree from firstLevel up. The finer levels are not
+	//	needed, the rays do not descend below the tiles or the LOD patches.
+	struct TilesHeader
+	{
+		uint magic, version;
+		uint iterations, seed;
+		float h, width;
+		uint tileSquares, firstLevel;
+	};
+
+	uint firstStoredLevel(uint _squares)
+	{
+		uint ret = 0;
+		while((uint)(FractalLandscape::MINMAX_BLOCK_SQUARES << (ret + 1)) <=
+			std::min((uint)FractalLandscape::LOD_PATCH_SQUARES, _squares))
+			ret++;
+		return ret;
+	}
+
+	size_t levelFloats(uint _squares, uint _level)
+	{
+		size_t blocks = _squares / FractalLandscape::MINMAX_BLOCK_SQUARES >> _level;
+		return 2 * blocks * blocks;
+	}
+}
+
+using namespace fractal_streaming_internal;
+
+//Generates the height map tile by tile, straight into the file. First the 
+//	levels with squares larger than a tile, on a grid of the tile corners. 
+//	Then each tile on its own, in a window of 2 x 2 tiles which includes the 
+//	tiles left of and below it, see perturbateLevels. The heights are the same as those 
+//	of generateHeights(), but only the corner grid and a row of tiles are in 
+//	memory. The min/max levels from the first stored one up are kept in 
+//	minMaxLevels, the finer ones are never built
+bool FractalLandscape::generateTiles(const std::string &_fileName)
+{
+	TilesHeader header;
+	memset(&header, 0, sizeof(header));
+	header.magic = _TILES_MAGIC;
+	header.version = _TILES_VERSION;
+	header.iterations = iterations;
+	header.seed = seed;
+	header.h = h;
+	header.width = width;
+	header.tileSquares = STREAM_TILE_SQUARES;
+	header.firstLevel = firstStoredLevel(number_of_squares_in_one_axis);
+
+	//Write to a temporary file first, so that concurrent readers
+	//	never see a partially written file
+	std::string tmpFileName = _fileName + ".tmp";
+	{
+		std::ofstream output(tmpFileName.c_str(), std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+		if(output.fail())
+		{
+			std::cerr << "Could not write terrain tiles " << _fileName << std::endl;
+			return false;
+		}
+
+		std::vector<char> headerBlock(_TILES_OFFSET, 0);
+		memcpy(&headerBlock[0], &header, sizeof(header));
+		output.write(&headerBlock[0], headerBlock.size());
+
+		const int last = (int)number_of_squares_in_one_axis;
+		uint tiles = number_of_squares_in_one_axis / STREAM_TILE_SQUARES;
+		Array2<float> corners(tiles + 1);
+		perturbateLevels(corners, 0, 0, STREAM_TILE_SQUARES, (int)tiles, last, 2 * STREAM_TILE_SQUARES);
+
+		//The min/max blocks are not larger than a tile, see firstStoredLevel
+		uint blockSquares = MINMAX_BLOCK_SQUARES << header.firstLevel;
+		uint tileBlocks = STREAM_TILE_SQUARES / blockSquares;
+		minMaxLevels.assign(header.firstLevel + 1, Array2<std::pair<float, float> >());
+		minMaxLevels.back() = Array2<std::pair<float, float> >(tiles * tileBlocks);
+		Array2<std::pair<float, float> > &firstLevel = minMaxLevels.back();
+
+		uint windowTiles = std::min(tiles, 2u);
+		size_t floatsPerTile = (STREAM_TILE_SQUARES + 1) * (STREAM_TILE_SQUARES + 1);
+		std::vector<float> tileRow(tiles * floatsPerTile);
+		for(uint ty = 0; ty < tiles; ty++)
+		{
+#pragma omp parallel for
+			for(int tx = 0; tx < (int)tiles; tx++)
+			{
+				uint wx = tx > 0 ? tx - 1 : 0, wy = ty > 0 ? ty - 1 : 0;
+				Array2<float> window(windowTiles * STREAM_TILE_SQUARES + 1);
+				for(uint j = 0; j <= windowTiles; j++)
+					for(uint i = 0; i <= windowTiles; i++)
+						window(i * STREAM_TILE_SQUARES, j * STREAM_TILE_SQUARES) = corners(wx + i, wy + j);
+				perturbateLevels(window, wx * STREAM_TILE_SQUARES, wy * STREAM_TILE_SQUARES, 1, 
+					(int)(windowTiles * STREAM_TILE_SQUARES), STREAM_TILE_SQUARES, 2);
+
+				uint x0 = (tx - wx) * STREAM_TILE_SQUARES, y0 = (ty - wy) * STREAM_TILE_SQUARES;
+				float *tile = &tileRow[tx * floatsPerTile];
+				for(uint y = 0; y <= STREAM_TILE_SQUARES; y++)
+					for(uint x = 0; x <= STREAM_TILE_SQUARES; x++)
+						tile[y * (STREAM_TILE_SQUARES + 1) + x] = window(x0 + x, y0 + y);
+
+				//Each block includes the vertices on its border, as in generateMinMaxLevels
+				for(uint by = 0; by < tileBlocks; by++)
+					for(uint bx = 0; bx < tileBlocks; bx++)
+					{
+						std::pair<float, float> range(FLT_MAX, -FLT_MAX);
+						for(uint y = by * blockSquares; y <= (by + 1) * blockSquares; y++)
+							for(uint x = bx * blockSquares; x <= (bx + 1) * blockSquares; x++)
+							{
+								range.first = std::min(range.first, tile[y * (STREAM_TILE_SQUARES + 1) + x]);
+								range.second = std::max(range.second, tile[y * (STREAM_TILE_SQUARES + 1) + x]);
+							}
+						firstLevel(tx * tileBlocks + bx, ty * tileBlocks + by) = range;
+					}
+			}
+
+			output.write((const char*)&tileRow[0], tileRow.size() * sizeof(float));
+		}
+
+		addCoarserMinMaxLevels(tiles * tileBlocks);
+
+		for(uint level = header.firstLevel; level < minMaxLevels.size(); level++)
+			output.write((const char*)&minMaxLevels[level](0, 0),
+				levelFloats(number_of_squares_in_one_axis, level) * sizeof(float));
+
+		if(output.fail())
+		{
+			std::cerr << "Could not write terrain tiles " << _fileName << std::endl;
+			return false;
+		}
+	}
+
+	::remove(_fileName.c_str());
+	::rename(tmpFileName.c_str(), _fileName.c_str());
+	return true;
+}
+
+//Maps the tile file and switches to the out-of-core mode. The height map in
+//	memory and the quadtree levels below the tiles are released.
+bool FractalLandscape::openTiles(const std::string &_fileName)
+{
+	//Unmaps the file again if it does not match
+	SmartPtr<TileCache> cache = new TileCache(tileBudget);
+	size_t dataSize = 0;
+	const byte *data = cache->mapFile(_fileName, dataSize);
+	if(data == NULL)
+		return false;
+
+	uint tiles = number_of_squares_in_one_axis / STREAM_TILE_SQUARES;
+	size_t floatsPerTile = (STREAM_TILE_SQUARES + 1) * (STREAM_TILE_SQUARES + 1);
+	uint firstLevel = firstStoredLevel(number_of_squares_in_one_axis);
+	uint levels = 0;
+	size_t expectedSize = _TILES_OFFSET + (size_t)tiles * tiles * floatsPerTile * sizeof(float);
+	for(uint blocks = number_of_squares_in_one_axis / MINMAX_BLOCK_SQUARES; blocks >= 1; blocks /= 2, levels++)
+		if(levels >= firstLevel)
+			expectedSize += levelFloats(number_of_squares_in_one_axis, levels) * sizeof(float);
+
+	bool valid = dataSize == expectedSize;
+	if(valid)
+	{
+		TilesHeader header;
+		memcpy(&header, data, sizeof(TilesHeader));
+		valid = header.magic == _TILES_MAGIC && header.version == _TILES_VERSION
+			&& header.iterations == iterations && header.seed == seed && header.h == h
+			&& header.width == width && header.tileSquares == STREAM_TILE_SQUARES
+			&& header.firstLevel == firstLevel;
+	}
+
+	if(!valid)
+		return false;
+
+	const float *levelData = (const float*)(data + expectedSize);
+	minMaxLevels.resize(levels);
+	for(uint level = levels; level-- > 0;)
+	{
+		if(level < firstLevel)
+		{
+			minMaxLevels[level] = Array2<std::pair<float, float> >();
+			continue;
+		}
+
+		size_t floats = levelFloats(number_of_squares_in_one_axis, level);
+		levelData -= floats;
+		minMaxLevels[level] = Array2<std::pair<float, float> >(number_of_squares_in_one_axis / MINMAX_BLOCK_SQUARES >> level);
+		memcpy(&minMaxLevels[level](0, 0), levelData, floats * sizeof(float));
+	}
+	minHeight = minMaxLevels.back()(0, 0).first;
+	maxHeight = minMaxLevels.back()(0, 0).second;
+
+	tileCache = cache;
+	tileData = (const float*)(data + _TILES_OFFSET);
+	tileCache->addBlocks((const byte*)tileData, (size_t)tiles * tiles, floatsPerTile * sizeof(float));
+	tilesPerAxis = tiles;
+	tileFloats = floatsPerTile;
+	tileLevel = 0;
+	while((uint)(MINMAX_BLOCK_SQUARES << tileLevel) < (uint)STREAM_TILE_SQUARES)
+		tileLevel++;
+
+	heights = Array2<float>();
+	return true;
+}
+
+void FractalLandscape::closeTiles()
+{
+	tileData = NULL;
+	tileCache = SmartPtr<TileCache>();
+}
+
+FractalLandscape::StreamingStats FractalLandscape::getStreamingStats() const
+{
+	StreamingStats ret;
+	memset(&ret, 0, sizeof(ret));
+	ret.residentBudget = tileBudget;
+	if(tileCache.data() == NULL)
+		return ret;
+
+	const TileCache::Stats &stats = tileCache->getStats();
+	ret.tileRequests = stats.hits + stats.misses;
+	ret.pageIns = stats.misses;
+	ret.evictions = stats.evictions;
+	ret.residentBytes = stats.residentBytes;
+	return ret;
+}
@@ -1,10 +1,13 @@
 #include "../core/algebra.h"
 #include "../core/array2.h"
+#include "../core/tile_cache.h"
 #include "../rt/basic_definitions.h"
 #include "../rt/bvh.h"
 #include "../rt/shading_basics.h"
 #include "../rt/texture.h"
 
+class PerspectiveCamera;
+
 // class for generating mountain like objects. output is a set of faces. 
 // Shader is shared between triangles
 // limitation: mountain grows only in positive Z axis, textures are aligned with x and y coords
@@ -15,6 +18,25 @@
 class FractalLandscape
 {
 private:
+	//A patch of the height field, tessellated at a lower level of detail. 
+	//	The patches belong to the landscape, which reuses them, see getLODPatch.
+	//	Allocated with plain new: the thread local pools of FastAllocObjectBase 
+	//	take memory back only on the thread which allocated it
+	struct LODPatch : RefCntBase
+	{
+		uint x, y; // first vertex of the patch in the height map
+		uint stride; // the patch uses every stride-th vertex of the height map
+		uint size; // number of vertices in one axis
+		std::vector<float> heights;
+		std::vector<Vector> normals;
+		size_t lastUse; // written without the lock, atomically
+
+		size_t bytes() const { return sizeof(LODPatch) + heights.size() * sizeof(float) + normals.size() * sizeof(Vector); }
+
+		void *operator new(size_t _size) { return ::operator new(_size); }
+		void operator delete(void *_obj) { ::operator delete(_obj); }
+	};
+
 	//This is the structure that is filled from the intersection
 	//	routine and is than passed to the getShader routine, in case
 	//	the face is the closest to the origin of the ray.
@@ -22,12 +44,18 @@ private:
 	{
 		//The barycentric coordinate (in .x, .y, .z) + the distance (in .w)
 		float4 intResult;
+		//HeightField only: the first vertex of the hit grid square, its size
+		//	in vertices and which of its two triangles. patch is set in the LOD mode
+		uint squareX, squareY, stride;
+		bool secondTriangle;
+		SmartPtr<LODPatch> patch;
+		//For the ray differentials
+		Ray ray;
 	};
 	Array2<float> heights; //height map
 	Array2<std::pair<Vector, Vector> > squareNormals; //height map consists of squares, 
 	//and each square has two triangle normals.
 	Array2<Vector> vertexNormals;
-	Array2<int> heightsSet; // did we already perturbated the height?
 	std::vector<Vector> normals; //vertex normal are in the end of generating copyed here 
 	// for easy indexing
 	Array2<Point> vertices; 
@@ -42,10 +70,54 @@ private:
 	float one_square_width;
 	Point corner;
 	float h; // constant that defines roughnes. from interval (0,1)
+	uint seed; // seed of the random perturbation
 	float textureScale;
+	float minHeight, maxHeight;
+	//Min/max mip-map of the height map, used by the height field. Level 0 has
+	//	the heights of blocks of MINMAX_BLOCK_SQUARES x MINMAX_BLOCK_SQUARES squares, 
+	//	each following level merges 2x2 blocks, up to a single block. 
+	//	Starting at 4x4 squares keeps the overhead at ~17% of the height map.
+	std::vector<Array2<std::pair<float, float> > > minMaxLevels;
+
+	//Level of detail mode of the height field, see enableLOD
+	uint lodPatchSquares; // 0 if the LOD mode is off
+	uint lodLevel; // the level of minMaxLevels with blocks of lodPatchSquares squares
+	std::vector<uint> lodStrides; // per patch
+	std::vector<LODPatch*> lodCache; // per patch, NULL if not tessellated. Read without the lock
+	std::vector<size_t> lodResident; // indices of the tessellated patches
+	std::vector<SmartPtr<LODPatch> > lodPatches; // all patches, in the cache or not
+	std::vector<LODPatch*> lodFree; // evicted patches, reused once no ray references them
+	size_t lodCacheBytes, lodCacheBudget, lodUseCounter;
+
+	//Out-of-core mode, see the streaming constructor. The height map lives in a
+	//	file of tiles of STREAM_TILE_SQUARES x STREAM_TILE_SQUARES squares. A tile 
+	//	includes the vertices on its border, so every square is inside one tile.
+	//	Every read of a height goes through tileCache, which maps the file 
+	//	and keeps the resident tiles within tileBudget.
+	const float *tileData; // all tiles, NULL if the height map is in memory
+	mutable SmartPtr<TileCache> tileCache; // one block per tile
+	size_t tileBudget;
+	uint tilesPerAxis;
+	uint tileLevel; // the level of minMaxLevels with blocks of one tile
+	size_t tileFloats; // per tile
 
 	SmartPtr<PluggableShader> shader;
 public:
+	//Statistics of the tile cache in the out-of-core mode
+	struct StreamingStats
+	{
+		size_t tileRequests; // tiles visited by rays or read by the shading and the LOD patches
+		size_t pageIns; // requests of tiles which were not resident
+		size_t evictions;
+		size_t residentBytes, residentBudget;
+
+		void print() const
+		{
+			std::cout << "Terrain tiles: " << tileRequests << " requests, " << pageIns << " page-ins, "
+				<< evictions << " evictions, " << residentBytes / 1024 << " of " << residentBudget / 1024 
+				<< " KB resident" << std::endl;
+		}
+	};
 
 	class Face;
 	std::vector<Face> faces;
@@ -68,56 +140,329 @@ public:
 
 		virtual BBox getBBox() const;
 
+		virtual BBox clipBBox(const BBox &_box) const;
+
+		virtual SmartPtr<Shader> getShader(IntRet _intData) const;
+	};
+
+	//The whole landscape as one primitive. Uses the regular grid of heights
+	//	as its own acceleration structure: a 2D DDA walks the grid squares
+	//	along the ray and only their two triangles are intersected.
+	//	Needs nothing but the height map, the faces do not have to be generated.
+	//For large grids the ray descends a min/max quadtree over the height
+	//	map first and skips whole blocks which it passes above or below. 
+	//	The DDA then only runs in the smallest blocks.
+	class HeightField : public Primitive
+	{
+		FractalLandscape *m_fractal;
+
+		//Intersects the squares [_x1, _x2) x [_y1, _y2) between the distances _tMin and _tMax
+		IntRet intersectSquares(const Ray& _ray, float _tMin, float _tMax, 
+			uint _x1, uint _y1, uint _x2, uint _y2, float _previousBestDistance) const;
+
+		//Same for the tessellation of a LOD patch
+		IntRet intersectPatch(const Ray& _ray, float _tMin, float _tMax, 
+			uint _px, uint _py, float _previousBestDistance) const;
+
+		//Same for a tile in the out-of-core mode
+		IntRet intersectTile(const Ray& _ray, float _tMin, float _tMax, 
+			uint _tx, uint _ty, float _previousBestDistance) const;
+	public:
+		HeightField(FractalLandscape *_obj) : m_fractal(_obj) {}
+
+		virtual IntRet intersect(const Ray& _ray, float _previousBestDistance ) const;
+
+		virtual BBox getBBox() const;
+
 		virtual SmartPtr<Shader> getShader(IntRet _intData) const;
 	};
+
+	HeightField heightField;
+
+	enum {MINMAX_BLOCK_SQUARES = 4, LOD_PATCH_SQUARES = 32, STREAM_TILE_SQUARES = 64};
 	
 	// Creates perturbated surface given by:
 	// a, b are opposite cornes of a flat square (Z coordinate should be the samer)
 	// _iterations - number of iterations
 	// _h roughnes constant from interval (0,1)
 	// shader -  shader is shared between faces. fractal does not support texture shader
+	// _seed - the same seed always gives the same landscape
+
+	FractalLandscape(Point a, Point b, uint _iterations, float _h, SmartPtr<PluggableShader> _shader, float _textureScale, uint _seed = 1)
+		: heightField(this) {
+		init(a, b, _iterations, _h, _shader, _textureScale, _seed);
+		generateHeights();
+		//the faces are generated on demand, the height field does not need them
+	}
+
+	// Same, but out-of-core: the height map is kept in _tileFile and the height
+	// field pages its tiles in through a cache of at most _residentBudget bytes.
+	// The file is written on the first run and reused while the parameters match,
+	// so the landscape is generated only once. It is generated tile by tile
+	// straight into the file, so the height map never has to fit in memory. 
+	// Landscapes smaller than one tile stay in memory.
+	FractalLandscape(Point a, Point b, uint _iterations, float _h, SmartPtr<PluggableShader> _shader, float _textureScale, uint _seed,
+		const std::string &_tileFile, size_t _residentBudget)
+		: heightField(this) {
+		init(a, b, _iterations, _h, _shader, _textureScale, _seed);
+		tileBudget = _residentBudget;
+		if(number_of_squares_in_one_axis < STREAM_TILE_SQUARES || openTiles(_tileFile))
+			return;
+
+		if(generateTiles(_tileFile) && openTiles(_tileFile))
+			return;
+
+		//if the file cannot be written, the landscape stays in memory
+		generateHeights();
+		generateMinMaxLevels();
+	}
+
+	~FractalLandscape() { closeTiles(); }
 
-	FractalLandscape(Point a, Point b, uint _iterations, float _h, SmartPtr<PluggableShader> _shader, float _textureScale) {
-		//initialization
+	//Adds all triangles contained in this object to a scene
+	void addReferencesToScene(std::vector<Primitive*> &_scene)
+	{
+		if(faces.empty())
+			generateFaces();
+
+		for(std::vector<Face>::const_iterator it = faces.begin(); it != faces.end(); it++)
+			_scene.push_back((Primitive*)&*it);	
+	}
+	//Adds the landscape as a single height field primitive to a scene.
+	//	An alternative to addReferencesToScene, which is much cheaper in memory
+	void addHeightFieldToScene(std::vector<Primitive*> &_scene)
+	{
+		if(minMaxLevels.empty() && number_of_squares_in_one_axis >= 2 * MINMAX_BLOCK_SQUARES)
+			generateMinMaxLevels();
+
+		_scene.push_back(&heightField);
+	}
+
+	//Switches the height field to a level of detail mode. The landscape is split 
+	//	into patches of LOD_PATCH_SQUARES x LOD_PATCH_SQUARES squares. Each patch 
+	//	uses squares of about _pixelsPerSquare pixels, as seen from _camera, but never 
+	//	finer than the height map. Patches are tessellated when a ray reaches them
+	//	and kept in a cache of at most _cacheBudget bytes.
+	void enableLOD(const PerspectiveCamera &_camera, float _pixelsPerSquare, size_t _cacheBudget);
+
+	//Number of triangles of all patches in the LOD mode
+	size_t getLODTriangleCount() const;
+
+	size_t getLODCacheSize() const { return lodCacheBytes; }
+
+	bool isStreaming() const { return tileData != NULL; }
+
+	StreamingStats getStreamingStats() const;
+protected:
+	void init(Point a, Point b, uint _iterations, float _h, SmartPtr<PluggableShader> _shader, float _textureScale, uint _seed)
+	{
 		corner = Point(std::min(a[0], b[0]), std::min(a[1], b[1]), a[2]);
 		width = abs(a[0] - b[0]);
 		number_of_squares_in_one_axis = pow(2, _iterations);
 		number_of_vertices_in_one_axis = number_of_squares_in_one_axis + 1;
-		heights = Array2<float>(number_of_vertices_in_one_axis);
-		vertexNormals = Array2<Vector>(number_of_vertices_in_one_axis);
-		squareNormals = Array2<std::pair<Vector, Vector> >(number_of_squares_in_one_axis);
-		vertices = Array2<Point>(number_of_vertices_in_one_axis);
-		heightsSet = Array2<int>(number_of_vertices_in_one_axis);
-		textCoords = Array2<float2>(number_of_vertices_in_one_axis);
 		one_square_width = width/number_of_squares_in_one_axis;
 		iterations = _iterations;
 		textureScale = _textureScale;
 		h = _h;
+		seed = _seed;
 		shader = _shader;
-		
-		//generating perturbated surface
-		generateTextureCoordinates();
+		lodPatchSquares = 0;
+		lodCacheBytes = lodCacheBudget = lodUseCounter = 0;
+		tileData = NULL;
+		tileBudget = 0;
+		tilesPerAxis = tileLevel = 0;
+		tileFloats = 0;
+	}
+
+	// generates perturbated surface in memory
+	void generateHeights()
+	{
+		heights = Array2<float>(number_of_vertices_in_one_axis);
 		resetHeights(0.0f);
-		perturbateSurface(0, 0, number_of_vertices_in_one_axis - 1, number_of_vertices_in_one_axis - 1, width);
+		perturbateSurface();
+		computeHeightRange();
+	}
+
+	// the out-of-core mode, see fractal_streaming.cpp
+	bool generateTiles(const std::string &_fileName);
+	bool openTiles(const std::string &_fileName);
+	void closeTiles();
+	// a tile, paged in through the tile cache. thread safe
+	const float* getTile(uint _tx, uint _ty) const
+	{
+		size_t index = (size_t)_ty * tilesPerAxis + _tx;
+		tileCache->touch(index);
+		return tileData + index * tileFloats;
+	}
+
+	// the height of a vertex, also in the out-of-core mode
+	float getHeight(uint x, uint y) const
+	{
+		if(tileData == NULL)
+			return heights(x, y);
+
+		uint tx = std::min(x / (uint)STREAM_TILE_SQUARES, tilesPerAxis - 1);
+		uint ty = std::min(y / (uint)STREAM_TILE_SQUARES, tilesPerAxis - 1);
+		return getTile(tx, ty)[(y - ty * STREAM_TILE_SQUARES) * (STREAM_TILE_SQUARES + 1) + x - tx * STREAM_TILE_SQUARES];
+	}
+
+	// the tessellation of a patch, from the cache. thread safe
+	SmartPtr<LODPatch> getLODPatch(uint _px, uint _py);
+	void tessellatePatch(uint _px, uint _py, LODPatch &_patch) const;
+	void evictLODPatches(size_t _keep);
+
+	// the per vertex data of the faces, computed from the height map
+	Point computeVertex(uint x, uint y) const
+	{
+		return Point(corner[0] + x * one_square_width, corner[1] + y * one_square_width, 
+			getHeight(x, y) + corner[2]);
+	}
+
+	float2 computeTextureCoord(uint x, uint y) const
+	{
+		return float2((float(x) / (float) (number_of_vertices_in_one_axis - 1) *textureScale),
+			(float(y) / (float) (number_of_vertices_in_one_axis - 1) *textureScale));
+	}
+
+	// the two triangle normals of a square. with stride > 1 of a square
+	// of stride x stride squares, from its corners (for the LOD patches)
+	std::pair<Vector, Vector> computeSquareNormals(uint x, uint y, uint stride = 1) const
+	{
+		float w = stride * one_square_width;
+		Vector vx(w,
+			 0,
+			 getHeight(x + stride,y) - getHeight(x,y));
+		Vector vy(0,
+			 w,
+			 getHeight(x,y + stride) - getHeight(x,y));
+		std::pair<Vector, Vector> ret;
+		ret.first = ~(vx % vy);
+
+		vx = Vector(w,
+			 0,
+			 getHeight(x + stride,y + stride) - getHeight(x,y + stride));
+		vy = Vector(0,
+			 w,
+			 getHeight(x + stride,y + stride) - getHeight(x + stride,y));
+		ret.second = ~(vx % vy);
+		return ret;
+	}
+
+	// by adding neighbour triangle normals we get vertex normal
+	// If we are on the egde where is no triangle on a side, we add (0,0,1) instead
+	Vector computeVertexNormal(uint x, uint y, uint stride = 1) const
+	{
+		Vector n(0,0,0);
+		std::pair<Vector, Vector> sq;
+		//left-up
+		if(x == 0 || y == number_of_squares_in_one_axis)
+			n = n + Vector(0,0,1);
+		else {
+			sq = computeSquareNormals(x - stride, y, stride);
+			n = n + sq.first + sq.second;
+		}
+		//right-up
+		if(x == number_of_squares_in_one_axis || y == number_of_squares_in_one_axis)
+			n = n + Vector(0,0,1);
+		else {
+			sq = computeSquareNormals(x, y, stride);
+			n = n + sq.first + sq.second;
+		}
+		//right-down
+		if(x == number_of_squares_in_one_axis || y == 0)
+			n = n + Vector(0,0,1);
+		else {
+			sq = computeSquareNormals(x, y - stride, stride);
+			n = n + sq.first + sq.second;
+		}
+		//left-down
+		if(x == 0 || y == 0)
+			n = n + Vector(0,0,1);
+		else {
+			sq = computeSquareNormals(x - stride, y - stride, stride);
+			n = n + sq.first + sq.second;
+		}
+		return ~n;
+	}
+
+	void computeHeightRange()
+	{
+		minHeight = FLT_MAX;
+		maxHeight = -FLT_MAX;
+		for(uint y = 0; y < number_of_vertices_in_one_axis; y++) 
+			for(uint x = 0; x < number_of_vertices_in_one_axis; x++) {
+				minHeight = std::min(minHeight, heights(x, y));
+				maxHeight = std::max(maxHeight, heights(x, y));
+			}
+	}
+
+	// builds the min/max mip-map of the heights. each block includes 
+	// the vertices on its border, so it bounds both triangles of all its squares
+	void generateMinMaxLevels()
+	{
+		uint blocks = number_of_squares_in_one_axis / MINMAX_BLOCK_SQUARES;
+		minMaxLevels.clear();
+		minMaxLevels.push_back(Array2<std::pair<float, float> >(blocks));
+		Array2<std::pair<float, float> > &level0 = minMaxLevels.back();
+
+		for(uint by = 0; by < blocks; by++) 
+			for(uint bx = 0; bx < blocks; bx++) {
+				std::pair<float, float> range(FLT_MAX, -FLT_MAX);
+				for(uint y = by * MINMAX_BLOCK_SQUARES; y <= (by + 1) * MINMAX_BLOCK_SQUARES; y++) 
+					for(uint x = bx * MINMAX_BLOCK_SQUARES; x <= (bx + 1) * MINMAX_BLOCK_SQUARES; x++) {
+						range.first = std::min(range.first, heights(x, y));
+						range.second = std::max(range.second, heights(x, y));
+					}
+				level0(bx, by) = range;
+			}
+
+		addCoarserMinMaxLevels(blocks);
+	}
+
+	// adds the levels of the min/max mip-map above the last one, which 
+	// has _blocks blocks in one axis
+	void addCoarserMinMaxLevels(uint _blocks)
+	{
+		uint blocks = _blocks;
+		while(blocks > 1) {
+			blocks /= 2;
+			minMaxLevels.push_back(Array2<std::pair<float, float> >(blocks));
+			const Array2<std::pair<float, float> > &prev = minMaxLevels[minMaxLevels.size() - 2];
+			Array2<std::pair<float, float> > &cur = minMaxLevels.back();
+
+			for(uint by = 0; by < blocks; by++) 
+				for(uint bx = 0; bx < blocks; bx++) {
+					std::pair<float, float> range = prev(2 * bx, 2 * by);
+					for(uint i = 1; i < 4; i++) {
+						const std::pair<float, float> &child = prev(2 * bx + (i & 1), 2 * by + (i >> 1));
+						range.first = std::min(range.first, child.first);
+						range.second = std::max(range.second, child.second);
+					}
+					cur(bx, by) = range;
+				}
+		}
+	}
+
+	// generates everything the faces need
+	void generateFaces()
+	{
+		vertexNormals = Array2<Vector>(number_of_vertices_in_one_axis);
+		squareNormals = Array2<std::pair<Vector, Vector> >(number_of_squares_in_one_axis);
+		vertices = Array2<Point>(number_of_vertices_in_one_axis);
+		textCoords = Array2<float2>(number_of_vertices_in_one_axis);
+
+		generateTextureCoordinates();
 		generateNormals();
 		generateVertexNormals();
 		generateTriangles();
 	}
-	//Adds all triangles contained in this object to a scene
-	void addReferencesToScene(std::vector<Primitive*> &_scene) const 
-	{
-		for(std::vector<Face>::const_iterator it = faces.begin(); it != faces.end(); it++)
-			_scene.push_back((Primitive*)&*it);	
-	}
-protected:
+
 	// sets texture coordinates of all vertices. scale is controlled by textureScale
 	void generateTextureCoordinates() 
 	{
 		for(uint y = 0; y < number_of_vertices_in_one_axis; y++) 
 			for(uint x = 0; x < number_of_vertices_in_one_axis; x++) {
-				textCoords(x, y) = float2((float(x) / (float) (number_of_vertices_in_one_axis - 1) *textureScale),
-						       (float(y) / (float) (number_of_vertices_in_one_axis - 1) *textureScale));
-
+				textCoords(x, y) = computeTextureCoord(x, y);
 			}
 	}
 	
@@ -130,102 +475,82 @@ protected:
 			}
 	}
 	
-	// we recursively perturbate 5 points between input coordinates
-	// if there are is no more points between, we terminate
-	// we use Diamond-Square-like algorithm here
+	// we use Diamond-Square-like algorithm here, level by level: first the centers
+	// of all squares of a level, than the midpoints of their edges. each level 
+	// is computed in parallel. every point is perturbated once, with a random number 
+	// hashed from its position, so the result does not depend on the number of threads
+	void perturbateSurface()
+	{
+		const int last = (int)number_of_vertices_in_one_axis - 1;
+		perturbateLevels(heights, 0, 0, 1, last, last, 2);
+	}
+
+	// the levels of perturbateSurface with squares of _firstSize down to _lastSize 
+	// squares of the height map, on a window of it: _grid(i, j) is the vertex
+	// (_x0 + i * _stride, _y0 + j * _stride), the window has _gridSquares squares 
+	// in one axis and only the squares inside it are computed.
+	// a midpoint shared by two squares is computed from the left (lower) one, 
+	// as it was in the recursive version. so a tile only depends on the tiles 
+	// left of and below it: a window of 2 x 2 tiles, with the vertices of the 
+	// coarser levels filled in, gives the right heights in its upper right 
+	// tile (see generateTiles)
 	// actual_square_width determines amount of perturbation - the bigger square the bigger pert.
-	void perturbateSurface(uint x1, uint y1, uint x2, uint y2,  float actual_square_width)
+	void perturbateLevels(Array2<float> &_grid, uint _x0, uint _y0, uint _stride, int _gridSquares, 
+		int _firstSize, int _lastSize) const
 	{
-		uint midx = (x1 + x2) / 2;
-		uint midy = (y1 + y2) / 2;
-		// we got point in the middle
-		if(midx > x1 && midy > y1) { // are there any points to perturbate?
+		const int last = (int)number_of_vertices_in_one_axis - 1;
+
+		for(int size = _firstSize; size >= _lastSize; size /= 2) {
+			const int cells = size / (int)_stride;
+			const int squares = _gridSquares / cells;
+			float actual_square_width = width * ((float)size / (float)last);
 			float diagonal_square_width = sqrt(2.0f) * actual_square_width;
-			heights(midx, midy) = (heights(x1,y1) + heights(x2, y2)+ heights(x1,y2) + heights(x2, y1)  )/4.0 + h*normalRandom() * diagonal_square_width;
-			
-			//here in these conditionals we check whether we are not on berder of fractal. 
+
+#pragma omp parallel for
+			for(int sy = 0; sy < squares; sy++)
+				for(int sx = 0; sx < squares; sx++) {
+					uint i1 = sx * cells, j1 = sy * cells, i2 = i1 + cells, j2 = j1 + cells;
+					uint midi = (i1 + i2) / 2;
+					uint midj = (j1 + j2) / 2;
+					uint midx = _x0 + midi * _stride, midy = _y0 + midj * _stride;
+					_grid(midi, midj) = (_grid(i1,j1) + _grid(i2, j2)+ _grid(i1,j2) + _grid(i2, j1)  )/4.0 + h*normalRandom(midx, midy) * diagonal_square_width;
+				}
+
 			// we don't want to perturbate edges
-			// also we don't want to perturbate poins that were already perturbated 
-			if(x1 != 0 && !heightsSet(x1, midy)) {
-				heights(x1, midy) =  (heights(x1,y1) + heights(x1, y2) + heights(midx, midy))/3.0 + h*normalRandom() * actual_square_width;
-				heightsSet(x1, midy) = 1;
-			}
-			if(x2 != (number_of_vertices_in_one_axis - 1)  && !heightsSet(x2, midy)) {
-				heights(x2, midy) =  (heights(x2,y1) + heights(x2, y2)  + heights(midx, midy))/3.0 +   h*normalRandom() * actual_square_width;
-				heightsSet(x2, midy) = 1;
-			}
-			if(y1 != 0  && !heightsSet(midx, y1)) {
-				heights(midx, y1) =(heights(x1,y1) + heights(x2, y1) + heights(midx, midy))/3.0+  h*normalRandom() * actual_square_width;
-				heightsSet(midx, y1) = 1;
-			}
-			if(y2 != (number_of_vertices_in_one_axis - 1) && !heightsSet(midx, y2)) {
-				heights(midx, y2) =  (heights(x1,y2) + heights(x2, y2) + heights(midx, midy))/3.0 +   h*normalRandom() * actual_square_width;
-				heightsSet(midx, y2) = 1;
-			}
-			actual_square_width = actual_square_width / 2.0f; 
-			// recursive call on small regions
-			perturbateSurface(x1,y1, midx, midy, actual_square_width);
-			perturbateSurface(midx,y1, x2, midy, actual_square_width);
-			perturbateSurface(x1,midy, midx, y2, actual_square_width);
-			perturbateSurface(midx, midy, x2, y2, actual_square_width);
+#pragma omp parallel for
+			for(int sy = 0; sy < squares; sy++)
+				for(int sx = 0; sx < squares; sx++) {
+					uint i1 = sx * cells, j1 = sy * cells, i2 = i1 + cells, j2 = j1 + cells;
+					uint midi = (i1 + i2) / 2;
+					uint midj = (j1 + j2) / 2;
+					uint x2 = _x0 + i2 * _stride, y2 = _y0 + j2 * _stride;
+					uint midx = _x0 + midi * _stride, midy = _y0 + midj * _stride;
+					if((int)x2 != last)
+						_grid(i2, midj) =  (_grid(i2,j1) + _grid(i2, j2)  + _grid(midi, midj))/3.0 +   h*normalRandom(x2, midy) * actual_square_width;
+					if((int)y2 != last)
+						_grid(midi, j2) =  (_grid(i1,j2) + _grid(i2, j2) + _grid(midi, midj))/3.0 +   h*normalRandom(midx, y2) * actual_square_width;
+				}
 		}
 	}
 	
 	// we iterate over all square and compute 2 triangle normals of each square
 	void generateNormals() 
 	{
-		for(uint y = 0; y < number_of_squares_in_one_axis; y++) 
+#pragma omp parallel for
+		for(int y = 0; y < (int)number_of_squares_in_one_axis; y++) 
 			for(uint x = 0; x < number_of_squares_in_one_axis ; x++) {
-				Vector vx(one_square_width,
-					 0,
-					 heights(x + 1,y) - heights(x,y));
-				Vector vy(0,
-					 one_square_width,
-					 heights(x,y + 1) - heights(x,y));
-				Vector n = ~(vx % vy);
-				squareNormals(x,y).first = n;
-
-				vx = Vector(one_square_width,
-					 0,
-					 heights(x + 1,y + 1) - heights(x,y + 1));
-				vy = Vector(0,
-					 one_square_width,
-					 heights(x + 1,y + 1) - heights(x + 1,y));
-				n = ~(vx % vy);
-				squareNormals(x,y).second = n;
-				
+				squareNormals(x,y) = computeSquareNormals(x, y);
 			}
 	}
 	
-	// by adding neighbour triangle normals we get vertex normal
-	// If we are on the egde where is no triangle on a side, we add (0,0,1) instead
+	// vertex normals of the whole map, see computeVertexNormal
 	void generateVertexNormals()
 	{
-		for(uint y = 0; y < number_of_vertices_in_one_axis; y++) 
+#pragma omp parallel for
+		for(int y = 0; y < (int)number_of_vertices_in_one_axis; y++) 
 			for(uint x = 0; x < number_of_vertices_in_one_axis; x++) {
-				Vector n(0,0,0);
-				//left-up
-				if(x == 0 || y == number_of_squares_in_one_axis)
-					n = n + Vector(0,0,1);
-				else
-					n = n + squareNormals(x - 1, y).first + squareNormals(x - 1, y).second;
-				//right-up
-				if(x == number_of_squares_in_one_axis || y == number_of_squares_in_one_axis)
-					n = n + Vector(0,0,1);
-				else
-					n = n + squareNormals(x, y).first + squareNormals(x, y).second;				
-				//right-down
-				if(x == number_of_squares_in_one_axis || y == 0)
-					n = n + Vector(0,0,1);
-				else
-					n = n + squareNormals(x, y - 1).first + squareNormals(x, y - 1).second;			
-				//left-down
-				if(x == 0 || y == 0)
-					n = n + Vector(0,0,1);
-				else
-					n = n + squareNormals(x - 1, y - 1).first + squareNormals(x - 1, y -1).second;
-				vertexNormals(x, y) = ~n;
-			}		
+				vertexNormals(x, y) = computeVertexNormal(x, y);
+			}
 	}
 	
 	// basically it generates final faces
@@ -233,42 +558,53 @@ protected:
 	{
 
 		// compute vertices by adding to corner point
-		for(uint y = 0; y < number_of_vertices_in_one_axis; y++) 
+#pragma omp parallel for
+		for(int y = 0; y < (int)number_of_vertices_in_one_axis; y++) 
 			for(uint x = 0; x < number_of_vertices_in_one_axis; x++) {
-				vertices(x, y) = Point(corner[0] + (x / (float) (number_of_vertices_in_one_axis - 1)) * width,
-						       corner[1] + (y / (float) (number_of_vertices_in_one_axis - 1)) * width, 
-						       heights(x, y) + corner[2]);
-
+				vertices(x, y) = computeVertex(x, y);
 			}
 		// for easy indexing we copy face normals to an array
-		int i = 0;
-		for(uint y = 0; y < number_of_squares_in_one_axis; y++) 
+		// two faces per square, in row order
+		size_t faceCount = 2 * (size_t)number_of_squares_in_one_axis * number_of_squares_in_one_axis;
+		faces.assign(faceCount, Face(this));
+		normals.resize(faceCount);
+#pragma omp parallel for
+		for(int y = 0; y < (int)number_of_squares_in_one_axis; y++) 
 			for(uint x = 0; x < number_of_squares_in_one_axis; x++) {	
-				Face f1(this);
-				Face f2(this);
+				size_t i = 2 * ((size_t)y * number_of_squares_in_one_axis + x);
+				Face &f1 = faces[i];
+				Face &f2 = faces[i + 1];
 				f1.vert1x = f2.vert1x = f2.vert2x = x;
 				f1.vert1y = f2.vert1y = f1.vert2y = y;
 				f1.vert3x = f2.vert3x = f1.vert2x = x + 1;
 				f1.vert3y = f2.vert3y = f2.vert2y = y + 1;
 
-				normals.push_back(squareNormals(x,y).first);
+				normals[i] = squareNormals(x,y).first;
 				f1.normal = i;
-				faces.push_back(f1);
-				i++;
 				
-				normals.push_back(squareNormals(x,y).second);
-				f2.normal = i;
-				faces.push_back(f2);
-				i++;
+				normals[i + 1] = squareNormals(x,y).second;
+				f2.normal = i + 1;
 			}
 	}
 	
+	// uniform random number from (0, 1), hashed from the seed and a position
+	// Details: splitmix64 finalizer, http://xorshift.di.unimi.it/splitmix64.c
+	float hashRandom(uint x, uint y, uint stream) const {
+		unsigned long long v = ((unsigned long long)seed << 32 | stream) * 0x9E3779B97F4A7C15ULL;
+		v ^= ((unsigned long long)x << 32 | y) + 0x632BE59BD9B4E019ULL;
+		v = (v ^ (v >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		v = (v ^ (v >> 27)) * 0x94D049BB133111EBULL;
+		v ^= v >> 31;
+		return ((float)(v >> 40) + 0.5f) / 16777216.0f;
+	}
+
 	// generates number with gaussian propability distribution
+	// the number depends only on the seed and the point x, y
 	// Details: http://www.taygeta.com/random/gaussian.html
-	float normalRandom() {
+	float normalRandom(uint x, uint y) const {
 			const double PI = 3.141592;
-		float r1 = rand() / (float)RAND_MAX;
-		float r2 = rand() / (float)RAND_MAX;
+		float r1 = hashRandom(x, y, 0);
+		float r2 = hashRandom(x, y, 1);
 		
 		float y1 = sqrt( - 2 * log(r1) ) * cos( 2 * PI * r2 );
 		//y2 = sqrt( - 2 ln(x1) ) sin( 2 pi x2 )
@@ -5,6 +5,7 @@
 #endif
 
 #include "../core/algebra.h"
+#include "../core/util.h"
 #include "../rt/basic_definitions.h"
 #include "../rt/bvh.h"
 #include "../rt/shading_basics.h"
@@ -12,17 +13,15 @@
 
 
 //A LightWave3D object. It provides the functionality of 
-//	an indexed triangle mesh. The primitive consists
-//	of 5 buffers holding vertex positions, vertex normals,
-//	vertex texture coordinates, face materials, and the faces
-//	them selfs. Each face is a triangle and only contains indices
-//	into the position, normal, texture coordinate, and material
-//	buffers.
+//	an indexed triangle mesh. The mesh consists of 3 vertex
+//	buffers holding positions, normals and texture coordinates, 
+//	and 2 face buffers: 3 vertex indices and a material per face.
+//	Each face is a triangle. All faces form a single primitive with
+//	its own BVH, which addresses them by index. A face takes 14 bytes
+//	plus 8 for its tangents. A vertex takes 20 bytes, 32 if the object 
+//	has normals, and is shared by the faces around it.
 class LWObject
 {
-public:
-	class Face;
-
 private:
 	//This is the structure that is filled from the intersection
 	//	routine and is than passed to the getShader routine, in case
@@ -31,6 +30,9 @@ private:
 	{
 		//The barycentric coordinate (in .x, .y, .z) + the distance (in .w)
 		float4 intResult;
+		uint face;
+		//For the ray differentials
+		Ray ray;
 	};
 
 public:
@@ -55,6 +57,9 @@ public:
 
 		float specularExp;
 
+		//The image files of the textures, empty if there is no texture
+		std::string diffuseTextureFile, specularTextureFile, ambientTextureFile, bumpTextureFile;
+
 		//The shader attached to the material. It can be
 		//	fully independent of the data stored in the material
 		SmartPtr<PluggableShader> shader;
@@ -65,45 +70,112 @@ public:
 	};
 
 
-	//A face definition (triangle)
-	class Face : public Primitive
+	//All faces of the object as one primitive. To its BVH,
+	//	the faces are an indexed set of triangles
+	class Mesh : public Primitive, public IndexedPrimitiveSet
 	{
 		LWObject *m_lwObject;
+		BVH m_bvh;
+
+		const Point& vertex(size_t _face, int _corner) const 
+		{ 
+			return m_lwObject->vertices[m_lwObject->faces[3 * _face + _corner]]; 
+		}
 	public:
-		size_t material;
-		size_t vert1, tex1, norm1;
-		size_t vert2, tex2, norm2;
-		size_t vert3, tex3, norm3;
+		Mesh(LWObject *_obj) : m_lwObject(_obj) {}
+
+		//Builds the BVH over the faces, with the settings of the object
+		void buildIndex();
 
-		Face(LWObject * _obj) : m_lwObject(_obj) {}
+		bool hasIndex() const { return !m_bvh.empty(); }
 
-		virtual IntRet intersect(const Ray& _ray, float _previousBestDistance ) const;
+		virtual IntRet intersect(const Ray& _ray, float _previousBestDistance) const;
 
 		virtual BBox getBBox() const;
 
-	virtual SmartPtr<Shader> getShader(IntRet _intData) const;
+		virtual SmartPtr<Shader> getShader(IntRet _intData) const;
+
+		virtual size_t getPrimitiveCount() const;
+
+		virtual BBox getBBox(size_t _face) const;
+
+		virtual BBox clipBBox(size_t _face, const BBox &_box) const;
+
+		virtual IntRet intersect(size_t _face, const Ray& _ray, float _previousBestDistance) const;
 	};
 
 	typedef std::vector<Point> t_pointVector;
 	typedef std::vector<Vector> t_vectVector;
-	typedef std::vector<Face> t_faceVector;
+	typedef std::vector<PackedUnitVector> t_packedVectVector;
+	typedef std::vector<uint> t_indexVector;
+	typedef std::vector<unsigned short> t_materialIdVector;
 	typedef std::vector<Material> t_materialVector;
 	typedef std::vector<float2> t_texCoordVector;
 
+	//Set in the material id of a face without texture coordinates
+	enum {NO_TEXCOORDS_FLAG = 0x8000};
+	//Set in the material id of a face with a corner without normal.
+	//	That corner takes the normal of the face, computed from the positions
+	enum {FACE_NORMAL_FLAG = 0x4000};
+	enum {MATERIAL_ID_MASK = FACE_NORMAL_FLAG - 1};
+
+	//The vertex buffers. normals is empty if the .obj has no normals,
+	//	otherwise all are of the same size. A vertex of a corner without 
+	//	normal has a zero normal
 	t_pointVector vertices;
 	t_vectVector normals;
-	t_faceVector faces;
-	t_materialVector materials;
 	t_texCoordVector texCoords;
+	//3 indices into the vertex buffers per face
+	t_indexVector faces;
+	//Index into materials per face, possibly with NO_TEXCOORDS_FLAG
+	//	and FACE_NORMAL_FLAG
+	t_materialIdVector materialIds;
+	//2 per face: the directions in which the texture coordinates u and v 
+	//	grow, see getTextureTangents. Computed by read()
+	t_packedVectVector tangents;
+	t_materialVector materials;
 	std::map<std::string, size_t> materialMap;
 
+	Mesh mesh;
+
+	//The builder of the BVH over the faces and an optional cache 
+	//	file for it, see GeometryGroup
+	BVH::BuildSettings bvhSettings;
+	std::string bvhCacheFile;
+
+	//If set, the first read() stores the mesh with its tangents and the material
+	//	table in this binary file. Later runs load them from there instead of parsing the .obj
+	//	and .mtl files, as long as the size and modification time of those files
+	//	are unchanged. The textures are still loaded from their image files.
+	std::string meshCacheFile;
+
+	//If set, each texture is converted once into a tile file next to its image 
+	//	(<image>.tiles), which is then mapped and paged in through this cache, 
+	//	see Texture::openTiles. The tile files are rewritten when the images 
+	//	change. Otherwise the textures are decoded into memory.
+	SmartPtr<TileCache> textureCache;
+
+	//If set, the bump maps get a derivative map, see Texture::bakeDerivatives.
+	//	The bump shading then takes one lookup per hit instead of three. 
+	//	The derivative maps stay in memory, also with a textureCache
+	bool bakeBumpMaps;
+
+	LWObject() : mesh(this), bakeBumpMaps(false) {}
+
 	//Reads the LightWave3D object from a file and creates default phong shaders
 	//	for its materials
 	void read(const std::string& aFileName, bool _createDefautShaders = true);
 
-	//Adds all faces contained in this object to a scene
-	void addReferencesToScene(std::vector<Primitive*> &_scene) const;
+	//Adds the mesh of this object to a scene. Builds its BVH on the first call
+	void addReferencesToScene(std::vector<Primitive*> &_scene);
 
+	size_t getFaceCount() const { return materialIds.size(); }
+
+private:
+	//Fills tangents for the faces from _firstFace on
+	void computeTangents(size_t _firstFace);
+	bool loadMeshCache(const std::string &_objFileName);
+	void saveMeshCache(const std::string &_objFileName, const std::vector<std::string> &_mtlFileNames) const;
 };
 
 
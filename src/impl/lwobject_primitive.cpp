@@ -2,50 +2,72 @@
 #include "lwobject.h"
 #include "../core/util.h"
 
-SmartPtr<Shader> LWObject::Face::getShader(IntRet _intData) const
+SmartPtr<Shader> LWObject::Mesh::getShader(IntRet _intData) const
 {
 	SmartPtr<ExtHitPoint> hit = _intData.hitInfo;
 
-	SmartPtr<PluggableShader> shader = m_lwObject->materials[material].shader->clone();
+	const uint *idx = &m_lwObject->faces[3 * hit->face];
+	uint materialId = m_lwObject->materialIds[hit->face];
 
-	shader->setPosition(Point::lerp(m_lwObject->vertices[vert1], m_lwObject->vertices[vert2], 
-		m_lwObject->vertices[vert3], hit->intResult.x, hit->intResult.y));
+	SmartPtr<PluggableShader> shader = m_lwObject->materials[materialId & MATERIAL_ID_MASK].shader->clone();
 
+	shader->setPosition(Point::lerp(m_lwObject->vertices[idx[0]], m_lwObject->vertices[idx[1]], 
+		m_lwObject->vertices[idx[2]], hit->intResult.x, hit->intResult.y));
 
-	Vector norm = 
-		m_lwObject->normals[norm1] * hit->intResult.x + 
-		m_lwObject->normals[norm2] * hit->intResult.y + 
-		m_lwObject->normals[norm3] * hit->intResult.z;
+
+	//A corner without normal takes the normal of the face
+	Vector n[3];
+	if((materialId & FACE_NORMAL_FLAG) != 0)
+	{
+		const Point &p0 = m_lwObject->vertices[idx[0]], &p1 = m_lwObject->vertices[idx[1]], &p2 = m_lwObject->vertices[idx[2]];
+		Vector faceNormal = ~((p1 - p0) % (p2 - p0));
+		for(int i = 0; i < 3; i++)
+		{
+			bool given = !m_lwObject->normals.empty() && m_lwObject->normals[idx[i]] * m_lwObject->normals[idx[i]] > 0.f;
+			n[i] = given ? m_lwObject->normals[idx[i]] : faceNormal;
+		}
+	}
+	else
+		for(int i = 0; i < 3; i++)
+			n[i] = m_lwObject->normals[idx[i]];
+
+	Vector norm = n[0] * hit->intResult.x + n[1] * hit->intResult.y + n[2] * hit->intResult.z;
 	
 	shader->setNormal(norm);
 
-	if(tex1 != -1 && tex2 != -1 && tex3 != -1)
+	TriangleHitDifferentials diff(m_lwObject->vertices[idx[0]], m_lwObject->vertices[idx[1]], m_lwObject->vertices[idx[2]],
+		hit->ray, hit->intResult.w);
+	if(hit->ray.hasDifferentials)
+		shader->setRayDifferentials(hit->ray, diff.dPdx, diff.dPdy, 
+			normalizedDifferential(norm, diff.differential(n[0], n[1], n[2], diff.dBdx)), 
+			normalizedDifferential(norm, diff.differential(n[0], n[1], n[2], diff.dBdy)));
+
+	if((materialId & NO_TEXCOORDS_FLAG) == 0)
 	{
 		float2 texPos = 
-			m_lwObject->texCoords[tex1] * hit->intResult.x +  
-			m_lwObject->texCoords[tex2] * hit->intResult.y +  
-			m_lwObject->texCoords[tex3] * hit->intResult.z;
+			m_lwObject->texCoords[idx[0]] * hit->intResult.x +  
+			m_lwObject->texCoords[idx[1]] * hit->intResult.y +  
+			m_lwObject->texCoords[idx[2]] * hit->intResult.z;
+
+		//The footprint of the pixel in the texture
+		const float2 &t0 = m_lwObject->texCoords[idx[0]], &t1 = m_lwObject->texCoords[idx[1]], &t2 = m_lwObject->texCoords[idx[2]];
+		shader->setTextureCoord(texPos, diff.differential(t0, t1, t2, diff.dBdx), diff.differential(t0, t1, t2, diff.dBdy));
 
-		shader->setTextureCoord(texPos);
+		//for bump mapping
+		const PackedUnitVector *tangents = &m_lwObject->tangents[2 * hit->face];
+		shader->setTangents(tangents[0].unpack(), tangents[1].unpack());
 	}
 
-	
-	//set pu, pv for bump mapping
-	shader->setPuPv(m_lwObject->vertices[vert1], m_lwObject->vertices[vert2],m_lwObject->vertices[vert3],
-			m_lwObject->texCoords[tex1], m_lwObject->texCoords[tex2], m_lwObject->texCoords[tex3]);
 	return shader;
 
 }
 
 
-Primitive::IntRet LWObject::Face::intersect(const Ray& _ray, float _previousBestDistance) const
+Primitive::IntRet LWObject::Mesh::intersect(size_t _face, const Ray& _ray, float _previousBestDistance) const
 {
 	IntRet ret;
 
-	float4 inter = 
-		intersectTriangle(
-			m_lwObject->vertices[vert1], m_lwObject->vertices[vert2], m_lwObject->vertices[vert3], _ray
-		);
+	float4 inter = intersectTriangle(vertex(_face, 0), vertex(_face, 1), vertex(_face, 2), _ray);
 
 	ret.distance = inter.w;
 
@@ -54,25 +76,61 @@ Primitive::IntRet LWObject::Face::intersect(const Ray& _ray, float _previousBest
 		SmartPtr<ExtHitPoint> hit = new ExtHitPoint;
 		ret.hitInfo = hit;
 		hit->intResult = inter;
+		hit->face = (uint)_face;
+		hit->ray = _ray;
 	}
 
 	return ret;
 }
 
 
-BBox LWObject::Face::getBBox() const
+BBox LWObject::Mesh::getBBox(size_t _face) const
 {
 
 	BBox ret = BBox::empty();
-	ret.extend(m_lwObject->vertices[vert1]);
-	ret.extend(m_lwObject->vertices[vert2]);
-	ret.extend(m_lwObject->vertices[vert3]);
+	ret.extend(vertex(_face, 0));
+	ret.extend(vertex(_face, 1));
+	ret.extend(vertex(_face, 2));
 
 	return ret;
 }
 
-void LWObject::addReferencesToScene(std::vector<Primitive*> &_scene) const
+BBox LWObject::Mesh::clipBBox(size_t _face, const BBox &_box) const
+{
+	return clipTriangle(vertex(_face, 0), vertex(_face, 1), vertex(_face, 2), _box);
+}
+
+size_t LWObject::Mesh::getPrimitiveCount() const
+{
+	return m_lwObject->materialIds.size();
+}
+
+Primitive::IntRet LWObject::Mesh::intersect(const Ray& _ray, float _previousBestDistance) const
+{
+	return m_bvh.intersect(_ray, _previousBestDistance).ret;
+}
+
+BBox LWObject::Mesh::getBBox() const
+{
+	return m_bvh.getSceneBBox();
+}
+
+void LWObject::Mesh::buildIndex()
+{
+	m_bvh.settings = m_lwObject->bvhSettings;
+	if(m_lwObject->bvhCacheFile.empty())
+		m_bvh.build(*this);
+	else
+		m_bvh.buildCached(*this, m_lwObject->bvhCacheFile);
+}
+
+void LWObject::addReferencesToScene(std::vector<Primitive*> &_scene)
 {
-	for(std::vector<Face>::const_iterator it = faces.begin(); it != faces.end(); it++)
-		_scene.push_back((Primitive*)&*it);
+	if(materialIds.empty())
+		return;
+
+	if(!mesh.hasIndex())
+		mesh.buildIndex();
+
+	_scene.push_back(&mesh);
 }
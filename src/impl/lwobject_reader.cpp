@@ -2,9 +2,14 @@
 #include "stdafx.h"
 #include "lwobject.h"
 #include "phong_shaders.h"
+#include "../core/util.h"
 
 #ifdef __unix
 #include <libgen.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #define _strnicmp strncasecmp
 #endif
 
@@ -19,6 +24,133 @@ namespace objLoaderUtil
 {
 	typedef std::map<std::string, size_t> t_materialMap;
 
+	//A corner of a face, as given in the file. The indices are -1 if not given.
+	//	Corners with equal indices share one vertex of the mesh.
+	struct FaceCorner
+	{
+		size_t pos, tex, norm;
+		size_t corner; // in LWObject::faces
+
+		bool operator< (const FaceCorner &_other) const
+		{
+			if(pos != _other.pos) return pos < _other.pos;
+			if(tex != _other.tex) return tex < _other.tex;
+			return norm < _other.norm;
+		}
+	};
+
+	//Files smaller than this are not split for parsing
+	const size_t _MIN_CHUNK_SIZE = 1 << 20;
+
+	//strtod for plain decimal numbers with at most 15 significant digits and
+	//	a power of ten of at most 22. Both are exact doubles then, so one
+	//	multiplication or division rounds like strtod. The rest goes to strtod.
+	//Details: Clinger - How to Read Floating Point Numbers Accurately, PLDI 1990
+	double parseDouble(const char *_str, char **_end)
+	{
+		static const double powersOf10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 
+			1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+		const char *cur = _str;
+		bool negative = *cur == '-';
+		if(*cur == '-' || *cur == '+')
+			cur++;
+
+		unsigned long long mantissa = 0;
+		int significantDigits = 0, digits = 0, exponent = 0;
+		for(; isdigit(*cur); cur++, digits++)
+			if(mantissa != 0 || *cur != '0')
+			{
+				mantissa = mantissa * 10 + (*cur - '0');
+				significantDigits++;
+			}
+
+		if(*cur == '.')
+			for(cur++; isdigit(*cur); cur++, digits++)
+				if(mantissa != 0 || *cur != '0')
+				{
+					mantissa = mantissa * 10 + (*cur - '0');
+					significantDigits++;
+					exponent--;
+				}
+				else
+					exponent--;
+
+		if(tolower(*cur) == 'e')
+		{
+			const char *expCur = cur + 1;
+			bool negativeExp = *expCur == '-';
+			if(*expCur == '-' || *expCur == '+')
+				expCur++;
+
+			if(isdigit(*expCur))
+			{
+				int exp = 0;
+				for(; isdigit(*expCur) && exp < 1000; expCur++)
+					exp = exp * 10 + (*expCur - '0');
+				if(isdigit(*expCur))
+					return strtod(_str, _end);
+
+				exponent += negativeExp ? -exp : exp;
+				cur = expCur;
+			}
+		}
+
+		//Hexadecimal numbers, inf and nan are left to strtod as well
+		if(digits == 0 || significantDigits > 15 || exponent < -22 || exponent > 22 || tolower(*cur) == 'x')
+			return strtod(_str, _end);
+
+		double ret = (double)mantissa;
+		ret = exponent < 0 ? ret / powersOf10[-exponent] : ret * powersOf10[exponent];
+
+		*_end = (char*)cur;
+		return negative ? -ret : ret;
+	}
+
+	//strtol(_str, _end, 10) for plain numbers, the rest goes to strtol
+	int parseInt(const char *_str, char **_end)
+	{
+		const char *cur = _str;
+		bool negative = *cur == '-';
+		if(*cur == '-' || *cur == '+')
+			cur++;
+
+		if(!isdigit(*cur))
+			return strtol(_str, _end, 10);
+
+		int digits = 0;
+		long ret = 0;
+		for(; isdigit(*cur) && digits < 9; cur++, digits++)
+			ret = ret * 10 + (*cur - '0');
+
+		if(isdigit(*cur))
+			return strtol(_str, _end, 10);
+
+		*_end = (char*)cur;
+		return (int)(negative ? -ret : ret);
+	}
+
+	//The contents of a part of an .obj file
+	struct ObjChunk
+	{
+		LWObject::t_pointVector vertices;
+		LWObject::t_vectVector normals;
+		LWObject::t_texCoordVector texCoords;
+		//3 per face, corner is relative to the chunk
+		std::vector<FaceCorner> corners;
+		//Per face: index into materialNames, -1 for the material in use at the start of the chunk
+		std::vector<int> faceMaterials;
+		//The materials used in the chunk, in the order of their first use
+		std::vector<std::string> materialNames;
+		int lastMaterial;
+		std::vector<std::string> matFiles;
+		//Line numbers relative to the chunk, true for unknown entities
+		std::vector<std::pair<size_t, bool> > errors;
+		size_t lineCount;
+
+		ObjChunk() : lastMaterial(-1), lineCount(0) {}
+	};
+
 	void skipWS(const char * &aStr)
 	{
 		while(isspace(*aStr))
@@ -59,6 +191,128 @@ namespace objLoaderUtil
 	}
 
 
+	//64 bit FNV-1a
+	void hashBytes(unsigned long long &_hash, const void *_data, size_t _size)
+	{
+		const byte *data = (const byte*)_data;
+		for(size_t i = 0; i < _size; i++)
+		{
+			_hash ^= data[i];
+			_hash *= 1099511628211ULL;
+		}
+	}
+
+	//Identifies the tile file of an image: the name, size and modification 
+	//	time of the image and the texel format. False if the image cannot be found
+	bool hashTextureSource(const std::string &_fileName, TiledImage::Format _format, unsigned long long &_hash)
+	{
+#ifdef __unix
+		struct stat st;
+		if(stat(_fileName.c_str(), &st) != 0)
+			return false;
+
+		_hash = 14695981039346656037ULL;
+		unsigned long long key[3] = {(unsigned long long)st.st_size, (unsigned long long)st.st_mtime, (unsigned long long)_format};
+		hashBytes(_hash, _fileName.c_str(), _fileName.size() + 1);
+		hashBytes(_hash, key, sizeof(key));
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	//The PNGs have 8 bits per component, so the texels are kept in 8 bits too.
+	//	Bump maps only need one component. Both tile formats sample faster 
+	//	than the row major float4 image, see bench/texture_sampling. With a _cache the texture is 
+	//	mapped from its tile file, which is written first if needed.
+	//	_bakeDerivatives bakes from the decoded image, never from the tiles: 
+	//	the other threads add blocks to _cache meanwhile, and reading the tiles 
+	//	would page in the whole texture. So the image is decoded even if the 
+	//	tile file is there
+	SmartPtr<Texture> loadTexture(const std::string &_fileName, bool _bumpMap, bool _bakeDerivatives, TileCache *_cache)
+	{
+		TiledImage::Format format = _bumpMap ? TiledImage::TF_R8 : TiledImage::TF_RGB8;
+		SmartPtr<Texture> ret = new Texture;
+
+		std::string tileFile = _fileName + ".tiles";
+		unsigned long long sourceStamp;
+		bool useTileFile = _cache != NULL && hashTextureSource(_fileName, format, sourceStamp);
+		bool opened = useTileFile && ret->openTiles(tileFile, sourceStamp, _cache);
+		if(opened && !_bakeDerivatives)
+			return ret;
+
+		SmartPtr<Image> img = new Image;
+		img->readPNG(_fileName);
+		ret->image = img;
+		if(_bakeDerivatives)
+			ret->bakeDerivatives();
+
+		if(opened)
+		{
+			ret->image = SmartPtr<Image>();
+			return ret;
+		}
+
+		ret->generateMipMaps();
+		ret->generateTiledLayout(format);
+
+		//The lookups only need the tiles
+		ret->image = SmartPtr<Image>();
+		ret->mipMaps.clear();
+
+		//If the file cannot be written, the texture just stays in memory
+		if(useTileFile && ret->writeTiles(tileFile, sourceStamp))
+			ret->openTiles(tileFile, sourceStamp, _cache);
+
+		return ret;
+	}
+
+	//Decodes the textures of the materials which have a texture file but no
+	//	texture yet. The files are decoded in parallel, each one once: materials
+	//	referencing the same file share the texture.
+	void loadTextures(LWObject::t_materialVector &_materials, TileCache *_cache, bool _bakeBumpMaps)
+	{
+		std::map<std::string, size_t> textureIndices;
+		std::vector<std::string> textureFiles;
+		//A file can be shared by a bump map and a color texture
+		std::vector<bool> bumpMapOnly, bumpMap;
+		std::vector<std::pair<SmartPtr<Texture>*, size_t> > slots;
+
+		for(LWObject::t_materialVector::iterator it = _materials.begin(); it != _materials.end(); it++)
+		{
+			SmartPtr<Texture> *textures[4] = {&it->diffuseTexture, &it->specularTexture, &it->ambientTexture, &it->bumpTexture};
+			const std::string *files[4] = {&it->diffuseTextureFile, &it->specularTextureFile, &it->ambientTextureFile, &it->bumpTextureFile};
+			for(int i = 0; i < 4; i++)
+			{
+				if(files[i]->empty() || textures[i]->data() != NULL)
+					continue;
+
+				std::map<std::string, size_t>::iterator index = textureIndices.find(*files[i]);
+				if(index == textureIndices.end())
+				{
+					index = textureIndices.insert(std::make_pair(*files[i], textureFiles.size())).first;
+					textureFiles.push_back(*files[i]);
+					bumpMapOnly.push_back(true);
+					bumpMap.push_back(false);
+				}
+				if(textures[i] != &it->bumpTexture)
+					bumpMapOnly[index->second] = false;
+				else
+					bumpMap[index->second] = true;
+				slots.push_back(std::make_pair(textures[i], index->second));
+			}
+		}
+
+		std::vector<SmartPtr<Texture> > decoded(textureFiles.size());
+
+#pragma omp parallel for schedule(dynamic)
+		for(int i = 0; i < (int)textureFiles.size(); i++)
+			decoded[i] = loadTexture(textureFiles[i], bumpMapOnly[i], _bakeBumpMaps && bumpMap[i], _cache);
+
+		for(size_t i = 0; i < slots.size(); i++)
+			*slots[i].first = decoded[slots[i].second];
+	}
+
 	void readMtlLib(const std::string &_fileName, LWObject::t_materialVector &_matVector, const t_materialMap &_matMap)
 	{
 		std::ifstream matInput(_fileName.c_str(), std::ios_base::in);
@@ -148,7 +402,11 @@ namespace objLoaderUtil
 					((_strnicmp(cmd, "map_Ka", 6) == 0) ? _matVector[curMtl].ambientTexture : 
 					((_strnicmp(cmd, "map_Ks", 6) == 0) ? _matVector[curMtl].specularTexture :
 					_matVector[curMtl].bumpTexture));
-
+				std::string &destFile = 
+					(_strnicmp(cmd, "map_Kd", 6) == 0) ?  _matVector[curMtl].diffuseTextureFile : 
+					((_strnicmp(cmd, "map_Ka", 6) == 0) ? _matVector[curMtl].ambientTextureFile : 
+					((_strnicmp(cmd, "map_Ks", 6) == 0) ? _matVector[curMtl].specularTextureFile :
+					_matVector[curMtl].bumpTextureFile));
 
 				bool bumpTex = _strnicmp(cmd,  "map_bump", 8) == 0 || _strnicmp(cmd,  "bump", 4) == 0;
 				if(_strnicmp(cmd,  "bump", 4) == 0)
@@ -175,14 +433,9 @@ namespace objLoaderUtil
 
 				skipWS(cmd);
 				std::string fn = endSpaceTrimmed(cmd);
-				std::string pngFileName = getDirName(_fileName) + _PATH_SEPARATOR + fn;
-
-				SmartPtr<Image> img = new Image;
-				img->readPNG(pngFileName);
-				SmartPtr<Texture> tex = new Texture;
-				tex->image = img;
-
-				dest = tex;
+				//Decoded later by loadTextures, together with all other textures
+				destFile = getDirName(_fileName) + _PATH_SEPARATOR + fn;
+				dest = SmartPtr<Texture>();
 			}
 
 			continue;
@@ -190,149 +443,119 @@ parse_err_found:
 			std::cerr << "Error at line " << curLine << "in " << _fileName <<std::endl;
 		}
 	}
-}
 
-using namespace objLoaderUtil;
-
-void LWObject::read(const std::string &_fileName, bool _createDefautShaders)
-{
-	std::ifstream inputStream(_fileName.c_str(), std::ios_base::in);
-	std::string buf;
-
-	const size_t _MAX_BUF = 8192;
-	const size_t _MAX_IDX = _MAX_BUF / 2;
+	//Parses the lines in [_begin, _end) of an .obj file
+	void parseObjChunk(const char *_begin, const char *_end, ObjChunk &_chunk)
+	{
+		std::string buf;
 
-	float tmpVert[4];
-	size_t tmpIdx[_MAX_IDX * 3];
-	int tmpVertPointer, tmpIdxPtr, vertexType;
-	size_t curMat = 0, curLine = 0;
-	std::vector<std::string> matFiles;
+		const size_t _MAX_BUF = 8192;
+		const size_t _MAX_IDX = _MAX_BUF / 2;
 
-	Material defaultMaterial;
-	defaultMaterial.name = "Default_{B77D36AF-37CE-4144-B772-E0F00F626DF6}";
-	defaultMaterial.diffuseCoeff = float4(1, 1, 1, 0);
-	defaultMaterial.specularCoeff = float4(0, 0, 0, 0);
-	defaultMaterial.specularExp = 0;
-	defaultMaterial.ambientCoeff = float4(0.2f, 0.2f, 0.2f, 0);
-	materials.push_back(defaultMaterial);
+		float tmpVert[4];
+		size_t tmpIdx[_MAX_IDX * 3];
+		int tmpVertPointer, tmpIdxPtr, vertexType;
+		int curMat = -1;
+		size_t curLine = 0;
+		std::map<std::string, int> localMaterials;
 
-	materialMap.insert(std::make_pair("defaultMaterial.name", (size_t)0));
+		_chunk.lastMaterial = -1;
 
-	if(inputStream.fail())
-		throw std::runtime_error("Error opening .obj file");
+		for(const char *lineStart = _begin; lineStart < _end;)
+		{
+			const char *lineEnd = (const char*)memchr(lineStart, '\n', _end - lineStart);
+			if(lineEnd == NULL)
+				lineEnd = _end;
 
-	while(!inputStream.eof())
-	{
-		std::getline(inputStream, buf);
-		const char *cmdString = buf.c_str();
+			buf.assign(lineStart, lineEnd);
+			lineStart = lineEnd + 1;
+			const char *cmdString = buf.c_str();
 
-		curLine++;
-		skipWS(cmdString);
-		switch(tolower(*cmdString))
-		{
-		case 0:
-			break;
-		case 'v':
-			cmdString++;
+			curLine++;
+			skipWS(cmdString);
 			switch(tolower(*cmdString))
 			{
-				case 'n': vertexType = 1; cmdString++; break;
-				case 't': vertexType = 2; cmdString++; break;
-				default: 
-					if(isspace(*cmdString))
-						vertexType = 0;
-					else
-						goto parse_err_found;
-			}
-
-			tmpVertPointer = 0;
-			for(;;)
-			{
-				skipWS(cmdString);
-				if(*cmdString == 0)
-					break;
-
-				char *newCmdString;
-				float flt = (float)strtod(cmdString, &newCmdString);
-				if(newCmdString == cmdString)
-					goto parse_err_found;
-
-				cmdString = newCmdString;
-
-				if(tmpVertPointer >= sizeof(tmpVert) / sizeof(float))
-					goto parse_err_found;
-
-				tmpVert[tmpVertPointer++] = flt;
-			}
+			case 0:
+				break;
+			case 'v':
+				cmdString++;
+				switch(tolower(*cmdString))
+				{
+					case 'n': vertexType = 1; cmdString++; break;
+					case 't': vertexType = 2; cmdString++; break;
+					default: 
+						if(isspace(*cmdString))
+							vertexType = 0;
+						else
+							goto parse_err_found;
+				}
 
-			if(vertexType != 2 && tmpVertPointer != 3 || vertexType == 2 && tmpVertPointer < 2)
-				goto parse_err_found;
+				tmpVertPointer = 0;
+				for(;;)
+				{
+					skipWS(cmdString);
+					if(*cmdString == 0)
+						break;
 
+					char *newCmdString;
+					float flt = (float)parseDouble(cmdString, &newCmdString);
+					if(newCmdString == cmdString)
+						goto parse_err_found;
 
-			if(vertexType == 0)
-				vertices.push_back(*(Point*)tmpVert);
-			else if (vertexType == 1)
-				normals.push_back(*(Vector*)tmpVert);
-			else
-				texCoords.push_back(*(float2*)tmpVert);
+					cmdString = newCmdString;
 
-			break;
+					if(tmpVertPointer >= sizeof(tmpVert) / sizeof(float))
+						goto parse_err_found;
 
-		case 'f':
-			cmdString++;
-			if(tolower(*cmdString) == 'o')
-				cmdString++;
-			skipWS(cmdString);
+					tmpVert[tmpVertPointer++] = flt;
+				}
 
-			tmpIdxPtr = 0;
-			for(;;)
-			{
-				if(tmpIdxPtr + 3 >= sizeof(tmpIdx) / sizeof(int))
+				if(vertexType != 2 && tmpVertPointer != 3 || vertexType == 2 && tmpVertPointer < 2)
 					goto parse_err_found;
 
-				char *newCmdString;
-				int idx = strtol(cmdString, &newCmdString, 10);
-
-				if(cmdString == newCmdString)
-					goto parse_err_found;
 
-				cmdString = newCmdString;
+				if(vertexType == 0)
+					_chunk.vertices.push_back(*(Point*)tmpVert);
+				else if (vertexType == 1)
+					_chunk.normals.push_back(*(Vector*)tmpVert);
+				else
+					_chunk.texCoords.push_back(*(float2*)tmpVert);
 
-				tmpIdx[tmpIdxPtr++] = idx - 1;
+				break;
 
+			case 'f':
+				cmdString++;
+				if(tolower(*cmdString) == 'o')
+					cmdString++;
 				skipWS(cmdString);
 
-				if(*cmdString == '/')
+				tmpIdxPtr = 0;
+				for(;;)
 				{
-					cmdString++;
-
-					skipWS(cmdString);
-					if(*cmdString != '/')
-					{
-						idx = strtol(cmdString, &newCmdString, 10);
+					if(tmpIdxPtr + 3 >= sizeof(tmpIdx) / sizeof(int))
+						goto parse_err_found;
 
-						if(cmdString == newCmdString)
-							goto parse_err_found;
+					char *newCmdString;
+					int idx = parseInt(cmdString, &newCmdString);
 
-						cmdString = newCmdString;
+					if(cmdString == newCmdString)
+						goto parse_err_found;
 
-						tmpIdx[tmpIdxPtr++] = idx - 1;
-					}
-					else
-						tmpIdx[tmpIdxPtr++] = -1;
+					cmdString = newCmdString;
 
+					tmpIdx[tmpIdxPtr++] = idx - 1;
 
 					skipWS(cmdString);
+
 					if(*cmdString == '/')
 					{
 						cmdString++;
-						skipWS(cmdString);
-						idx = strtol(cmdString, &newCmdString, 10);
 
-						//Do ahead lookup of one number
-						skipWS((const char * &)newCmdString);
-						if(isdigit(*newCmdString) || (*newCmdString == 0 || *newCmdString == '#') && cmdString != newCmdString)
+						skipWS(cmdString);
+						if(*cmdString != '/')
 						{
+							idx = parseInt(cmdString, &newCmdString);
+
 							if(cmdString == newCmdString)
 								goto parse_err_found;
 
@@ -342,124 +565,626 @@ void LWObject::read(const std::string &_fileName, bool _createDefautShaders)
 						}
 						else
 							tmpIdx[tmpIdxPtr++] = -1;
+
+
+						skipWS(cmdString);
+						if(*cmdString == '/')
+						{
+							cmdString++;
+							skipWS(cmdString);
+							idx = parseInt(cmdString, &newCmdString);
+
+							//Do ahead lookup of one number
+							skipWS((const char * &)newCmdString);
+							if(isdigit(*newCmdString) || (*newCmdString == 0 || *newCmdString == '#') && cmdString != newCmdString)
+							{
+								if(cmdString == newCmdString)
+									goto parse_err_found;
+
+								cmdString = newCmdString;
+
+								tmpIdx[tmpIdxPtr++] = idx - 1;
+							}
+							else
+								tmpIdx[tmpIdxPtr++] = -1;
+						}
+						else
+							tmpIdx[tmpIdxPtr++] = -1;
 					}
 					else
+					{
+						tmpIdx[tmpIdxPtr++] = -1;
 						tmpIdx[tmpIdxPtr++] = -1;
+					}
+
+					skipWS(cmdString);
+					if(*cmdString == 0)
+						break;
 				}
-				else
+
+				if(tmpIdxPtr <= 6)
+					goto parse_err_found;
+
+				for(int idx = 3; idx < tmpIdxPtr - 3; idx += 3)
 				{
-					tmpIdx[tmpIdxPtr++] = -1;
-					tmpIdx[tmpIdxPtr++] = -1;
-				}
+					const size_t *faceIdx[3] = {tmpIdx, tmpIdx + idx, tmpIdx + idx + 3};
 
-				skipWS(cmdString);
-				if(*cmdString == 0)
-					break;
-			}
+					for(int i = 0; i < 3; i++)
+					{
+						FaceCorner c;
+						c.pos = faceIdx[i][0];
+						c.tex = faceIdx[i][1];
+						c.norm = faceIdx[i][2];
+						c.corner = _chunk.corners.size();
+						_chunk.corners.push_back(c);
+					}
 
-			if(tmpIdxPtr <= 6)
-				goto parse_err_found;
+					_chunk.faceMaterials.push_back(curMat);
+				}
+				break;
 
-			for(int idx = 3; idx < tmpIdxPtr - 3; idx += 3)
-			{
-				Face t(this);
-				t.material = curMat;
-				memcpy(&t.vert1, tmpIdx, 3 * sizeof(size_t));
-				memcpy(&t.vert2, tmpIdx + idx, 6 * sizeof(size_t));
+			case 'o':
+			case 'g':
+			case 's': //?
+			case '#':
+				//Not supported
+				break;
 
-				faces.push_back(t);
-			}
-			break;
+			default:
+				if(_strnicmp(cmdString, "usemtl", 6) == 0)
+				{
+					cmdString += 6;
+					skipWS(cmdString);
+					std::string name = endSpaceTrimmed(cmdString);
+					if(name.empty())
+						goto parse_err_found;
 
-		case 'o':
-		case 'g':
-		case 's': //?
-		case '#':
-			//Not supported
-			break;
+					if(localMaterials.find(name) == localMaterials.end())
+					{
+						_chunk.materialNames.push_back(name);
+						localMaterials[name] = (int)_chunk.materialNames.size() - 1;
+					}
 
-		default:
-			if(_strnicmp(cmdString, "usemtl", 6) == 0)
-			{
-				cmdString += 6;
-				skipWS(cmdString);
-				std::string name = endSpaceTrimmed(cmdString);
-				if(name.empty())
-					goto parse_err_found;
+					curMat = localMaterials[name];
+					_chunk.lastMaterial = curMat;
+				}
+				else if(_strnicmp(cmdString, "mtllib", 6) == 0)
+				{
+					cmdString += 6;
+					skipWS(cmdString);
+					std::string name = endSpaceTrimmed(cmdString);
+					if(name.empty())
+						goto parse_err_found;
 
-				if(materialMap.find(name) == materialMap.end())
+					_chunk.matFiles.push_back(name);
+				}
+				else
 				{
-					materials.push_back(Material(name));
-					materialMap[name] = materials.size() - 1;
+					_chunk.errors.push_back(std::make_pair(curLine, true));
 				}
-
-				curMat = materialMap[name];
 			}
-			else if(_strnicmp(cmdString, "mtllib", 6) == 0)
-			{
-				cmdString += 6;
-				skipWS(cmdString);
-				std::string name = endSpaceTrimmed(cmdString);
-				if(name.empty())
-					goto parse_err_found;
 
-				matFiles.push_back(name);
+			continue;
+parse_err_found:
+			_chunk.errors.push_back(std::make_pair(curLine, false));
+		}
+
+		_chunk.lineCount = curLine;
+	}
+	void createDefaultShaders(LWObject::t_materialVector &_materials)
+	{
+		for(LWObject::t_materialVector::iterator it = _materials.begin(); it != _materials.end(); it++)
+		{
+			SmartPtr<BumpTexturePhongShader> shader = new BumpTexturePhongShader;
+			it->shader = shader;
+			if((it->bumpTexture).data() != NULL) {
+				shader->bumpTexture = it->bumpTexture;
+				shader->bumpIntensity = it->bumpIntensity;
 			}
-			else
+			shader->diffuseCoef = it->diffuseCoeff;
+			shader->ambientCoef = it->ambientCoeff;
+			shader->specularCoef = it->specularCoeff;
+			shader->specularExponent = it->specularExp;
+			shader->diffTexture = it->diffuseTexture;
+			shader->specTexture = it->specularTexture;
+			shader->amibientTexture = it->ambientTexture;
+		}
+	}
+
+	//Increase when the layout of the mesh cache or the parser output changes
+	enum {_MESH_CACHE_VERSION = 3, _MESH_CACHE_MAGIC = 0x48534D4C /*LMSH*/};
+
+	//File layout: the header, the vertices, the normals (none or one per vertex), 
+	//	the texture coordinates, faces and tangents, the material ids padded to 4 bytes, 
+	//	a MeshCacheMaterial per material, then the strings: the .mtl files, then 
+	//	the name and the diffuse, specular, ambient and bump texture files of each 
+	//	material, each one terminated by a 0
+	struct MeshCacheHeader
+	{
+		uint magic, version;
+		unsigned long long sourceHash;
+		unsigned long long vertexCount, normalCount, faceCount, materialCount, mtlFileCount, stringBytes;
+	};
+
+	struct MeshCacheMaterial
+	{
+		float4 diffuseCoeff, specularCoeff, ambientCoeff;
+		float bumpIntensity, specularExp;
+	};
+
+	enum {_STRINGS_PER_MATERIAL = 5};
+
+	size_t meshCacheSize(const MeshCacheHeader &_header)
+	{
+		size_t materialIdBytes = ((size_t)_header.faceCount * sizeof(unsigned short) + 3) & ~(size_t)3;
+		return sizeof(MeshCacheHeader) 
+			+ (size_t)_header.vertexCount * (sizeof(Point) + sizeof(float2)) + (size_t)_header.normalCount * sizeof(Vector)
+			+ (size_t)_header.faceCount * (3 * sizeof(uint) + 2 * sizeof(PackedUnitVector)) + materialIdBytes
+			+ (size_t)_header.materialCount * sizeof(MeshCacheMaterial) + (size_t)_header.stringBytes;
+	}
+
+	//Hash of the names, sizes and modification times of the source files.
+	//	False if one of them cannot be found
+	bool hashSourceFiles(const std::string &_objFileName, const std::vector<std::string> &_mtlFileNames, unsigned long long &_hash)
+	{
+#ifdef __unix
+		_hash = 14695981039346656037ULL;
+		uint layout[5] = {_MESH_CACHE_VERSION, sizeof(Point), sizeof(float2), sizeof(PackedUnitVector), sizeof(MeshCacheMaterial)};
+		hashBytes(_hash, layout, sizeof(layout));
+
+		for(size_t i = 0; i <= _mtlFileNames.size(); i++)
+		{
+			const std::string &fileName = i == 0 ? _objFileName : _mtlFileNames[i - 1];
+			struct stat st;
+			if(stat(fileName.c_str(), &st) != 0)
+				return false;
+
+			unsigned long long key[2] = {(unsigned long long)st.st_size, (unsigned long long)st.st_mtime};
+			hashBytes(_hash, fileName.c_str(), fileName.size() + 1);
+			hashBytes(_hash, key, sizeof(key));
+		}
+		return true;
+#else
+		//Without stat there is no cheap way to tell if the files changed, 
+		//	so the cache is not used
+		return false;
+#endif
+	}
+
+	void writeString(std::ostream &_output, const std::string &_str)
+	{
+		_output.write(_str.c_str(), _str.size() + 1);
+	}
+}
+
+using namespace objLoaderUtil;
+
+void LWObject::read(const std::string &_fileName, bool _createDefautShaders)
+{
+	//The cache holds a whole object, so it is only used if nothing was read before
+	bool useMeshCache = !meshCacheFile.empty() && faces.empty() && materials.empty();
+	if(useMeshCache && loadMeshCache(_fileName))
+	{
+		if(_createDefautShaders)
+			createDefaultShaders(materials);
+		return;
+	}
+
+	const char *data = NULL;
+	size_t dataSize = 0;
+
+#ifdef __unix
+	int fd = open(_fileName.c_str(), O_RDONLY);
+	if(fd < 0)
+		throw std::runtime_error("Error opening .obj file");
+
+	struct stat st;
+	void *mapping = MAP_FAILED;
+	if(fstat(fd, &st) == 0 && st.st_size > 0)
+	{
+		dataSize = (size_t)st.st_size;
+		mapping = mmap(NULL, dataSize, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(mapping == MAP_FAILED)
+		{
+			close(fd);
+			throw std::runtime_error("Error opening .obj file");
+		}
+		data = (const char*)mapping;
+		madvise(mapping, dataSize, MADV_SEQUENTIAL);
+	}
+	close(fd);
+#else
+	std::ifstream inputStream(_fileName.c_str(), std::ios_base::in | std::ios_base::binary);
+	if(inputStream.fail())
+		throw std::runtime_error("Error opening .obj file");
+
+	std::vector<char> fileContents(
+		(std::istreambuf_iterator<char>(inputStream)), std::istreambuf_iterator<char>());
+	data = fileContents.empty() ? NULL : &fileContents.front();
+	dataSize = fileContents.size();
+#endif
+
+	//Line aligned chunks, parsed in parallel
+	size_t chunkCount = 1;
+#ifdef _OPENMP
+	chunkCount = 4 * omp_get_max_threads();
+#endif
+	chunkCount = std::max((size_t)1, std::min(chunkCount, dataSize / _MIN_CHUNK_SIZE));
+
+	std::vector<const char*> chunkBounds(chunkCount + 1);
+	chunkBounds[0] = data;
+	chunkBounds[chunkCount] = data + dataSize;
+	for(size_t i = 1; i < chunkCount; i++)
+	{
+		const char *bound = std::max(data + dataSize / chunkCount * i, chunkBounds[i - 1]);
+		const char *lineEnd = (const char*)memchr(bound, '\n', data + dataSize - bound);
+		chunkBounds[i] = lineEnd != NULL ? lineEnd + 1 : data + dataSize;
+	}
+
+	std::vector<ObjChunk> chunks(chunkCount);
+
+#pragma omp parallel for schedule(dynamic)
+	for(int i = 0; i < (int)chunkCount; i++)
+		parseObjChunk(chunkBounds[i], chunkBounds[i + 1], chunks[i]);
+
+#ifdef __unix
+	if(data != NULL)
+		munmap(mapping, dataSize);
+#endif
+
+	Material defaultMaterial;
+	defaultMaterial.name = "Default_{B77D36AF-37CE-4144-B772-E0F00F626DF6}";
+	defaultMaterial.diffuseCoeff = float4(1, 1, 1, 0);
+	defaultMaterial.specularCoeff = float4(0, 0, 0, 0);
+	defaultMaterial.specularExp = 0;
+	defaultMaterial.ambientCoeff = float4(0.2f, 0.2f, 0.2f, 0);
+	materials.push_back(defaultMaterial);
+
+	materialMap.insert(std::make_pair("defaultMaterial.name", (size_t)0));
+
+	//The vertex data as given in the file, indexed separately by the faces
+	t_pointVector objVertices;
+	t_vectVector objNormals;
+	t_texCoordVector objTexCoords;
+	std::vector<FaceCorner> corners;
+	std::vector<std::string> matFiles;
+
+	size_t vertexCnt = 0, normalCnt = 0, texCoordCnt = 0, cornerCnt = 0;
+	for(size_t i = 0; i < chunkCount; i++)
+	{
+		vertexCnt += chunks[i].vertices.size();
+		normalCnt += chunks[i].normals.size();
+		texCoordCnt += chunks[i].texCoords.size();
+		cornerCnt += chunks[i].corners.size();
+	}
+	objVertices.reserve(vertexCnt);
+	objNormals.reserve(normalCnt);
+	objTexCoords.reserve(texCoordCnt);
+	corners.reserve(cornerCnt);
+	materialIds.reserve(materialIds.size() + cornerCnt / 3);
+
+	//Merge the chunks in the file order. The vertex indices in the faces are 
+	//	absolute, only the corners, materials and line numbers are chunk relative
+	size_t curMat = 0, lineOffset = 0;
+	for(size_t i = 0; i < chunkCount; i++)
+	{
+		ObjChunk &chunk = chunks[i];
+
+		for(size_t e = 0; e < chunk.errors.size(); e++)
+			std::cerr << (chunk.errors[e].second ? "Unknown entity at line " : "Error at line ") 
+				<< lineOffset + chunk.errors[e].first << std::endl;
+		lineOffset += chunk.lineCount;
+
+		std::vector<size_t> chunkMaterials(chunk.materialNames.size());
+		for(size_t m = 0; m < chunk.materialNames.size(); m++)
+		{
+			const std::string &name = chunk.materialNames[m];
+			if(materialMap.find(name) == materialMap.end())
 			{
-				std::cerr << "Unknown entity at line " << curLine << std::endl;
+				materials.push_back(Material(name));
+				materialMap[name] = materials.size() - 1;
 			}
+
+			chunkMaterials[m] = materialMap[name];
 		}
 
-		continue;
-parse_err_found:
-		std::cerr << "Error at line " << curLine << std::endl;
-	}
+		size_t cornerOffset = corners.size();
+		for(size_t face = 0; face < chunk.faceMaterials.size(); face++)
+		{
+			const FaceCorner *c = &chunk.corners[3 * face];
+			bool textured = c[0].tex != (size_t)-1 && c[1].tex != (size_t)-1 && c[2].tex != (size_t)-1;
+			bool smooth = c[0].norm != (size_t)-1 && c[1].norm != (size_t)-1 && c[2].norm != (size_t)-1;
+			size_t faceMat = chunk.faceMaterials[face] == -1 ? curMat : chunkMaterials[chunk.faceMaterials[face]];
+
+			_ASSERT(faceMat <= MATERIAL_ID_MASK);
+			materialIds.push_back((unsigned short)(faceMat | (textured ? 0 : NO_TEXCOORDS_FLAG) 
+				| (smooth ? 0 : FACE_NORMAL_FLAG)));
+		}
+
+		for(size_t c = 0; c < chunk.corners.size(); c++)
+		{
+			corners.push_back(chunk.corners[c]);
+			corners.back().corner += cornerOffset;
+		}
 
+		if(chunk.lastMaterial != -1)
+			curMat = chunkMaterials[chunk.lastMaterial];
+
+		objVertices.insert(objVertices.end(), chunk.vertices.begin(), chunk.vertices.end());
+		objNormals.insert(objNormals.end(), chunk.normals.begin(), chunk.normals.end());
+		objTexCoords.insert(objTexCoords.end(), chunk.texCoords.begin(), chunk.texCoords.end());
+		matFiles.insert(matFiles.end(), chunk.matFiles.begin(), chunk.matFiles.end());
+
+		//Keeps the peak memory down
+		chunk = ObjChunk();
+	}
 
 	std::string objDir = getDirName(_fileName);
+	std::vector<std::string> mtlFileNames;
 
 	for(std::vector<std::string>::const_iterator it = matFiles.begin(); it != matFiles.end(); it++)
 	{
 		std::string mtlFileName = objDir + _PATH_SEPARATOR + *it;
 
 		readMtlLib(mtlFileName, materials, materialMap);
+		mtlFileNames.push_back(mtlFileName);
 	}
 
+	loadTextures(materials, textureCache.data(), bakeBumpMaps);
+
 	if(_createDefautShaders)
+		createDefaultShaders(materials);
+
+	//Build the vertex buffers, one vertex per distinct corner: position, texture
+	//	coordinates and normal. A corner without normal gets a zero normal, see
+	//	FACE_NORMAL_FLAG. Without any normals in the object, the normal buffer 
+	//	stays empty
+	bool withNormals = !objNormals.empty() || !normals.empty();
+	if(withNormals)
+		normals.resize(vertices.size(), Vector(0, 0, 0));
+
+	std::sort(corners.begin(), corners.end());
+	size_t firstCorner = faces.size();
+	faces.resize(firstCorner + corners.size());
+	for(size_t i = 0; i < corners.size(); i++)
 	{
-		
-		for(t_materialVector::iterator it = materials.begin(); it != materials.end(); it++)
+		const FaceCorner &c = corners[i];
+		if(i == 0 || corners[i - 1] < c)
 		{
-			SmartPtr<BumpTexturePhongShader> shader = new BumpTexturePhongShader;
-			it->shader = shader;
-			if((it->bumpTexture).data() != NULL) {
-				shader->bumpTexture = it->bumpTexture;
-				shader->bumpIntensity = it->bumpIntensity;
-			}
-			shader->diffuseCoef = it->diffuseCoeff;
-			shader->ambientCoef = it->ambientCoeff;
-			shader->specularCoef = it->specularCoeff;
-			shader->specularExponent = it->specularExp;
-			shader->diffTexture = it->diffuseTexture;
-			shader->specTexture = it->specularTexture;
-			shader->amibientTexture = it->ambientTexture;
+			vertices.push_back(objVertices[c.pos]);
+			if(withNormals)
+				normals.push_back(c.norm != (size_t)-1 ? objNormals[c.norm] : Vector(0, 0, 0));
+			texCoords.push_back(c.tex != (size_t)-1 ? objTexCoords[c.tex] : float2(0, 0));
+		}
+
+		faces[firstCorner + c.corner] = (uint)vertices.size() - 1;
+	}
+
+	computeTangents(firstCorner / 3);
+
+	if(useMeshCache)
+		saveMeshCache(_fileName, mtlFileNames);
+}
+
+void LWObject::computeTangents(size_t _firstFace)
+{
+	tangents.resize(2 * materialIds.size());
+
+#pragma omp parallel for
+	for(int face = (int)_firstFace; face < (int)materialIds.size(); face++)
+	{
+		const uint *idx = &faces[3 * face];
+		const Point &p1 = vertices[idx[0]], &p2 = vertices[idx[1]], &p3 = vertices[idx[2]];
+		Vector ret[2];
+		if(!getTextureTangents(p1, p2, p3, texCoords[idx[0]], texCoords[idx[1]], texCoords[idx[2]], ret[0], ret[1]))
+		{
+			//Without usable texture coordinates, any two directions in the plane of 
+			//	the face do. Their cross product is the normal of the face
+			Vector n = ~((p2 - p1) % (p3 - p1));
+			ret[0] = ~(n % (fabs(n.x) > 0.9f ? Vector(0, 1, 0) : Vector(1, 0, 0)));
+			ret[1] = n % ret[0];
 		}
 
+		tangents[2 * face] = PackedUnitVector(ret[0]);
+		tangents[2 * face + 1] = PackedUnitVector(ret[1]);
+	}
+}
+
+bool LWObject::loadMeshCache(const std::string &_objFileName)
+{
+	const byte *data = NULL;
+	size_t dataSize = 0;
+
+#ifdef __unix
+	int fd = open(meshCacheFile.c_str(), O_RDONLY);
+	if(fd < 0)
+		return false;
+
+	struct stat st;
+	void *mapping = MAP_FAILED;
+	if(fstat(fd, &st) == 0 && st.st_size > 0)
+	{
+		dataSize = (size_t)st.st_size;
+		mapping = mmap(NULL, dataSize, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	close(fd);
+
+	if(mapping == MAP_FAILED)
+		return false;
+	data = (const byte*)mapping;
+#else
+	std::ifstream input(meshCacheFile.c_str(), std::ios_base::in | std::ios_base::binary);
+	if(input.fail())
+		return false;
+
+	std::vector<byte> fileContents(
+		(std::istreambuf_iterator<char>(input)), std::istreambuf_iterator<char>());
+	if(fileContents.empty())
+		return false;
+	data = &fileContents.front();
+	dataSize = fileContents.size();
+#endif
+
+	bool valid = dataSize >= sizeof(MeshCacheHeader);
+	MeshCacheHeader header;
+	if(valid)
+	{
+		memcpy(&header, data, sizeof(MeshCacheHeader));
+		valid = header.magic == _MESH_CACHE_MAGIC && header.version == _MESH_CACHE_VERSION
+			&& (header.normalCount == 0 || header.normalCount == header.vertexCount)
+			&& header.stringBytes > 0 && dataSize == meshCacheSize(header);
+	}
+
+	//All strings must be terminated inside the file
+	const char *strings = (const char*)data + dataSize - (valid ? header.stringBytes : 0);
+	valid = valid && strings[header.stringBytes - 1] == 0 && (size_t)std::count(strings, strings + header.stringBytes, 0)
+		== header.mtlFileCount + _STRINGS_PER_MATERIAL * header.materialCount;
+
+	//The key: are the source files the same as when the cache was written?
+	std::vector<std::string> mtlFileNames;
+	for(size_t i = 0; valid && i < header.mtlFileCount; i++)
+	{
+		mtlFileNames.push_back(strings);
+		strings += mtlFileNames.back().size() + 1;
 	}
 
-	for(t_faceVector::iterator it = faces.begin(); it != faces.end(); it++)
+	unsigned long long sourceHash;
+	valid = valid && hashSourceFiles(_objFileName, mtlFileNames, sourceHash) && sourceHash == header.sourceHash;
+
+	if(valid)
 	{
-		if(it->norm1 == -1 || it->norm2 == -1 || it->norm3 == -1)
+		size_t vertexCount = (size_t)header.vertexCount, normalCount = (size_t)header.normalCount;
+		size_t faceCount = (size_t)header.faceCount;
+		const Point *vertexData = (const Point*)(data + sizeof(MeshCacheHeader));
+		const Vector *normalData = (const Vector*)(vertexData + vertexCount);
+		const float2 *texCoordData = (const float2*)(normalData + normalCount);
+		const uint *faceData = (const uint*)(texCoordData + vertexCount);
+		const PackedUnitVector *tangentData = (const PackedUnitVector*)(faceData + 3 * faceCount);
+		const unsigned short *materialIdData = (const unsigned short*)(tangentData + 2 * faceCount);
+		const MeshCacheMaterial *materialData = (const MeshCacheMaterial*)((const byte*)materialIdData 
+			+ ((faceCount * sizeof(unsigned short) + 3) & ~(size_t)3));
+
+		vertices.assign(vertexData, vertexData + vertexCount);
+		normals.assign(normalData, normalData + normalCount);
+		texCoords.assign(texCoordData, texCoordData + vertexCount);
+		faces.assign(faceData, faceData + 3 * faceCount);
+		tangents.assign(tangentData, tangentData + 2 * faceCount);
+		materialIds.assign(materialIdData, materialIdData + faceCount);
+
+		materials.resize((size_t)header.materialCount);
+		for(size_t i = 0; i < materials.size(); i++)
 		{
-			Vector e1 = vertices[it->vert2] - vertices[it->vert1];
-			Vector e2 = vertices[it->vert3] - vertices[it->vert1];
-			Vector n = ~(e1 % e2);
-			if(it->norm1 == -1) it->norm1 = normals.size();
-			if(it->norm2 == -1) it->norm2 = normals.size();
-			if(it->norm3 == -1) it->norm3 = normals.size();
-
-			normals.push_back(n);
+			Material &mat = materials[i];
+			std::string *matStrings[_STRINGS_PER_MATERIAL] = {&mat.name, 
+				&mat.diffuseTextureFile, &mat.specularTextureFile, &mat.ambientTextureFile, &mat.bumpTextureFile};
+			for(int j = 0; j < _STRINGS_PER_MATERIAL; j++)
+			{
+				*matStrings[j] = strings;
+				strings += matStrings[j]->size() + 1;
+			}
+
+			mat.diffuseCoeff = materialData[i].diffuseCoeff;
+			mat.specularCoeff = materialData[i].specularCoeff;
+			mat.ambientCoeff = materialData[i].ambientCoeff;
+			mat.bumpIntensity = materialData[i].bumpIntensity;
+			mat.specularExp = materialData[i].specularExp;
 		}
 	}
+
+#ifdef __unix
+	munmap(mapping, dataSize);
+#endif
+
+	if(!valid)
+		return false;
+
+	//Same as read(): the default material is registered under a fixed name
+	materialMap.insert(std::make_pair("defaultMaterial.name", (size_t)0));
+	for(size_t i = 1; i < materials.size(); i++)
+		materialMap[materials[i].name] = i;
+
+	loadTextures(materials, textureCache.data(), bakeBumpMaps);
+
+	return true;
+}
+
+void LWObject::saveMeshCache(const std::string &_objFileName, const std::vector<std::string> &_mtlFileNames) const
+{
+	MeshCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	header.magic = _MESH_CACHE_MAGIC;
+	header.version = _MESH_CACHE_VERSION;
+	if(!hashSourceFiles(_objFileName, _mtlFileNames, header.sourceHash))
+		return;
+
+	header.vertexCount = vertices.size();
+	header.normalCount = normals.size();
+	header.faceCount = materialIds.size();
+	header.materialCount = materials.size();
+	header.mtlFileCount = _mtlFileNames.size();
+	for(size_t i = 0; i < _mtlFileNames.size(); i++)
+		header.stringBytes += _mtlFileNames[i].size() + 1;
+	for(t_materialVector::const_iterator it = materials.begin(); it != materials.end(); it++)
+		header.stringBytes += it->name.size() + it->diffuseTextureFile.size() + it->specularTextureFile.size()
+			+ it->ambientTextureFile.size() + it->bumpTextureFile.size() + _STRINGS_PER_MATERIAL;
+
+	//Write to a temporary file first, so that concurrent readers
+	//	never see a partially written cache
+	std::string tmpFileName = meshCacheFile + ".tmp";
+	{
+		std::ofstream output(tmpFileName.c_str(), std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+		if(output.fail())
+		{
+			std::cerr << "Could not write mesh cache " << meshCacheFile << std::endl;
+			return;
+		}
+
+		output.write((const char*)&header, sizeof(header));
+		if(!vertices.empty())
+		{
+			output.write((const char*)&vertices.front(), vertices.size() * sizeof(Point));
+			if(!normals.empty())
+				output.write((const char*)&normals.front(), normals.size() * sizeof(Vector));
+			output.write((const char*)&texCoords.front(), texCoords.size() * sizeof(float2));
+		}
+		if(!materialIds.empty())
+		{
+			output.write((const char*)&faces.front(), faces.size() * sizeof(uint));
+			output.write((const char*)&tangents.front(), tangents.size() * sizeof(PackedUnitVector));
+			output.write((const char*)&materialIds.front(), materialIds.size() * sizeof(unsigned short));
+			if(materialIds.size() % 2 != 0)
+				output.write("\0\0", 2);
+		}
+
+		for(t_materialVector::const_iterator it = materials.begin(); it != materials.end(); it++)
+		{
+			MeshCacheMaterial mat;
+			mat.diffuseCoeff = it->diffuseCoeff;
+			mat.specularCoeff = it->specularCoeff;
+			mat.ambientCoeff = it->ambientCoeff;
+			mat.bumpIntensity = it->bumpIntensity;
+			mat.specularExp = it->specularExp;
+			output.write((const char*)&mat, sizeof(mat));
+		}
+
+		for(size_t i = 0; i < _mtlFileNames.size(); i++)
+			writeString(output, _mtlFileNames[i]);
+		for(t_materialVector::const_iterator it = materials.begin(); it != materials.end(); it++)
+		{
+			writeString(output, it->name);
+			writeString(output, it->diffuseTextureFile);
+			writeString(output, it->specularTextureFile);
+			writeString(output, it->ambientTextureFile);
+			writeString(output, it->bumpTextureFile);
+		}
+
+		if(output.fail())
+		{
+			std::cerr << "Could not write mesh cache " << meshCacheFile << std::endl;
+			return;
+		}
+	}
+
+	::remove(meshCacheFile.c_str());
+	::rename(tmpFileName.c_str(), meshCacheFile.c_str());
 }
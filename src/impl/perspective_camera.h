@@ -49,12 +49,23 @@ public:
 	}
 
 
+	const Point& getCenter() const { return m_center; }
+
+	//The angle (in radians) covered by one pixel, at the image center
+	float getPixelAngle() const { return m_stepY.len(); }
+
 	virtual Ray getPrimaryRay(float _x, float _y)
 	{
 		Ray ret;
 		ret.o = m_center;
 		ret.d = m_topLeft + _x * m_stepX + _y * m_stepY;
 
+		//All rays start at the center, the neighbouring pixels are a step away
+		ret.hasDifferentials = true;
+		ret.dodx = ret.dody = Vector(0, 0, 0);
+		ret.dddx = m_stepX;
+		ret.dddy = m_stepY;
+
 		return ret;
 	}
 };
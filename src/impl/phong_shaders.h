@@ -81,20 +81,34 @@ class TexturedPhongShader : public DefaultPhongShader
 {
 protected:
 	float2 m_texCoord; 
+	//The footprint of the pixel, zero if unknown
+	float2 m_dTexCoorddx, m_dTexCoorddy;
 public:
 	SmartPtr<Texture> diffTexture;
 	SmartPtr<Texture> amibientTexture;
 	SmartPtr<Texture> specTexture;
 	
+	TexturedPhongShader() : m_dTexCoorddx(0, 0), m_dTexCoorddy(0, 0) {}
 
-	virtual void setTextureCoord(const float2& _texCoord) { m_texCoord = _texCoord;}
+	virtual void setTextureCoord(const float2& _texCoord) 
+	{ 
+		m_texCoord = _texCoord;
+		m_dTexCoorddx = m_dTexCoorddy = float2(0, 0);
+	}
+
+	virtual void setTextureCoord(const float2& _texCoord, const float2& _dTexCoorddx, const float2& _dTexCoorddy) 
+	{ 
+		m_texCoord = _texCoord;
+		m_dTexCoorddx = _dTexCoorddx;
+		m_dTexCoorddy = _dTexCoorddy;
+	}
 
 	virtual float4 getAmbientCoefficient() const 
 	{ 
 		float4 ret = DefaultPhongShader::getAmbientCoefficient();
 
 		if(amibientTexture.data() != NULL)
-			ret = amibientTexture->sample(m_texCoord);
+			ret = amibientTexture->sample(m_texCoord, m_dTexCoorddx, m_dTexCoorddy);
 
 		return ret;
 	}
@@ -104,10 +118,10 @@ public:
 		DefaultPhongShader::getCoeff(_diffuseCoef, _specularCoef, _specularExponent);
 
 		if(diffTexture.data() != NULL)
-			_diffuseCoef = diffTexture->sample(m_texCoord);
+			_diffuseCoef = diffTexture->sample(m_texCoord, m_dTexCoorddx, m_dTexCoorddy);
 
 		if(specTexture.data() != NULL)
-			_specularCoef = specTexture->sample(m_texCoord);
+			_specularCoef = specTexture->sample(m_texCoord, m_dTexCoorddx, m_dTexCoorddy);
 	}
 
 	
@@ -120,7 +134,7 @@ class BumpTexturePhongShader : public TexturedPhongShader
 {
 public:
 	SmartPtr<Texture> bumpTexture;
-	//vectors (1,0) and (0,1) converted from texture space to object space
+	//vectors (1,0) and (0,1) converted from texture space to object space, see setTangents
 	Vector pu, pv;
 	// to change intensity of bumps. it's not used yet.
 	float bumpIntensity;
@@ -145,31 +159,14 @@ public:
 		return ret;
 	}
 	
-	// convert vectors (1,0) and (0,1) from texture space to object space
+	// vectors (1,0) and (0,1) converted from texture space to object space
 	// than they can be perturbated
 	// details: http://www.irstamek.com/iWeb/Papers/bump-eng.pdf
-	// basically we construct a matrix M that performs trasformatino from texture space T to object space V
-	// M * T = V
-	// M = V * T^(-1)
-	// two first columns of M are the desired vectors
-	virtual void setPuPv(Point x, Point y, Point z, float2 u, float2 v, float2 w)
+	// the primitives compute them once per face, see getTextureTangents
+	virtual void setTangents(const Vector &_tangent, const Vector &_bitangent)
 	{ 
-		Vector vec[3];
-		vec[0] = Vector(u.x, u.y, 1.0f);
-		vec[1] = Vector(v.x, v.y, 1.0f);
-		vec[2] = Vector(w.x, w.y, 1.0f);
-		Matrix t_matrix(vec);
-		t_matrix = t_matrix.inverse();
-		
-		vec[0] = Vector(x[0], x[1], x[2]);
-		vec[1] = Vector(y[0], y[1], y[2]);
-		vec[2] = Vector(z[0], z[1], z[2]);
-		Matrix v_matrix(vec);
-		
-		Matrix m_matrix = v_matrix * t_matrix;
-		
-		pu = ~(m_matrix.v[0]);
-		pv = ~(m_matrix.v[1]);
+		pu = _tangent;
+		pv = _bitangent;
 	}		
 	_IMPLEMENT_CLONE(BumpTexturePhongShader);
 };
@@ -181,6 +178,10 @@ public:
 	// on the side of face normal (n1) and on the other side(n2)
 	float n1, n2; 
 	Point m_position;
+	//The incoming ray and the change of the position and of the normal
+	//	from one pixel to the next, see setRayDifferentials
+	Ray m_ray;
+	Vector m_dPdx, m_dPdy, m_dNdx, m_dNdy;
 	
 	// Details http://www.google.com/url?sa=t&source=web&cd=1&ved=0CBoQFjAA&url=http%3A%2F%2Fgraphics.stanford.edu%2Fcourses%2Fcs148-10-summer%2Fdocs%2F2006--degreve--reflection_refraction.pdf&rct=j&q=reflections%20and%20refractions%20in%20ray%20tracing%20stanford&ei=EeU9TdahF8HNswa-t7X0Bg&usg=AFQjCNGEsxpZBk_m6u_PiM1apLdNPVPajA&cad=rja
 	virtual float4 getIndirectRadiance(const Vector &_out, Integrator *_integrator) const
@@ -221,6 +222,34 @@ public:
 		Ray newray;
 		newray.d = ~(- _out - 2 * cosI * normal);
 		newray.o = m_position + newray.d;
+
+		//The differentials of the reflected and the refracted ray follow from
+		//	differentiating their directions. In x and y: the change of the incoming 
+		//	direction -_out, of the normal and of cosI
+		//Details: Igehy - Tracing Ray Differentials, SIGGRAPH 1999
+		Vector dIn[2], dNormal[2];
+		float dCosI[2];
+		if(m_ray.hasDifferentials)
+		{
+			dIn[0] = m_ray.dddx;
+			dIn[1] = m_ray.dddy;
+			dNormal[0] = front ? m_dNdx : -m_dNdx;
+			dNormal[1] = front ? m_dNdy : -m_dNdy;
+
+			Vector dReflected[2];
+			for(int i = 0; i < 2; i++)
+			{
+				dCosI[i] = -(dNormal[i] * (-_out) + normal * dIn[i]);
+				dReflected[i] = normalizedDifferential(- _out - 2 * cosI * normal, 
+					dIn[i] - 2 * (dCosI[i] * normal + cosI * dNormal[i]));
+			}
+
+			newray.hasDifferentials = true;
+			newray.dodx = m_dPdx + dReflected[0];
+			newray.dody = m_dPdy + dReflected[1];
+			newray.dddx = dReflected[0];
+			newray.dddy = dReflected[1];
+		}
 		
 		// specify actual contribution for no infinite cycles
 		_integrator->addContribution(reflCoef);
@@ -232,6 +261,21 @@ public:
 		if(sinT2 <= 1.0) {
 			float cosT = sqrt(1 - sinT2);
 			newray.d  = nn*(-_out) + (((nn * cosI) - cosT) * normal);
+
+			//The refracted ray starts at the same point as the reflected one. 
+			//	At the critical angle its direction has no derivative
+			newray.hasDifferentials = m_ray.hasDifferentials && cosT > 0.f;
+			if(newray.hasDifferentials)
+			{
+				Vector dRefracted[2];
+				for(int i = 0; i < 2; i++)
+				{
+					float dCosT = nn * nn * cosI * dCosI[i] / cosT;
+					dRefracted[i] = nn * dIn[i] + (nn * dCosI[i] - dCosT) * normal + ((nn * cosI) - cosT) * dNormal[i];
+				}
+				newray.dddx = dRefracted[0];
+				newray.dddy = dRefracted[1];
+			}
 			
 			// specify actual contribution for no infinite cycles
 			_integrator->addContribution(float4::rep(1.0f) - reflCoef);
@@ -246,6 +290,16 @@ public:
 	
 	virtual void setPosition(const Point& _point) { m_position = _point; }
 
+	virtual void setRayDifferentials(const Ray &_ray, const Vector &_dPdx, const Vector &_dPdy, 
+		const Vector &_dNdx, const Vector &_dNdy)
+	{
+		m_ray = _ray;
+		m_dPdx = _dPdx;
+		m_dPdy = _dPdy;
+		m_dNdx = _dNdx;
+		m_dNdy = _dNdy;
+	}
+
 	_IMPLEMENT_CLONE(RRPhongShader);
 };
 
@@ -266,7 +320,7 @@ public:
 		
 		// then we maybe override it
 		if(amibientNoiseTexture.data() != NULL)
-			ret = amibientNoiseTexture->sample(m_texCoord);
+			ret = amibientNoiseTexture->sample(m_texCoord, m_dTexCoorddx, m_dTexCoorddy);
 
 		return ret;
 	}
@@ -276,15 +330,15 @@ public:
 		TexturedPhongShader::getCoeff(_diffuseCoef, _specularCoef, _specularExponent);
 
 		if(diffNoiseTexture.data() != NULL)
-			_diffuseCoef = diffNoiseTexture->sample(m_texCoord);
+			_diffuseCoef = diffNoiseTexture->sample(m_texCoord, m_dTexCoorddx, m_dTexCoorddy);
 
 
 		if(specNoiseTexture.data() != NULL)
-			_specularCoef = specNoiseTexture->sample(m_texCoord);
+			_specularCoef = specNoiseTexture->sample(m_texCoord, m_dTexCoorddx, m_dTexCoorddy);
 	}
 
 	
 	_IMPLEMENT_CLONE(ProceduralPhongShader);
 };
 
-#endif //__INCLUDE_GUARD_810F2AF5_7E81_4F1E_AA05_992B6D2C0016
\ No newline at end of file
+#endif //__INCLUDE_GUARD_810F2AF5_7E81_4F1E_AA05_992B6D2C0016
\ No newline at end of file
@@ -0,0 +1,50 @@
+#ifndef __INCLUDE_GUARD_0C7D5E2B_6F14_4B8A_A3E9_1D52C84B97F6
+#define __INCLUDE_GUARD_0C7D5E2B_6F14_4B8A_A3E9_1D52C84B97F6
+#ifdef _MSC_VER
+	#pragma once
+#endif
+
+#include "../rt/texture.h"
+
+//A Texture baked from another texture, e.g. a procedural one like
+//	CloudTexture. source is sampled once per texel at the chosen
+//	resolution, the lookups are then those of a mip-mapped Texture. It is
+//	tiled in _format, except for TF_RGBA32F: float4 tiles sample slower 
+//	than the row major image, see Texture::generateTiledLayout.
+//	The bake happens in the constructor, in parallel, so construct it 
+//	before rendering
+class BakedTexture : public Texture
+{
+public:
+	SmartPtr<TextureBase> source;
+
+	BakedTexture(TextureBase *_source, uint _width, uint _height, TiledImage::Format _format = TiledImage::TF_RGBA32F)
+		: source(_source)
+	{
+		addressModeX = _source->addressModeX;
+		addressModeY = _source->addressModeY;
+
+		image = new Image(_width, _height);
+
+		//The sample positions which this texture maps to the texel centers
+#pragma omp parallel for schedule(dynamic, 16)
+		for(int y = 0; y < (int)_height; y++)
+			for(uint x = 0; x < _width; x++)
+				(*image)(x, y) = _source->sample(float2(
+					((float)x - _TEXEL_CENTER_OFFS) / (float)_width,
+					((float)y - _TEXEL_CENTER_OFFS) / (float)_height));
+
+		generateMipMaps();
+		if(_format == TiledImage::TF_RGBA32F)
+			return;
+
+		generateTiledLayout(_format);
+
+		//The lookups only need the tiles
+		image = SmartPtr<Image>();
+		mipMaps.clear();
+	}
+};
+
+
+#endif //__INCLUDE_GUARD_0C7D5E2B_6F14_4B8A_A3E9_1D52C84B97F6
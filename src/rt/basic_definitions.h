@@ -87,6 +87,16 @@ public:
 	//	primitive is unbounded
 	virtual BBox getBBox() const = 0;
 
+	//Returns the bounding box of the part of the primitive inside _box.
+	//	Used by the spatial split BVH builder. The default (getBBox() clipped
+	//	to _box) is conservative, triangles override it with exact clipping.
+	virtual BBox clipBBox(const BBox &_box) const
+	{
+		BBox ret = getBBox();
+		ret.clip(_box);
+		return ret;
+	}
+
 	//Intersections are considered "successful", iff the distance to the intersection is 
 	//	bigger than INTEPS() and smaller than FLT_MAX
 	static const float INTEPS() { return 0.0001f;};
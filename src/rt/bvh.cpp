@@ -1,5 +1,13 @@
 #include "stdafx.h"
 #include "bvh.h"
+#include "../core/util.h"
+
+#ifdef __unix
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 namespace bvh_build_internal
 {
@@ -15,14 +23,154 @@ namespace bvh_build_internal
 		Point centroid;
 		size_t origIndex;
 	};
+
+	//Primitive objects, seen as an indexed set by the builders
+	class PrimitiveArray : public IndexedPrimitiveSet
+	{
+		const std::vector<Primitive*> &m_primitives;
+	public:
+		PrimitiveArray(const std::vector<Primitive*> &_primitives) : m_primitives(_primitives) {}
+
+		virtual size_t getPrimitiveCount() const { return m_primitives.size(); }
+
+		virtual BBox getBBox(size_t _index) const { return m_primitives[_index]->getBBox(); }
+
+		virtual BBox clipBBox(size_t _index, const BBox &_box) const { return m_primitives[_index]->clipBBox(_box); }
+
+		virtual Primitive::IntRet intersect(size_t _index, const Ray &_ray, float _previousBestDistance) const
+		{
+			return m_primitives[_index]->intersect(_ray, _previousBestDistance);
+		}
+	};
+}
+
+namespace bvh_cache_internal
+{
+	//Increase when the node layout or the builder changes
+	enum {_CACHE_VERSION = 2, _CACHE_MAGIC = 0x43485642 /*BVHC*/};
+
+	struct CacheHeader
+	{
+		uint magic, version;
+		unsigned long long sceneHash;
+		unsigned long long nodeCount, leafDataCount;
+	};
+
+	//64 bit FNV-1a
+	void hashBytes(unsigned long long &_hash, const void *_data, size_t _size)
+	{
+		const byte *data = (const byte*)_data;
+		for(size_t i = 0; i < _size; i++)
+		{
+			_hash ^= data[i];
+			_hash *= 1099511628211ULL;
+		}
+	}
 }
 
 using namespace bvh_build_internal;
+using namespace bvh_cache_internal;
 
-//An iterative split in the middle build for BVHs
 void BVH::build(const std::vector<Primitive*> &_objects)
 {
-	std::vector<BBox> objectBBoxes(_objects.size());
+	m_primitives = _objects;
+	m_primitiveSet = NULL;
+	buildHierarchy(PrimitiveArray(m_primitives));
+}
+
+void BVH::build(const IndexedPrimitiveSet &_objects)
+{
+	std::vector<Primitive*>().swap(m_primitives);
+	m_primitiveSet = &_objects;
+	buildHierarchy(_objects);
+}
+
+void BVH::buildHierarchy(const IndexedPrimitiveSet &_objects)
+{
+	m_nodes.clear();
+	m_leafData.clear();
+
+	double startTime = wallClock();
+
+	if(settings.method == BM_SpatialSplit)
+		buildSpatialSplit(_objects);
+	else if(settings.method == BM_Linear)
+		buildLinear(_objects);
+	else
+		buildMiddleSplit(_objects);
+
+	if(settings.treeletTimeBudget > 0)
+		optimizeTreelets(settings.treeletTimeBudget);
+
+	updateStats(wallClock() - startTime);
+	m_depth = m_stats.maxDepth;
+	updateTraversalData();
+}
+
+void BVH::updateStats(double _buildTime)
+{
+	m_stats.buildTime = _buildTime;
+	m_stats.nodeCount = m_nodes.size();
+	m_stats.leafCount = 0;
+	m_stats.references = 0;
+	m_stats.maxDepth = 0;
+	m_stats.sahCost = 0.f;
+
+	float rootArea = m_nodes[0].bbox.area();
+	std::vector<std::pair<size_t, size_t> > traverseStack(1, std::make_pair((size_t)0, (size_t)0));
+
+	while(!traverseStack.empty())
+	{
+		const Node &node = m_nodes[traverseStack.back().first];
+		size_t depth = traverseStack.back().second;
+		traverseStack.pop_back();
+
+		m_stats.maxDepth = std::max(m_stats.maxDepth, depth);
+		float relArea = rootArea > 0.f ? node.bbox.area() / rootArea : 1.f;
+
+		if(node.isLeaf())
+		{
+			size_t cnt = 0;
+			for(size_t idx = node.getLeftChildOrLeaf(); m_leafData[idx] != LEAF_END; idx++)
+				cnt++;
+
+			m_stats.leafCount++;
+			m_stats.references += cnt;
+			m_stats.sahCost += relArea * cnt;
+		}
+		else
+		{
+			m_stats.sahCost += relArea;
+			traverseStack.push_back(std::make_pair(node.getLeftChildOrLeaf(), depth + 1));
+			traverseStack.push_back(std::make_pair(node.getLeftChildOrLeaf() + 1, depth + 1));
+		}
+	}
+}
+
+void BVH::updateTraversalData()
+{
+	if(!settings.stacklessTraversal && m_depth < TRAVERSAL_STACK_SIZE)
+	{
+		std::vector<size_t>().swap(m_parents);
+		return;
+	}
+
+	m_parents.resize(m_nodes.size());
+	m_parents[0] = 0;
+	for(size_t i = 0; i < m_nodes.size(); i++)
+	{
+		if(m_nodes[i].isLeaf())
+			continue;
+
+		m_parents[m_nodes[i].getLeftChildOrLeaf()] = i;
+		m_parents[m_nodes[i].getLeftChildOrLeaf() + 1] = i;
+	}
+}
+
+//An iterative split in the middle build for BVHs
+void BVH::buildMiddleSplit(const IndexedPrimitiveSet &_objects)
+{
+	std::vector<BBox> objectBBoxes(_objects.getPrimitiveCount());
 
 	BuildStateStruct curState;
 	curState.centroidBBox = BBox::empty();
@@ -31,7 +179,7 @@ void BVH::build(const std::vector<Primitive*> &_objects)
 
 	for(size_t i = 0; i < objectBBoxes.size(); i++)
 	{
-		objectBBoxes[i] = _objects[i]->getBBox();
+		objectBBoxes[i] = _objects.getBBox(i);
 		
 	    centroids[i].centroid = objectBBoxes[i].min.lerp(objectBBoxes[i].max, 0.5f);
 	    centroids[i].origIndex = i;
@@ -43,7 +191,8 @@ void BVH::build(const std::vector<Primitive*> &_objects)
 	curState.nodeIndex = 0;
 	m_nodes.resize(1);
 
-	std::stack<BuildStateStruct> buildStack;
+	std::vector<BuildStateStruct> buildStack;
+	buildStack.reserve(TRAVERSAL_STACK_SIZE);
 
 	const float _EPS = 0.0000001f;
 
@@ -65,16 +214,16 @@ void BVH::build(const std::vector<Primitive*> &_objects)
 			for(size_t i = curState.segmentStart; i < curState.segmentEnd; i++)
 			{
 				m_nodes[curState.nodeIndex].bbox.extend(objectBBoxes[centroids[i].origIndex]);
-				m_leafData.push_back(_objects[centroids[i].origIndex]);
+				m_leafData.push_back((uint)centroids[i].origIndex);
 			}
 
-			m_leafData.push_back(NULL);
+			m_leafData.push_back(LEAF_END);
 
 			if(buildStack.empty())
 				break;
 
-			curState = buildStack.top();
-			buildStack.pop();
+			curState = buildStack.back();
+			buildStack.pop_back();
 
 			continue;
 		}
@@ -121,49 +270,44 @@ void BVH::build(const std::vector<Primitive*> &_objects)
 		curState.nodeIndex = m_nodes.size();
 		rightState.nodeIndex = curState.nodeIndex + 1;
 		
-		buildStack.push(rightState);
+		buildStack.push_back(rightState);
 
 		m_nodes.resize(rightState.nodeIndex + 1);
 	}
 }
 
-//Recursive intersection
 BVH::IntersectionReturn BVH::intersect(const Ray &_ray, float _previousBestDistance) const
+{
+	if(!m_parents.empty())
+		return intersectStackless(_ray, _previousBestDistance);
+
+	return intersectWithStack(_ray, _previousBestDistance);
+}
+
+//Iterative intersection with a fixed size stack of the far children
+BVH::IntersectionReturn BVH::intersectWithStack(const Ray &_ray, float _previousBestDistance) const
 {
 	Primitive::IntRet bestHit;
 	bestHit.distance = _previousBestDistance;
 
-	Primitive *bestPrimitive = NULL;
+	size_t bestIndex = (size_t)-1;
 
-	std::stack<size_t> traverseStack;
+	size_t traverseStack[TRAVERSAL_STACK_SIZE];
+	size_t stackSize = 0;
 
 	size_t curNode = 0;
-	size_t closestFace = (size_t)-1;
 
 	for(;;)
 	{
 		const BVH::Node& node = m_nodes[curNode];
 		if(node.isLeaf())
 		{
-			size_t idx = node.getLeftChildOrLeaf();
-			while(m_leafData[idx] != NULL)
-			{
-				Primitive::IntRet curRet = m_leafData[idx]->intersect(_ray, bestHit.distance);
-
-				if(curRet.distance > Primitive::INTEPS() && curRet.distance < bestHit.distance)
-				{
-					bestHit = curRet;
-					bestPrimitive = m_leafData[idx];
-				}
-
-				idx++;
-			}
+			intersectLeaf(&m_leafData[node.getLeftChildOrLeaf()], _ray, bestHit, bestIndex);
 
-			if(traverseStack.empty())
+			if(stackSize == 0)
 				break;
 
-			curNode = traverseStack.top();
-			traverseStack.pop();
+			curNode = traverseStack[--stackSize];
 		}
 		else
 		{
@@ -190,22 +334,327 @@ BVH::IntersectionReturn BVH::intersect(const Ray &_ray, float _previousBestDista
 				size_t farNode = curNode + 1;
 				if(intLeft.first > intRight.first)
 					std::swap(curNode, farNode);
-				traverseStack.push(farNode);
+
+				//At most one node per level is pushed
+				_ASSERT(stackSize < TRAVERSAL_STACK_SIZE);
+				traverseStack[stackSize++] = farNode;
 			}
 			else
 			{
-				if(traverseStack.empty())
+				if(stackSize == 0)
 					break;
 
-				curNode = traverseStack.top();
-				traverseStack.pop();
+				curNode = traverseStack[--stackSize];
+			}
+		}
+	}
+
+	BVH::IntersectionReturn ret;
+	ret.ret = bestHit;
+	ret.index = bestIndex;
+	ret.primitive = bestIndex != (size_t)-1 && m_primitiveSet == NULL ? m_primitives[bestIndex] : NULL;
+	return ret;
+}
+
+//Stackless intersection over the parent links. The near child of a node
+//	is chosen by the ray direction only, so the traversal can tell on the way
+//	up whether the sibling was already visited.
+//Details: Hapala et al. - Efficient Stack-less BVH Traversal for Ray Tracing, SCCG 2011
+BVH::IntersectionReturn BVH::intersectStackless(const Ray &_ray, float _previousBestDistance) const
+{
+	enum {FROM_PARENT, FROM_SIBLING, FROM_CHILD};
+
+	Primitive::IntRet bestHit;
+	bestHit.distance = _previousBestDistance;
+
+	size_t bestIndex = (size_t)-1;
+
+	size_t curNode = 0;
+	int state = FROM_SIBLING;
+
+	for(;;)
+	{
+		const BVH::Node &node = m_nodes[curNode];
+
+		if(state == FROM_CHILD)
+		{
+			if(curNode == 0)
+				break;
+
+			size_t parent = m_parents[curNode];
+			if(curNode == nearChild(parent, _ray))
+			{
+				curNode = farChild(parent, _ray);
+				state = FROM_SIBLING;
 			}
+			else
+				curNode = parent;
+
+			continue;
+		}
+
+		std::pair<float, float> intNode = node.bbox.intersect(_ray);
+		intNode.first = std::max(Primitive::INTEPS(), intNode.first);
+		intNode.second = std::min(intNode.second, bestHit.distance);
+
+		bool descend = intNode.first < intNode.second + Primitive::INTEPS();
+
+		if(descend && !node.isLeaf())
+		{
+			curNode = nearChild(curNode, _ray);
+			state = FROM_PARENT;
+			continue;
+		}
+
+		if(descend)
+			intersectLeaf(&m_leafData[node.getLeftChildOrLeaf()], _ray, bestHit, bestIndex);
+
+		if(state == FROM_PARENT)
+		{
+			curNode = farChild(m_parents[curNode], _ray);
+			state = FROM_SIBLING;
+		}
+		else
+		{
+			curNode = m_parents[curNode];
+			state = FROM_CHILD;
 		}
 	}
 
 	BVH::IntersectionReturn ret;
 	ret.ret = bestHit;
-	ret.primitive = bestPrimitive;
+	ret.index = bestIndex;
+	ret.primitive = bestIndex != (size_t)-1 && m_primitiveSet == NULL ? m_primitives[bestIndex] : NULL;
 	return ret;
 }
 
+void BVH::merge(const std::vector<Primitive*> &_objects)
+{
+	if(_objects.empty())
+		return;
+
+	if(empty())
+	{
+		build(_objects);
+		return;
+	}
+
+	_ASSERT(m_primitiveSet == NULL);
+
+	BVH sub;
+	sub.settings = settings;
+	sub.build(_objects);
+
+	//The old root moves to the end of the node array and the root of the
+	//	sub-hierarchy goes right after it, so they become siblings.
+	//	All other nodes of the sub-hierarchy are shifted by the same offset.
+	const size_t NODE_TYPE_MASK = ((size_t)1 << Node::LEAF_FLAG_BIT);
+	size_t oldRootIndex = m_nodes.size();
+	size_t nodeOffset = oldRootIndex + 1;
+	size_t leafOffset = m_leafData.size();
+	uint primitiveOffset = (uint)m_primitives.size();
+
+	m_nodes.push_back(m_nodes[0]);
+	m_nodes.reserve(nodeOffset + sub.m_nodes.size());
+	for(std::vector<Node>::const_iterator it = sub.m_nodes.begin(); it != sub.m_nodes.end(); it++)
+	{
+		Node node = *it;
+		if(node.isLeaf())
+			node.dataIndex = (node.getLeftChildOrLeaf() + leafOffset) | NODE_TYPE_MASK;
+		else
+			node.dataIndex += nodeOffset;
+		m_nodes.push_back(node);
+	}
+
+	for(std::vector<uint>::const_iterator it = sub.m_leafData.begin(); it != sub.m_leafData.end(); it++)
+		m_leafData.push_back(*it == LEAF_END ? (uint)LEAF_END : *it + primitiveOffset);
+	m_primitives.insert(m_primitives.end(), _objects.begin(), _objects.end());
+
+	m_nodes[0].bbox.extend(sub.m_nodes[0].bbox);
+	m_nodes[0].dataIndex = oldRootIndex;
+
+	m_depth = std::max(m_depth, sub.m_depth) + 1;
+	updateTraversalData();
+}
+
+void BVH::remove(const std::vector<Primitive*> &_objects)
+{
+	std::set<Primitive*> removed(_objects.begin(), _objects.end());
+
+	//Compact every leaf list in place. The freed slots at the end 
+	//	of a list are filled with LEAF_END.
+	size_t writePtr = 0;
+	for(size_t readPtr = 0; readPtr < m_leafData.size(); readPtr++)
+	{
+		if(m_leafData[readPtr] == LEAF_END)
+		{
+			while(writePtr <= readPtr)
+				m_leafData[writePtr++] = LEAF_END;
+		}
+		else if(removed.find(m_primitives[m_leafData[readPtr]]) == removed.end())
+			m_leafData[writePtr++] = m_leafData[readPtr];
+	}
+}
+
+bool BVH::empty() const
+{
+	if(m_nodes.empty())
+		return true;
+
+	return m_nodes[0].isLeaf() && m_leafData[m_nodes[0].getLeftChildOrLeaf()] == LEAF_END;
+}
+
+unsigned long long BVH::computeSceneHash(const IndexedPrimitiveSet &_objects) const
+{
+	unsigned long long hash = 14695981039346656037ULL;
+
+	//Builder settings
+	uint layout[3] = {_CACHE_VERSION, sizeof(Node), sizeof(size_t)};
+	hashBytes(hash, layout, sizeof(layout));
+	hashBytes(hash, &settings.method, sizeof(settings.method));
+	hashBytes(hash, &settings.spatialSplitBudget, sizeof(settings.spatialSplitBudget));
+	hashBytes(hash, &settings.linearMortonBits, sizeof(settings.linearMortonBits));
+	hashBytes(hash, &settings.linearSAHTopBits, sizeof(settings.linearSAHTopBits));
+	hashBytes(hash, &settings.treeletTimeBudget, sizeof(settings.treeletTimeBudget));
+
+	for(size_t i = 0; i < _objects.getPrimitiveCount(); i++)
+	{
+		BBox box = _objects.getBBox(i);
+		hashBytes(hash, &box.min, sizeof(Point));
+		hashBytes(hash, &box.max, sizeof(Point));
+	}
+
+	return hash;
+}
+
+void BVH::buildCached(const std::vector<Primitive*> &_objects, const std::string &_cacheFile)
+{
+	m_primitives = _objects;
+	m_primitiveSet = NULL;
+	buildHierarchyCached(PrimitiveArray(m_primitives), _cacheFile);
+}
+
+void BVH::buildCached(const IndexedPrimitiveSet &_objects, const std::string &_cacheFile)
+{
+	std::vector<Primitive*>().swap(m_primitives);
+	m_primitiveSet = &_objects;
+	buildHierarchyCached(_objects, _cacheFile);
+}
+
+void BVH::buildHierarchyCached(const IndexedPrimitiveSet &_objects, const std::string &_cacheFile)
+{
+	double startTime = wallClock();
+	unsigned long long sceneHash = computeSceneHash(_objects);
+
+	if(loadCache(_cacheFile, _objects, sceneHash))
+	{
+		updateStats(wallClock() - startTime);
+		m_depth = m_stats.maxDepth;
+		updateTraversalData();
+		return;
+	}
+
+	buildHierarchy(_objects);
+	saveCache(_cacheFile, sceneHash);
+}
+
+bool BVH::loadCache(const std::string &_fileName, const IndexedPrimitiveSet &_objects, unsigned long long _sceneHash)
+{
+	const byte *data = NULL;
+	size_t dataSize = 0;
+
+#ifdef __unix
+	int fd = open(_fileName.c_str(), O_RDONLY);
+	if(fd < 0)
+		return false;
+
+	struct stat st;
+	void *mapping = MAP_FAILED;
+	if(fstat(fd, &st) == 0 && st.st_size > 0)
+	{
+		dataSize = (size_t)st.st_size;
+		mapping = mmap(NULL, dataSize, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	close(fd);
+
+	if(mapping == MAP_FAILED)
+		return false;
+	data = (const byte*)mapping;
+#else
+	std::ifstream input(_fileName.c_str(), std::ios_base::in | std::ios_base::binary);
+	if(input.fail())
+		return false;
+
+	std::vector<byte> fileContents(
+		(std::istreambuf_iterator<char>(input)), std::istreambuf_iterator<char>());
+	if(fileContents.empty())
+		return false;
+	data = &fileContents.front();
+	dataSize = fileContents.size();
+#endif
+
+	bool valid = dataSize >= sizeof(CacheHeader);
+	CacheHeader header;
+	if(valid)
+	{
+		memcpy(&header, data, sizeof(CacheHeader));
+		valid = header.magic == _CACHE_MAGIC && header.version == _CACHE_VERSION 
+			&& header.sceneHash == _sceneHash && header.nodeCount > 0
+			&& dataSize == sizeof(CacheHeader) + header.nodeCount * sizeof(Node) + header.leafDataCount * sizeof(uint);
+	}
+
+	if(valid)
+	{
+		const Node *nodes = (const Node*)(data + sizeof(CacheHeader));
+		const uint *leafIndices = (const uint*)(nodes + header.nodeCount);
+
+		m_nodes.assign(nodes, nodes + header.nodeCount);
+		m_leafData.assign(leafIndices, leafIndices + header.leafDataCount);
+
+		//The leaf entries are indices into _objects, like m_leafData
+		for(size_t i = 0; valid && i < m_leafData.size(); i++)
+			valid = m_leafData[i] == LEAF_END || m_leafData[i] < _objects.getPrimitiveCount();
+
+		if(!valid)
+		{
+			m_nodes.clear();
+			m_leafData.clear();
+		}
+	}
+
+#ifdef __unix
+	munmap(mapping, dataSize);
+#endif
+
+	return valid;
+}
+
+void BVH::saveCache(const std::string &_fileName, unsigned long long _sceneHash) const
+{
+	CacheHeader header;
+	header.magic = _CACHE_MAGIC;
+	header.version = _CACHE_VERSION;
+	header.sceneHash = _sceneHash;
+	header.nodeCount = m_nodes.size();
+	header.leafDataCount = m_leafData.size();
+
+	//Write to a temporary file first, so that concurrent readers
+	//	never see a partially written cache
+	std::string tmpFileName = _fileName + ".tmp";
+	{
+		std::ofstream output(tmpFileName.c_str(), std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+		if(output.fail())
+		{
+			std::cerr << "Could not write BVH cache " << _fileName << std::endl;
+			return;
+		}
+
+		output.write((const char*)&header, sizeof(header));
+		output.write((const char*)&m_nodes.front(), m_nodes.size() * sizeof(Node));
+		if(!m_leafData.empty())
+			output.write((const char*)&m_leafData.front(), m_leafData.size() * sizeof(uint));
+	}
+
+	::remove(_fileName.c_str());
+	::rename(tmpFileName.c_str(), _fileName.c_str());
+}
@@ -7,6 +7,23 @@
 #include "../core/memory.h"
 #include "basic_definitions.h"
 
+//Bounded primitives addressed by index, e.g. the triangles of a mesh.
+//	A BVH can be built over them without a Primitive object per element.
+class IndexedPrimitiveSet
+{
+public:
+	virtual ~IndexedPrimitiveSet() {}
+
+	virtual size_t getPrimitiveCount() const = 0;
+
+	virtual BBox getBBox(size_t _index) const = 0;
+
+	//The bounding box of the part of the primitive inside _box, see Primitive::clipBBox
+	virtual BBox clipBBox(size_t _index, const BBox &_box) const = 0;
+
+	virtual Primitive::IntRet intersect(size_t _index, const Ray &_ray, float _previousBestDistance) const = 0;
+};
+
 //A bounding volume hierarchy
 class BVH
 {
@@ -32,23 +49,194 @@ class BVH
 
 	};
 
+	//Terminates the list of primitives of a leaf in m_leafData
+	enum {LEAF_END = 0xFFFFFFFF};
+
 	std::vector<Node> m_nodes;
-	std::vector<Primitive*> m_leafData;
+	//Indices of the primitives in the leaves, each leaf list ends with LEAF_END
+	std::vector<uint> m_leafData;
+
+	//The indexed primitives: either Primitive objects or an external set
+	std::vector<Primitive*> m_primitives;
+	const IndexedPrimitiveSet *m_primitiveSet;
+
+	//Depth of the deepest leaf, the root has depth 0
+	size_t m_depth;
+	//Parent of each node, the root is its own parent. Only filled
+	//	if the stackless traversal is used
+	std::vector<size_t> m_parents;
+
+	//The builders behind build()
+	void buildHierarchy(const IndexedPrimitiveSet &_objects);
+	void buildHierarchyCached(const IndexedPrimitiveSet &_objects, const std::string &_cacheFile);
+	void buildMiddleSplit(const IndexedPrimitiveSet &_objects);
+	void buildSpatialSplit(const IndexedPrimitiveSet &_objects);
+	void buildLinear(const IndexedPrimitiveSet &_objects);
+
+	bool optimizeTreelet(size_t _root);
+	void updateStats(double _buildTime);
+	void updateTraversalData();
+
+	bool loadCache(const std::string &_fileName, const IndexedPrimitiveSet &_objects, unsigned long long _sceneHash);
+	void saveCache(const std::string &_fileName, unsigned long long _sceneHash) const;
 
 public:
 	struct IntersectionReturn
 	{
+		//NULL for a BVH over an IndexedPrimitiveSet
 		Primitive *primitive;
+		//Index of the primitive in the objects the BVH was built from
+		size_t index;
 		Primitive::IntRet ret;
 	};
 
+	//The algorithm used by build()
+	enum BuildMethod
+	{
+		BM_MiddleSplit, //Split in the middle of the centroid bounds. Fast to build
+		BM_SpatialSplit, //SAH with spatial splits (SBVH). Primitives can be referenced
+			//from several leaves, which pays off for large or skewed triangles
+		BM_Linear, //Morton code sorted LBVH (HLBVH if linearSAHTopBits > 0). Fastest
+			//to build, meant for scenes which are rebuilt every frame
+	};
+
+	struct BuildSettings
+	{
+		BuildMethod method;
+
+		//BM_SpatialSplit only: how many extra references spatial splits may
+		//	create, relative to the number of primitives (0.3 -> at most 30% more)
+		float spatialSplitBudget;
+
+		//BM_Linear only: length of the morton codes, 30 or 63 bits
+		int linearMortonBits;
+		//BM_Linear only: the primitives are grouped into clusters by this many
+		//	top bits of their morton codes, and the hierarchy over the clusters
+		//	is built with SAH. 0 disables the SAH top levels
+		int linearSAHTopBits;
+
+		//If > 0, the hierarchy is improved with optimizeTreelets() after
+		//	the build, for at most this many seconds
+		double treeletTimeBudget;
+
+		//Always use the stackless traversal. Otherwise it is only used for
+		//	trees deeper than TRAVERSAL_STACK_SIZE. Does not affect the hierarchy itself
+		bool stacklessTraversal;
+
+		BuildSettings() 
+			: method(BM_MiddleSplit), spatialSplitBudget(0.3f), 
+			linearMortonBits(30), linearSAHTopBits(0), treeletTimeBudget(0),
+			stacklessTraversal(false)
+		{}
+	};
+
+	//Statistics about the last full build
+	struct BuildStats
+	{
+		//In seconds. For hierarchies loaded from a cache - the load time
+		double buildTime;
+		size_t nodeCount, leafCount, references;
+		size_t maxDepth;
+		//Traversal and intersection costs are both 1:
+		//	sum of Area(node) / Area(root) over all inner nodes
+		//	+ sum of Area(leaf) / Area(root) * primitives(leaf) over all leaves
+		float sahCost;
+
+		void print() const
+		{
+			std::cout << "BVH: " << nodeCount << " nodes, " << leafCount << " leaves, "
+				<< references << " references, depth " << maxDepth << ", SAH cost " << sahCost
+				<< ", built in " << buildTime << "s" << std::endl;
+		}
+	};
+
+	//Size of the traversal stack, which lives on the call stack of intersect()
+	enum {TRAVERSAL_STACK_SIZE = 64};
+
+	BuildSettings settings;
+
+	BVH() : m_primitiveSet(NULL), m_depth(0) {}
+
 	//Builds the hierarchy over a set of bounded primitives
 	void build(const std::vector<Primitive*> &_objects);
 
-	//Intersects a ray with the BVH.
+	//Same for primitives addressed by index. The set must outlive the BVH
+	void build(const IndexedPrimitiveSet &_objects);
+
+	//Builds a sub-hierarchy over a batch of bounded primitives and hangs it,
+	//	together with the existing hierarchy, under a new root. The existing
+	//	nodes are not touched, so the cost depends only on the size of the batch.
+	//	Only for hierarchies over Primitive objects, like remove().
+	void merge(const std::vector<Primitive*> &_objects);
+
+	//Removes primitives from the leaves. Node bounding boxes are not refitted,
+	//	they stay conservative until the next full build.
+	void remove(const std::vector<Primitive*> &_objects);
+
+	//Same as build, but first tries to load the hierarchy from _cacheFile.
+	//	The cache is keyed by a hash of the primitive bounds and the builder
+	//	settings, so it is only used if the scene did not change. After
+	//	a build the cache file is (re)written.
+	void buildCached(const std::vector<Primitive*> &_objects, const std::string &_cacheFile);
+	void buildCached(const IndexedPrimitiveSet &_objects, const std::string &_cacheFile);
+
+	//Hash of the primitive bounding boxes and the builder settings
+	unsigned long long computeSceneHash(const IndexedPrimitiveSet &_objects) const;
+
+	//Restructures small treelets (up to 7 leaves) to minimize their SAH cost,
+	//	bottom-up, with the treelets of each tree level processed in parallel.
+	//	Does a few rounds over the tree, stops early once _timeBudget seconds are used up.
+	//Details: Karras, Aila - Fast Parallel Construction of High-Quality Bounding Volume Hierarchies, HPG 2013
+	void optimizeTreelets(double _timeBudget);
+
+	//True if the hierarchy was never built or contains no primitives
+	bool empty() const;
+
+	//Intersects a ray with the BVH. Does not allocate any memory: uses a fixed
+	//	size stack, or a stackless traversal over parent links for the deepest trees
 	IntersectionReturn intersect(const Ray &_ray, float _previousBestDistance) const;
 
 	BBox getSceneBBox() const { return m_nodes[0].bbox; };
+
+	const BuildStats& getBuildStats() const { return m_stats; }
+
+private:
+	BuildStats m_stats;
+
+	IntersectionReturn intersectWithStack(const Ray &_ray, float _previousBestDistance) const;
+	IntersectionReturn intersectStackless(const Ray &_ray, float _previousBestDistance) const;
+
+	//Intersects the primitives of the leaf list starting at _leafData, updating the closest hit
+	void intersectLeaf(const uint *_leafData, const Ray &_ray, Primitive::IntRet &_bestHit, size_t &_bestIndex) const
+	{
+		for(; *_leafData != LEAF_END; _leafData++)
+		{
+			Primitive::IntRet curRet = m_primitiveSet != NULL ? 
+				m_primitiveSet->intersect(*_leafData, _ray, _bestHit.distance) :
+				m_primitives[*_leafData]->intersect(_ray, _bestHit.distance);
+
+			if(curRet.distance > Primitive::INTEPS() && curRet.distance < _bestHit.distance)
+			{
+				_bestHit = curRet;
+				_bestIndex = *_leafData;
+			}
+		}
+	}
+
+	//The child of an inner node whose center comes first along the ray direction
+	size_t nearChild(size_t _node, const Ray &_ray) const
+	{
+		size_t left = m_nodes[_node].getLeftChildOrLeaf();
+		const BBox &leftBBox = m_nodes[left].bbox, &rightBBox = m_nodes[left + 1].bbox;
+		Vector centerDiff = (leftBBox.min - rightBBox.min) + (leftBBox.max - rightBBox.max);
+		return centerDiff * _ray.d <= 0.f ? left : left + 1;
+	}
+
+	size_t farChild(size_t _node, const Ray &_ray) const
+	{
+		size_t left = m_nodes[_node].getLeftChildOrLeaf();
+		return nearChild(_node, _ray) == left ? left + 1 : left;
+	}
 };
 
 #endif //__INCLUDE_GUARD_8D5E74D9_FBD2_4B91_88E1_716ECFC377C4
@@ -0,0 +1,355 @@
+//A linear BVH builder (LBVH), optionally with SAH refined top levels (HLBVH)
+//Details: Lauterbach et al. - Fast BVH Construction on GPUs, EG 2009
+//	Pantaleoni, Luebke - HLBVH: Hierarchical LBVH Construction for Real-Time Ray Tracing, HPG 2010
+#include "stdafx.h"
+#include "bvh.h"
+
+namespace bvh_linear_internal
+{
+	enum {_MAX_LEAF_SIZE = 2, _RADIX_BITS = 8, _RADIX_BLOCKS = 64, _SAH_BINS = 16};
+
+	struct MortonPrimitive
+	{
+		unsigned long long code;
+		size_t index;
+	};
+
+	//A set of primitives which share the top bits of their morton codes.
+	//	The leaves of the SAH built top levels
+	struct Cluster
+	{
+		size_t start, end;
+		BBox bbox;
+		Point centroid;
+	};
+
+	struct BuildTask
+	{
+		//Range in the clusters (top levels) or in the sorted primitives
+		size_t start, end;
+		size_t nodeIndex;
+		bool clusters;
+	};
+
+	//Inserts two zero bits between each of the lower 21 bits of _v
+	unsigned long long expandBits(unsigned long long _v)
+	{
+		_v &= 0x1fffffULL;
+		_v = (_v | _v << 32) & 0x1f00000000ffffULL;
+		_v = (_v | _v << 16) & 0x1f0000ff0000ffULL;
+		_v = (_v | _v << 8) & 0x100f00f00f00f00fULL;
+		_v = (_v | _v << 4) & 0x10c30c30c30c30c3ULL;
+		_v = (_v | _v << 2) & 0x1249249249249249ULL;
+		return _v;
+	}
+
+	int highestBit(unsigned long long _v)
+	{
+		int ret = -1;
+		while(_v != 0)
+		{
+			_v >>= 1;
+			ret++;
+		}
+		return ret;
+	}
+
+	//A parallel, stable LSD radix sort on the lower _bits of the codes.
+	//	The data is split into a fixed number of blocks, so the result
+	//	does not depend on the number of threads
+	void radixSort(std::vector<MortonPrimitive> &_data, int _bits)
+	{
+		const int BUCKETS = 1 << _RADIX_BITS;
+		const long blockSize = (long)(_data.size() + _RADIX_BLOCKS - 1) / _RADIX_BLOCKS;
+		const long size = (long)_data.size();
+
+		std::vector<MortonPrimitive> tmp(_data.size());
+		std::vector<size_t> offsets(BUCKETS * _RADIX_BLOCKS);
+
+		for(int shift = 0; shift < _bits; shift += _RADIX_BITS)
+		{
+			std::fill(offsets.begin(), offsets.end(), 0);
+
+#pragma omp parallel for
+			for(int block = 0; block < _RADIX_BLOCKS; block++)
+			{
+				long end = std::min(size, (block + 1) * blockSize);
+				for(long i = block * blockSize; i < end; i++)
+					offsets[((_data[i].code >> shift) & (BUCKETS - 1)) * _RADIX_BLOCKS + block]++;
+			}
+
+			//Exclusive prefix sum, bucket major, so equal keys keep the block order
+			size_t sum = 0;
+			for(size_t i = 0; i < offsets.size(); i++)
+			{
+				size_t cnt = offsets[i];
+				offsets[i] = sum;
+				sum += cnt;
+			}
+
+#pragma omp parallel for
+			for(int block = 0; block < _RADIX_BLOCKS; block++)
+			{
+				long end = std::min(size, (block + 1) * blockSize);
+				for(long i = block * blockSize; i < end; i++)
+					tmp[offsets[((_data[i].code >> shift) & (BUCKETS - 1)) * _RADIX_BLOCKS + block]++] = _data[i];
+			}
+
+			_data.swap(tmp);
+		}
+	}
+
+	//Splits a range of sorted primitives at the highest bit in which
+	//	the morton codes differ. Returns the first index of the right half
+	size_t findMortonSplit(const std::vector<MortonPrimitive> &_sorted, size_t _start, size_t _end)
+	{
+		unsigned long long first = _sorted[_start].code;
+		unsigned long long last = _sorted[_end - 1].code;
+
+		if(first == last)
+			return (_start + _end) / 2;
+
+		unsigned long long bit = 1ULL << highestBit(first ^ last);
+
+		//The codes are sorted and share all bits above, so the bit
+		//	is 0 in the left part of the range and 1 in the right part
+		size_t lo = _start, hi = _end - 1;
+		while(lo + 1 < hi)
+		{
+			size_t mid = (lo + hi) / 2;
+			if(_sorted[mid].code & bit)
+				hi = mid;
+			else
+				lo = mid;
+		}
+
+		return hi;
+	}
+
+	//Binned SAH over the cluster centroids. Reorders the clusters in the range
+	//	and returns the first cluster of the right half
+	size_t splitClusters(std::vector<Cluster> &_clusters, size_t _start, size_t _end)
+	{
+		BBox centroidBBox = BBox::empty();
+		for(size_t i = _start; i < _end; i++)
+			centroidBBox.extend(_clusters[i].centroid);
+
+		float bestCost = FLT_MAX;
+		int bestDim = -1, bestBin = 0;
+
+		for(int dim = 0; dim < 3; dim++)
+		{
+			float extent = centroidBBox.max[dim] - centroidBBox.min[dim];
+			if(extent <= 0.f)
+				continue;
+
+			BBox bins[_SAH_BINS];
+			size_t counts[_SAH_BINS];
+			for(int i = 0; i < _SAH_BINS; i++)
+			{
+				bins[i] = BBox::empty();
+				counts[i] = 0;
+			}
+
+			for(size_t i = _start; i < _end; i++)
+			{
+				int bin = std::min((int)((_clusters[i].centroid[dim] - centroidBBox.min[dim]) / extent * _SAH_BINS), _SAH_BINS - 1);
+				bins[bin].extend(_clusters[i].bbox);
+				counts[bin] += _clusters[i].end - _clusters[i].start;
+			}
+
+			BBox rightBBoxes[_SAH_BINS];
+			size_t rightCnts[_SAH_BINS];
+			BBox acc = BBox::empty();
+			size_t accCnt = 0;
+			for(int i = _SAH_BINS - 1; i > 0; i--)
+			{
+				acc.extend(bins[i]);
+				accCnt += counts[i];
+				rightBBoxes[i] = acc;
+				rightCnts[i] = accCnt;
+			}
+
+			acc = BBox::empty();
+			accCnt = 0;
+			for(int i = 0; i < _SAH_BINS - 1; i++)
+			{
+				acc.extend(bins[i]);
+				accCnt += counts[i];
+				if(accCnt == 0 || rightCnts[i + 1] == 0)
+					continue;
+
+				float cost = acc.area() * accCnt + rightBBoxes[i + 1].area() * rightCnts[i + 1];
+				if(cost < bestCost)
+				{
+					bestCost = cost;
+					bestDim = dim;
+					bestBin = i;
+				}
+			}
+		}
+
+		if(bestDim == -1)
+			return (_start + _end) / 2;
+
+		float extent = centroidBBox.max[bestDim] - centroidBBox.min[bestDim];
+		size_t left = _start, right = _end;
+		while(left < right)
+		{
+			int bin = std::min((int)((_clusters[left].centroid[bestDim] - centroidBBox.min[bestDim]) / extent * _SAH_BINS), _SAH_BINS - 1);
+			if(bin <= bestBin)
+				left++;
+			else
+				std::swap(_clusters[left], _clusters[--right]);
+		}
+
+		return left;
+	}
+}
+
+using namespace bvh_linear_internal;
+
+//LBVH build: sort the primitives along a morton curve and emit the hierarchy
+//	from the bits of the codes. Node bounding boxes are computed in a final
+//	bottom-up pass, children are always stored after their parents
+void BVH::buildLinear(const IndexedPrimitiveSet &_objects)
+{
+	const size_t NODE_TYPE_MASK = ((size_t)1 << Node::LEAF_FLAG_BIT);
+	const long size = (long)_objects.getPrimitiveCount();
+
+	int bitsPerAxis = settings.linearMortonBits > 30 ? 21 : 10;
+	int codeBits = 3 * bitsPerAxis;
+	int topBits = std::min(settings.linearSAHTopBits, codeBits);
+
+	std::vector<BBox> objectBBoxes(_objects.getPrimitiveCount());
+	std::vector<Point> centroids(_objects.getPrimitiveCount());
+
+	BBox centroidBBox = BBox::empty();
+#pragma omp parallel
+	{
+		BBox threadBBox = BBox::empty();
+#pragma omp for
+		for(long i = 0; i < size; i++)
+		{
+			objectBBoxes[i] = _objects.getBBox(i);
+			centroids[i] = objectBBoxes[i].min.lerp(objectBBoxes[i].max, 0.5f);
+			threadBBox.extend(centroids[i]);
+		}
+#pragma omp critical
+		centroidBBox.extend(threadBBox);
+	}
+
+	std::vector<MortonPrimitive> sorted(_objects.getPrimitiveCount());
+	Vector extent = centroidBBox.diagonal();
+	float gridSize = (float)((1 << bitsPerAxis) - 1);
+
+#pragma omp parallel for
+	for(long i = 0; i < size; i++)
+	{
+		unsigned long long code = 0;
+		for(int dim = 0; dim < 3; dim++)
+		{
+			float rel = extent[dim] > 0.f ? (centroids[i][dim] - centroidBBox.min[dim]) / extent[dim] : 0.f;
+			code |= expandBits((unsigned long long)(rel * gridSize)) << (2 - dim);
+		}
+		sorted[i].code = code;
+		sorted[i].index = i;
+	}
+
+	radixSort(sorted, codeBits);
+
+	//Group the primitives by the top bits of their codes
+	std::vector<Cluster> clusters;
+	if(topBits > 0)
+	{
+		int shift = codeBits - topBits;
+		for(size_t i = 0; i < sorted.size(); i++)
+		{
+			if(i == 0 || (sorted[i].code >> shift) != (sorted[i - 1].code >> shift))
+			{
+				Cluster c;
+				c.start = i;
+				c.bbox = BBox::empty();
+				clusters.push_back(c);
+			}
+
+			clusters.back().end = i + 1;
+			clusters.back().bbox.extend(objectBBoxes[sorted[i].index]);
+		}
+
+		for(std::vector<Cluster>::iterator it = clusters.begin(); it != clusters.end(); it++)
+			it->centroid = it->bbox.min.lerp(it->bbox.max, 0.5f);
+	}
+
+	BuildTask curTask;
+	curTask.nodeIndex = 0;
+	curTask.clusters = clusters.size() > 1;
+	curTask.start = 0;
+	curTask.end = curTask.clusters ? clusters.size() : sorted.size();
+
+	m_nodes.resize(1);
+	std::vector<BuildTask> buildStack;
+
+	for(;;)
+	{
+		if(curTask.clusters && curTask.end - curTask.start == 1)
+		{
+			//Continue below the cluster with the morton code splits
+			const Cluster &c = clusters[curTask.start];
+			curTask.clusters = false;
+			curTask.start = c.start;
+			curTask.end = c.end;
+		}
+
+		if(!curTask.clusters && curTask.end - curTask.start <= _MAX_LEAF_SIZE)
+		{
+			//Create a leaf
+			Node &node = m_nodes[curTask.nodeIndex];
+			node.bbox = BBox::empty();
+			node.dataIndex = m_leafData.size() | NODE_TYPE_MASK;
+
+			for(size_t i = curTask.start; i < curTask.end; i++)
+			{
+				node.bbox.extend(objectBBoxes[sorted[i].index]);
+				m_leafData.push_back((uint)sorted[i].index);
+			}
+
+			m_leafData.push_back(LEAF_END);
+
+			if(buildStack.empty())
+				break;
+
+			curTask = buildStack.back();
+			buildStack.pop_back();
+
+			continue;
+		}
+
+		size_t split = curTask.clusters ?
+			splitClusters(clusters, curTask.start, curTask.end) :
+			findMortonSplit(sorted, curTask.start, curTask.end);
+
+		m_nodes[curTask.nodeIndex].dataIndex = m_nodes.size();
+
+		BuildTask rightTask = curTask;
+		rightTask.start = split;
+		rightTask.nodeIndex = m_nodes.size() + 1;
+		buildStack.push_back(rightTask);
+
+		curTask.end = split;
+		curTask.nodeIndex = m_nodes.size();
+
+		m_nodes.resize(m_nodes.size() + 2);
+	}
+
+	//Bottom-up bounding boxes of the inner nodes
+	for(size_t i = m_nodes.size(); i-- > 0;)
+	{
+		Node &node = m_nodes[i];
+		if(node.isLeaf())
+			continue;
+
+		node.bbox = m_nodes[node.getLeftChildOrLeaf()].bbox;
+		node.bbox.extend(m_nodes[node.getLeftChildOrLeaf() + 1].bbox);
+	}
+}
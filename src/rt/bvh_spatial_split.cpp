@@ -0,0 +1,406 @@
+//A SAH BVH builder with spatial splits (SBVH)
+//Details: Stich, Friedrich, Dietrich - Spatial Splits in Bounding Volume Hierarchies, HPG 2009
+#include "stdafx.h"
+#include "bvh.h"
+
+namespace bvh_spatial_split_internal
+{
+	enum {_NUM_BINS = 32, _NUM_SPATIAL_BINS = 16, _MAX_LEAF_SIZE = 2, _MAX_SPATIAL_DEPTH = 48};
+
+	//Nodes with up to this many references become leaves if that is cheaper
+	//	than the best split. Larger nodes are always split, if possible
+	enum {_MAX_SAH_LEAF_SIZE = 8};
+
+	//Spatial splits are only tried if the children of the best object split
+	//	overlap by more than this fraction of the scene surface area
+	const float _SPATIAL_SPLIT_ALPHA = 0.00001f;
+	const float _EPS = 0.0000001f;
+
+	//A (possibly clipped) reference to a primitive
+	struct Reference
+	{
+		BBox bbox;
+		size_t primIndex;
+	};
+
+	struct BuildTask
+	{
+		std::vector<Reference> refs;
+		size_t nodeIndex;
+		int depth;
+	};
+
+	struct Split
+	{
+		float cost;
+		int dim;
+		bool spatial;
+		//Object split: the last bin going to the left. Spatial split: the split plane
+		int bin;
+		float position;
+		BBox leftBBox, rightBBox;
+		size_t leftCnt, rightCnt;
+
+		Split() : cost(FLT_MAX), dim(-1), spatial(false) {}
+	};
+
+	struct Bin
+	{
+		BBox bbox;
+		size_t count, entries, exits;
+
+		void reset() { bbox = BBox::empty(); count = entries = exits = 0; }
+	};
+
+	Point centroid(const BBox &_bbox)
+	{
+		return _bbox.min.lerp(_bbox.max, 0.5f);
+	}
+
+	BBox unite(const BBox &_a, const BBox &_b)
+	{
+		BBox ret = _a;
+		ret.extend(_b);
+		return ret;
+	}
+
+	int objectBin(const Point &_centroid, const BBox &_centroidBBox, int _dim)
+	{
+		float extent = _centroidBBox.max[_dim] - _centroidBBox.min[_dim];
+		int bin = (int)((_centroid[_dim] - _centroidBBox.min[_dim]) / extent * _NUM_BINS);
+		return std::min(std::max(bin, 0), (int)_NUM_BINS - 1);
+	}
+
+	int spatialBin(float _pos, float _origin, float _binWidth)
+	{
+		int bin = (int)((_pos - _origin) / _binWidth);
+		return std::min(std::max(bin, 0), (int)_NUM_SPATIAL_BINS - 1);
+	}
+
+	//Clips a reference to the slab [_lo, _hi] along _dim
+	BBox clipReference(const Reference &_ref, const IndexedPrimitiveSet &_objects, int _dim, float _lo, float _hi)
+	{
+		BBox slab = _ref.bbox;
+		slab.min[_dim] = std::max(slab.min[_dim], _lo);
+		slab.max[_dim] = std::min(slab.max[_dim], _hi);
+		if(slab.isEmpty())
+			return BBox::empty();
+
+		BBox ret = _objects.clipBBox(_ref.primIndex, slab);
+		ret.clip(slab);
+		return ret;
+	}
+
+	//Binned SAH over the centroids
+	void findObjectSplit(const std::vector<Reference> &_refs, const BBox &_centroidBBox, Split &_best)
+	{
+		Bin bins[_NUM_BINS];
+		BBox rightBBoxes[_NUM_BINS];
+
+		for(int dim = 0; dim < 3; dim++)
+		{
+			if(_centroidBBox.max[dim] - _centroidBBox.min[dim] < _EPS)
+				continue;
+
+			for(int i = 0; i < _NUM_BINS; i++)
+				bins[i].reset();
+
+			for(std::vector<Reference>::const_iterator it = _refs.begin(); it != _refs.end(); it++)
+			{
+				Bin &bin = bins[objectBin(centroid(it->bbox), _centroidBBox, dim)];
+				bin.bbox.extend(it->bbox);
+				bin.count++;
+			}
+
+			BBox rightBBox = BBox::empty();
+			for(int i = _NUM_BINS - 1; i > 0; i--)
+			{
+				rightBBox.extend(bins[i].bbox);
+				rightBBoxes[i] = rightBBox;
+			}
+
+			BBox leftBBox = BBox::empty();
+			size_t leftCnt = 0;
+			for(int i = 0; i < _NUM_BINS - 1; i++)
+			{
+				leftBBox.extend(bins[i].bbox);
+				leftCnt += bins[i].count;
+				size_t rightCnt = _refs.size() - leftCnt;
+				if(leftCnt == 0 || rightCnt == 0)
+					continue;
+
+				float cost = leftBBox.area() * leftCnt + rightBBoxes[i + 1].area() * rightCnt;
+				if(cost < _best.cost)
+				{
+					_best.cost = cost;
+					_best.dim = dim;
+					_best.spatial = false;
+					_best.bin = i;
+					_best.leftBBox = leftBBox;
+					_best.rightBBox = rightBBoxes[i + 1];
+					_best.leftCnt = leftCnt;
+					_best.rightCnt = rightCnt;
+				}
+			}
+		}
+	}
+
+	//Binned SAH over the node bounds, with references clipped to the bins
+	void findSpatialSplit(const std::vector<Reference> &_refs, const BBox &_nodeBBox,
+		const IndexedPrimitiveSet &_objects, Split &_best)
+	{
+		Bin bins[_NUM_SPATIAL_BINS];
+		BBox rightBBoxes[_NUM_SPATIAL_BINS];
+		size_t rightCnts[_NUM_SPATIAL_BINS];
+
+		for(int dim = 0; dim < 3; dim++)
+		{
+			float origin = _nodeBBox.min[dim];
+			float binWidth = (_nodeBBox.max[dim] - origin) / _NUM_SPATIAL_BINS;
+			if(binWidth < _EPS)
+				continue;
+
+			for(int i = 0; i < _NUM_SPATIAL_BINS; i++)
+				bins[i].reset();
+
+			for(std::vector<Reference>::const_iterator it = _refs.begin(); it != _refs.end(); it++)
+			{
+				int firstBin = spatialBin(it->bbox.min[dim], origin, binWidth);
+				int lastBin = spatialBin(it->bbox.max[dim], origin, binWidth);
+				bins[firstBin].entries++;
+				bins[lastBin].exits++;
+
+				if(firstBin == lastBin)
+					bins[firstBin].bbox.extend(it->bbox);
+				else
+					for(int i = firstBin; i <= lastBin; i++)
+						bins[i].bbox.extend(clipReference(*it, _objects, dim,
+							origin + i * binWidth, origin + (i + 1) * binWidth));
+			}
+
+			BBox rightBBox = BBox::empty();
+			size_t rightCnt = 0;
+			for(int i = _NUM_SPATIAL_BINS - 1; i > 0; i--)
+			{
+				rightBBox.extend(bins[i].bbox);
+				rightCnt += bins[i].exits;
+				rightBBoxes[i] = rightBBox;
+				rightCnts[i] = rightCnt;
+			}
+
+			BBox leftBBox = BBox::empty();
+			size_t leftCnt = 0;
+			for(int i = 0; i < _NUM_SPATIAL_BINS - 1; i++)
+			{
+				leftBBox.extend(bins[i].bbox);
+				leftCnt += bins[i].entries;
+				if(leftCnt == 0 || rightCnts[i + 1] == 0)
+					continue;
+				//Splits which keep all references on both sides make no progress
+				if(leftCnt == _refs.size() && rightCnts[i + 1] == _refs.size())
+					continue;
+
+				float cost = leftBBox.area() * leftCnt + rightBBoxes[i + 1].area() * rightCnts[i + 1];
+				if(cost < _best.cost)
+				{
+					_best.cost = cost;
+					_best.dim = dim;
+					_best.spatial = true;
+					_best.position = origin + (i + 1) * binWidth;
+					_best.leftBBox = leftBBox;
+					_best.rightBBox = rightBBoxes[i + 1];
+					_best.leftCnt = leftCnt;
+					_best.rightCnt = rightCnts[i + 1];
+				}
+			}
+		}
+	}
+
+	//Distributes the references of a spatial split. References which straddle
+	//	the split plane are either clipped into both children, or "unsplit"
+	//	(put completely into one child) if that is cheaper or the budget is exhausted
+	void partitionSpatial(const std::vector<Reference> &_refs, const Split &_split,
+		const IndexedPrimitiveSet &_objects, size_t &_budget,
+		std::vector<Reference> &_left, std::vector<Reference> &_right)
+	{
+		int dim = _split.dim;
+		BBox leftBBox = _split.leftBBox, rightBBox = _split.rightBBox;
+		size_t leftCnt = _split.leftCnt, rightCnt = _split.rightCnt;
+
+		for(std::vector<Reference>::const_iterator it = _refs.begin(); it != _refs.end(); it++)
+		{
+			if(it->bbox.max[dim] <= _split.position)
+				_left.push_back(*it);
+			else if(it->bbox.min[dim] >= _split.position)
+				_right.push_back(*it);
+			else
+			{
+				float splitCost = leftBBox.area() * leftCnt + rightBBox.area() * rightCnt;
+				//The binned counts can miss a straddling reference, they must not wrap around
+				float toLeftCost = unite(leftBBox, it->bbox).area() * leftCnt + rightBBox.area() * (rightCnt > 0 ? rightCnt - 1 : 0);
+				float toRightCost = leftBBox.area() * (leftCnt > 0 ? leftCnt - 1 : 0) + unite(rightBBox, it->bbox).area() * rightCnt;
+
+				Reference leftRef = *it, rightRef = *it;
+				leftRef.bbox = clipReference(*it, _objects, dim, -FLT_MAX, _split.position);
+				rightRef.bbox = clipReference(*it, _objects, dim, _split.position, FLT_MAX);
+
+				//The primitive itself may only touch the plane
+				bool toLeft = rightRef.bbox.isEmpty() || (!leftRef.bbox.isEmpty() && toLeftCost < toRightCost);
+				bool split = _budget > 0 && !leftRef.bbox.isEmpty() && !rightRef.bbox.isEmpty()
+					&& splitCost < toLeftCost && splitCost < toRightCost;
+
+				if(split)
+				{
+					_left.push_back(leftRef);
+					_right.push_back(rightRef);
+					_budget--;
+				}
+				else if(toLeft)
+				{
+					_left.push_back(*it);
+					leftBBox.extend(it->bbox);
+					rightCnt--;
+				}
+				else
+				{
+					_right.push_back(*it);
+					rightBBox.extend(it->bbox);
+					leftCnt--;
+				}
+			}
+		}
+	}
+
+	void partitionObject(const std::vector<Reference> &_refs, const Split &_split, const BBox &_centroidBBox,
+		std::vector<Reference> &_left, std::vector<Reference> &_right)
+	{
+		for(std::vector<Reference>::const_iterator it = _refs.begin(); it != _refs.end(); it++)
+		{
+			if(objectBin(centroid(it->bbox), _centroidBBox, _split.dim) <= _split.bin)
+				_left.push_back(*it);
+			else
+				_right.push_back(*it);
+		}
+	}
+}
+
+using namespace bvh_spatial_split_internal;
+
+//An iterative SBVH build. Leaf data holds every reference once per leaf,
+//	a primitive can appear in several leaves.
+void BVH::buildSpatialSplit(const IndexedPrimitiveSet &_objects)
+{
+	const size_t NODE_TYPE_MASK = ((size_t)1 << Node::LEAF_FLAG_BIT);
+
+	size_t budget = (size_t)(settings.spatialSplitBudget * _objects.getPrimitiveCount());
+
+	BuildTask curTask;
+	curTask.nodeIndex = 0;
+	curTask.depth = 0;
+	curTask.refs.resize(_objects.getPrimitiveCount());
+
+	BBox sceneBBox = BBox::empty();
+	for(size_t i = 0; i < _objects.getPrimitiveCount(); i++)
+	{
+		curTask.refs[i].bbox = _objects.getBBox(i);
+		curTask.refs[i].primIndex = i;
+		sceneBBox.extend(curTask.refs[i].bbox);
+	}
+
+	float minOverlap = _SPATIAL_SPLIT_ALPHA * sceneBBox.area();
+
+	m_nodes.resize(1);
+	std::vector<BuildTask> buildStack;
+
+	for(;;)
+	{
+		BBox nodeBBox = BBox::empty(), centroidBBox = BBox::empty();
+		for(std::vector<Reference>::const_iterator it = curTask.refs.begin(); it != curTask.refs.end(); it++)
+		{
+			nodeBBox.extend(it->bbox);
+			centroidBBox.extend(centroid(it->bbox));
+		}
+
+		Split objectSplit, best;
+		if(curTask.refs.size() > _MAX_LEAF_SIZE)
+		{
+			findObjectSplit(curTask.refs, centroidBBox, objectSplit);
+			best = objectSplit;
+
+			BBox overlap = objectSplit.leftBBox;
+			overlap.clip(objectSplit.rightBBox);
+			bool trySpatial = budget > 0 && curTask.depth < _MAX_SPATIAL_DEPTH
+				&& (objectSplit.dim == -1 || overlap.area() > minOverlap);
+
+			if(trySpatial)
+				findSpatialSplit(curTask.refs, nodeBBox, _objects, best);
+
+			//The cost model of BuildStats::sahCost: traversal and intersection
+			//	costs are both 1, so splitting adds the area of the node once
+			//	and a leaf costs its area once per reference
+			float leafCost = nodeBBox.area() * curTask.refs.size();
+			if(curTask.refs.size() <= _MAX_SAH_LEAF_SIZE && leafCost <= nodeBBox.area() + best.cost)
+				best = objectSplit = Split();
+		}
+
+		m_nodes[curTask.nodeIndex].bbox = nodeBBox;
+
+		BuildTask leftTask, rightTask;
+		if(best.spatial)
+		{
+			partitionSpatial(curTask.refs, best, _objects, budget, leftTask.refs, rightTask.refs);
+
+			//All references were unsplit to one side. Nothing was duplicated
+			//	in this case, so simply fall back to the object split
+			if(leftTask.refs.empty() || rightTask.refs.empty())
+			{
+				leftTask.refs.clear();
+				rightTask.refs.clear();
+				best = objectSplit;
+			}
+		}
+
+		if(!best.spatial && best.dim != -1)
+			partitionObject(curTask.refs, best, centroidBBox, leftTask.refs, rightTask.refs);
+
+		if(leftTask.refs.empty() || rightTask.refs.empty())
+		{
+			//Create a leaf
+			m_nodes[curTask.nodeIndex].dataIndex = m_leafData.size() | NODE_TYPE_MASK;
+
+			for(std::vector<Reference>::const_iterator it = curTask.refs.begin(); it != curTask.refs.end(); it++)
+				m_leafData.push_back((uint)it->primIndex);
+
+			m_leafData.push_back(LEAF_END);
+
+			if(buildStack.empty())
+				break;
+
+			curTask.refs.swap(buildStack.back().refs);
+			curTask.nodeIndex = buildStack.back().nodeIndex;
+			curTask.depth = buildStack.back().depth;
+			buildStack.pop_back();
+
+			continue;
+		}
+
+		_ASSERT(!leftTask.refs.empty() && !rightTask.refs.empty());
+
+		m_nodes[curTask.nodeIndex].dataIndex = m_nodes.size();
+
+		leftTask.nodeIndex = m_nodes.size();
+		rightTask.nodeIndex = leftTask.nodeIndex + 1;
+		leftTask.depth = rightTask.depth = curTask.depth + 1;
+
+		m_nodes.resize(rightTask.nodeIndex + 1);
+
+		buildStack.push_back(BuildTask());
+		buildStack.back().refs.swap(rightTask.refs);
+		buildStack.back().nodeIndex = rightTask.nodeIndex;
+		buildStack.back().depth = rightTask.depth;
+
+		curTask.refs.swap(leftTask.refs);
+		curTask.nodeIndex = leftTask.nodeIndex;
+		curTask.depth = leftTask.depth;
+	}
+}
@@ -0,0 +1,193 @@
+//Treelet restructuring of a built BVH
+//Details: Karras, Aila - Fast Parallel Construction of High-Quality Bounding Volume Hierarchies, HPG 2013
+#include "stdafx.h"
+#include "bvh.h"
+#include "../core/util.h"
+
+namespace bvh_treelet_internal
+{
+	enum {_TREELET_LEAVES = 7, _TREELET_SUBSETS = 1 << _TREELET_LEAVES, _MAX_ROUNDS = 3};
+
+	int bitCount(int _v)
+	{
+		int ret = 0;
+		for(; _v != 0; _v &= _v - 1)
+			ret++;
+		return ret;
+	}
+}
+
+using namespace bvh_treelet_internal;
+
+//Forms a treelet below _root by repeatedly expanding the treelet leaf with
+//	the largest surface area and replaces it with the topology of minimal SAH
+//	cost. The leaves of the treelet (whole subtrees) are not changed, so only the
+//	areas of the inner treelet nodes matter. The node slots of the inner nodes are reused.
+//Returns true if the treelet was changed.
+bool BVH::optimizeTreelet(size_t _root)
+{
+	size_t leaves[_TREELET_LEAVES];
+	//Child pairs owned by the inner treelet nodes
+	size_t pairs[_TREELET_LEAVES - 1];
+
+	int leafCnt = 2, pairCnt = 1;
+	pairs[0] = m_nodes[_root].getLeftChildOrLeaf();
+	leaves[0] = pairs[0];
+	leaves[1] = pairs[0] + 1;
+
+	float oldCost = 0.f;
+	while(leafCnt < _TREELET_LEAVES)
+	{
+		int expand = -1;
+		float bestArea = -1.f;
+		for(int i = 0; i < leafCnt; i++)
+		{
+			if(m_nodes[leaves[i]].isLeaf())
+				continue;
+
+			float area = m_nodes[leaves[i]].bbox.area();
+			if(area > bestArea)
+			{
+				bestArea = area;
+				expand = i;
+			}
+		}
+
+		if(expand == -1)
+			break;
+
+		oldCost += bestArea;
+		size_t children = m_nodes[leaves[expand]].getLeftChildOrLeaf();
+		pairs[pairCnt++] = children;
+		leaves[expand] = children;
+		leaves[leafCnt++] = children + 1;
+	}
+
+	if(leafCnt < 3)
+		return false;
+
+	Node records[_TREELET_LEAVES];
+	for(int i = 0; i < leafCnt; i++)
+		records[i] = m_nodes[leaves[i]];
+
+	//Optimal partitioning of every subset of the treelet leaves. The root of the
+	//	treelet is not counted, its area does not change
+	BBox bboxes[_TREELET_SUBSETS];
+	float costs[_TREELET_SUBSETS];
+	int bestPartition[_TREELET_SUBSETS];
+
+	int allLeaves = (1 << leafCnt) - 1;
+	for(int subset = 1; subset <= allLeaves; subset++)
+	{
+		int lowest = subset & -subset;
+		if(subset == lowest)
+		{
+			int leaf = bitCount(lowest - 1);
+			bboxes[subset] = records[leaf].bbox;
+			costs[subset] = 0.f;
+			continue;
+		}
+
+		bboxes[subset] = bboxes[subset ^ lowest];
+		bboxes[subset].extend(bboxes[lowest]);
+
+		//Partitions which contain the lowest leaf, to visit every split once
+		float bestCost = FLT_MAX;
+		for(int part = (subset - 1) & subset; part != 0; part = (part - 1) & subset)
+		{
+			if((part & lowest) == 0)
+				continue;
+
+			float cost = costs[part] + costs[subset ^ part];
+			if(cost < bestCost)
+			{
+				bestCost = cost;
+				bestPartition[subset] = part;
+			}
+		}
+
+		costs[subset] = bestCost + (subset == allLeaves ? 0.f : bboxes[subset].area());
+	}
+
+	if(costs[allLeaves] >= oldCost * 0.9999f)
+		return false;
+
+	//Write the new topology
+	std::pair<int, size_t> stack[2 * _TREELET_LEAVES];
+	int stackSize = 0, nextPair = 0;
+	stack[stackSize++] = std::make_pair(allLeaves, _root);
+
+	while(stackSize > 0)
+	{
+		int subset = stack[--stackSize].first;
+		size_t nodeIndex = stack[stackSize].second;
+
+		if(bitCount(subset) == 1)
+		{
+			m_nodes[nodeIndex] = records[bitCount(subset - 1)];
+			continue;
+		}
+
+		size_t children = pairs[nextPair++];
+		m_nodes[nodeIndex].bbox = bboxes[subset];
+		m_nodes[nodeIndex].dataIndex = children;
+
+		int part = bestPartition[subset];
+		stack[stackSize++] = std::make_pair(part, children);
+		stack[stackSize++] = std::make_pair(subset ^ part, children + 1);
+	}
+
+	_ASSERT(nextPair == pairCnt);
+
+	return true;
+}
+
+void BVH::optimizeTreelets(double _timeBudget)
+{
+	if(m_nodes.empty())
+		return;
+
+	double startTime = wallClock();
+
+	for(int round = 0; round < _MAX_ROUNDS; round++)
+	{
+		//The inner nodes, by depth. Treelets with roots on the same level
+		//	are disjoint, so each level can be processed in parallel. Nodes
+		//	above the level being processed are never moved.
+		std::vector<std::vector<size_t> > levels;
+		std::vector<std::pair<size_t, size_t> > traverseStack(1, std::make_pair((size_t)0, (size_t)0));
+		while(!traverseStack.empty())
+		{
+			size_t nodeIndex = traverseStack.back().first;
+			size_t depth = traverseStack.back().second;
+			traverseStack.pop_back();
+
+			if(m_nodes[nodeIndex].isLeaf())
+				continue;
+
+			if(levels.size() <= depth)
+				levels.resize(depth + 1);
+			levels[depth].push_back(nodeIndex);
+
+			traverseStack.push_back(std::make_pair(m_nodes[nodeIndex].getLeftChildOrLeaf(), depth + 1));
+			traverseStack.push_back(std::make_pair(m_nodes[nodeIndex].getLeftChildOrLeaf() + 1, depth + 1));
+		}
+
+		long changed = 0;
+		for(size_t level = levels.size(); level-- > 0;)
+		{
+			const std::vector<size_t> &roots = levels[level];
+
+#pragma omp parallel for schedule(dynamic, 256) reduction(+:changed)
+			for(long i = 0; i < (long)roots.size(); i++)
+				if(optimizeTreelet(roots[i]))
+					changed++;
+
+			if(wallClock() - startTime > _timeBudget)
+				return;
+		}
+
+		if(changed == 0)
+			break;
+	}
+}
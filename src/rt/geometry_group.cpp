@@ -2,6 +2,12 @@
 
 #include "geometry_group.h"
 
+//Another way of saying !(box.max.x < box.min.x && box.max.y < box.min.y & box.max.z < box.min.z)
+static bool isBounded(const BBox &_box)
+{
+	return ((float4(_box.max) < float4(_box.min)).getMask() & 14) == 0;
+}
+
 SmartPtr<Shader> GeometryGroup::getShader(IntRet _intData) const
 {
 	//Dereference the intersection info and ask the contained primitive
@@ -12,6 +18,8 @@ SmartPtr<Shader> GeometryGroup::getShader(IntRet _intData) const
 
 Primitive::IntRet GeometryGroup::intersect(const Ray& _ray, float _previousBestDistance) const
 {
+	ensureIndexUpToDate();
+
 	IntRet bestRet;
 	bestRet.distance = _previousBestDistance;
 
@@ -50,6 +58,8 @@ Primitive::IntRet GeometryGroup::intersect(const Ray& _ray, float _previousBestD
 
 BBox GeometryGroup::getBBox() const
 {
+	ensureIndexUpToDate();
+
 	IntRet ret;
 	if(m_nonIdxPrimitives.size() > 0)
 		return BBox::empty();
@@ -65,13 +75,119 @@ void GeometryGroup::rebuildIndex()
 	//Separate the bounded and unbounded primitives
 	for(std::vector<Primitive*>::const_iterator it = primitives.begin(); it != primitives.end(); it++)
 	{
-		BBox box = (*it)->getBBox();
-		//Another way of saying !(box.max.x < box.min.x && box.max.y < box.min.y & box.max.z < box.min.z)
-		if(((float4(box.max) < float4(box.min)).getMask() & 14) == 0)
+		if(isBounded((*it)->getBBox()))
 			indexPrimitives.push_back(*it);
 		else
 			m_nonIdxPrimitives.push_back(*it);
 	}
 
-	m_bvh.build(indexPrimitives);
+	buildBVH(indexPrimitives);
+
+	m_pendingAdd.clear();
+	m_pendingRemove.clear();
+	publishIndex();
+}
+
+void GeometryGroup::addPrimitives(const std::vector<Primitive*> &_batch)
+{
+	primitives.insert(primitives.end(), _batch.begin(), _batch.end());
+	m_pendingAdd.insert(m_pendingAdd.end(), _batch.begin(), _batch.end());
+	m_indexDirty = true;
+}
+
+void GeometryGroup::removePrimitives(const std::vector<Primitive*> &_batch)
+{
+	std::set<Primitive*> removed(_batch.begin(), _batch.end());
+
+	std::vector<Primitive*> kept;
+	kept.reserve(primitives.size());
+	for(std::vector<Primitive*>::const_iterator it = primitives.begin(); it != primitives.end(); it++)
+		if(removed.find(*it) == removed.end())
+			kept.push_back(*it);
+	primitives.swap(kept);
+
+	m_pendingRemove.insert(m_pendingRemove.end(), _batch.begin(), _batch.end());
+	m_indexDirty = true;
+}
+
+void GeometryGroup::updateIndex()
+{
+	if(!m_pendingRemove.empty())
+	{
+		std::set<Primitive*> removed(m_pendingRemove.begin(), m_pendingRemove.end());
+
+		//Primitives which were added and removed before the update never reach the index
+		std::vector<Primitive*> kept;
+		for(std::vector<Primitive*>::const_iterator it = m_pendingAdd.begin(); it != m_pendingAdd.end(); it++)
+			if(removed.find(*it) == removed.end())
+				kept.push_back(*it);
+		m_pendingAdd.swap(kept);
+
+		kept.clear();
+		for(std::vector<Primitive*>::const_iterator it = m_nonIdxPrimitives.begin(); it != m_nonIdxPrimitives.end(); it++)
+			if(removed.find(*it) == removed.end())
+				kept.push_back(*it);
+		m_nonIdxPrimitives.swap(kept);
+
+		if(!m_bvh.empty())
+			m_bvh.remove(m_pendingRemove);
+	}
+
+	std::vector<Primitive*> indexPrimitives;
+	for(std::vector<Primitive*>::const_iterator it = m_pendingAdd.begin(); it != m_pendingAdd.end(); it++)
+	{
+		if(isBounded((*it)->getBBox()))
+			indexPrimitives.push_back(*it);
+		else
+			m_nonIdxPrimitives.push_back(*it);
+	}
+
+	if(m_bvh.empty())
+		//Also keeps a valid (empty) root, so the BVH can always be traversed
+		buildBVH(indexPrimitives);
+	else
+	{
+		m_bvh.settings = bvhSettings;
+		m_bvh.merge(indexPrimitives);
+	}
+
+	m_pendingAdd.clear();
+	m_pendingRemove.clear();
+	publishIndex();
+}
+
+void GeometryGroup::publishIndex()
+{
+	//The BVH is complete in memory before the flag can be seen cleared
+#pragma omp flush
+#pragma omp atomic write
+	m_indexDirty = false;
+}
+
+void GeometryGroup::ensureIndexUpToDate() const
+{
+	bool dirty;
+#pragma omp atomic read
+	dirty = m_indexDirty;
+	//Pairs with the flush in publishIndex: a thread which sees the flag 
+	//	cleared also sees the BVH
+#pragma omp flush
+	if(!dirty)
+		return;
+
+#pragma omp critical (GeometryGroupIndexUpdate)
+	{
+		if(m_indexDirty)
+			const_cast<GeometryGroup*>(this)->updateIndex();
+	}
+}
+
+void GeometryGroup::buildBVH(const std::vector<Primitive*> &_indexPrimitives)
+{
+	m_bvh.settings = bvhSettings;
+
+	if(bvhCacheFile.empty())
+		m_bvh.build(_indexPrimitives);
+	else
+		m_bvh.buildCached(_indexPrimitives, bvhCacheFile);
 }
@@ -26,15 +26,52 @@ class GeometryGroup : public Primitive
 	//The list of not bounded primitives
 	std::vector<Primitive *> m_nonIdxPrimitives;
 
+	//Batches added or removed since the index was last updated
+	std::vector<Primitive *> m_pendingAdd;
+	std::vector<Primitive *> m_pendingRemove;
+	//Read and written atomically, see publishIndex
+	bool m_indexDirty;
+
+	//Applies the pending batches before the index is used. Thread safe
+	void ensureIndexUpToDate() const;
+
+	//Clears m_indexDirty once the BVH is built, see ensureIndexUpToDate
+	void publishIndex();
+
+	//Full build of the BVH, through the cache if bvhCacheFile is set
+	void buildBVH(const std::vector<Primitive*> &_indexPrimitives);
+
 public:
 	std::vector<Primitive *> primitives;
 
+	//If not empty, full BVH builds are loaded from (and stored to) this file
+	std::string bvhCacheFile;
+
+	//The builder used for the index
+	BVH::BuildSettings bvhSettings;
+
+	GeometryGroup() : m_indexDirty(true) {}
+
 	virtual SmartPtr<Shader> getShader(IntRet _intData) const;
 	virtual IntRet intersect(const Ray& _ray, float _previousBestDistance ) const;
 	virtual BBox getBBox() const;
 
-	//Rebuilds the BVH and updated m_nonIdxPrimitives
+	//Rebuilds the BVH from scratch and updated m_nonIdxPrimitives
 	void rebuildIndex();
+
+	//Adds a batch of primitives to the group. The index is not rebuilt,
+	//	instead the batch gets its own sub-hierarchy which is merged into
+	//	the existing BVH on the first intersection (or on updateIndex())
+	void addPrimitives(const std::vector<Primitive*> &_batch);
+
+	//Removes a batch of primitives from the group. Applied lazily, like addPrimitives
+	void removePrimitives(const std::vector<Primitive*> &_batch);
+
+	//Applies all pending added and removed batches to the index
+	void updateIndex();
+
+	//Statistics of the last full build of the index
+	const BVH::BuildStats& getIndexStats() const { return m_bvh.getBuildStats(); }
 };
 
 #endif //__INCLUDE_GUARD_3862487A_DF63_478D_99C2_652B7C66442E
@@ -15,7 +15,8 @@ public:
 	class CloudPerlin: public Perlin
 	{
 	public:
-		CloudPerlin(uint _width, float _persistence, int _n_octaves): Perlin(_width, _persistence, _n_octaves)
+		CloudPerlin(uint _width, float _persistence, int _n_octaves, Basis _basis = PB_SmoothedValue)
+			: Perlin(_width, _persistence, _n_octaves, _basis)
 		{}
 		
 		// make clouds with certain size and density
@@ -34,12 +35,12 @@ public:
 	SmartPtr<Perlin> perlin;
 	
 
-	CloudTexture()
+	CloudTexture(Perlin::Basis _basis = Perlin::PB_SmoothedValue)
 	{
 		addressModeX = TAM_Wrap;
 		addressModeY = TAM_Wrap;
 		filterMode = TFM_Point;
-		perlin = new CloudPerlin(100, 0.6f, 6); 
+		perlin = new CloudPerlin(100, 0.6f, 6, _basis); 
 	}
 private:
 	// we get grayscale sample and convert it to white-blue to look like a clouds
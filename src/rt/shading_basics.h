@@ -55,8 +55,25 @@ public:
 	
 	//Sets the texture coordinates for the intersection
 	virtual void setTextureCoord(const float2& _texCoord) {};
+
+	//Same, together with the footprint of the pixel in the texture: the change
+	//	of the texture coordinates from one pixel to the next in x and y.
+	//	Shaders which do not filter their textures ignore the footprint
+	virtual void setTextureCoord(const float2& _texCoord, const float2& _dTexCoorddx, const float2& _dTexCoorddy) 
+	{
+		setTextureCoord(_texCoord);
+	}
 	
-	virtual void setPuPv(Point x, Point y, Point z, float2 u, float2 v, float2 w) {};
+	//Sets the ray differentials at the hit: the incoming ray and the change of 
+	//	the surface point and of the (normalized) normal from one pixel to the next.
+	//	Only called for rays with differentials. Shaders which spawn secondary
+	//	rays use them to give those rays differentials too
+	virtual void setRayDifferentials(const Ray &_ray, const Vector &_dPdx, const Vector &_dPdy, 
+		const Vector &_dNdx, const Vector &_dNdy) {};
+
+	//Sets the directions in which the texture coordinates u and v grow at 
+	//	the hit, normalized. Bump mapping shaders perturb the normal along them
+	virtual void setTangents(const Vector &_tangent, const Vector &_bitangent) {};
 };
 
 //A helper macro to implement default cloning 
@@ -0,0 +1,164 @@
+//The tile files of Texture: the tiled levels of a texture, mapped and paged in
+//	through a TileCache. And the baked derivative maps
+#include "stdafx.h"
+#include "texture.h"
+
+namespace texture_internal
+{
+	//Increase when the layout of the file or of TiledImage changes
+	enum {_TILES_VERSION = 1, _TILES_MAGIC = 0x4C545854 /*TXTL*/, _MAX_LEVELS = 32};
+
+	//File layout: the header, then the blocks of each level (see TiledImage), 
+	//	from the full resolution image down. The levels start on a 
+	//	TiledImage::BLOCK_ALIGNMENT boundary, so their blocks are whole pages
+	struct TilesHeader
+	{
+		uint magic, version;
+		uint format, levels;
+		unsigned long long sourceStamp;
+		uint sizes[_MAX_LEVELS][2];
+	};
+
+	size_t levelOffset(size_t _end)
+	{
+		return (_end + TiledImage::BLOCK_ALIGNMENT - 1) / TiledImage::BLOCK_ALIGNMENT * TiledImage::BLOCK_ALIGNMENT;
+	}
+
+	//The size of the file, and the offset of each level
+	size_t tilesLayout(const TilesHeader &_header, std::vector<size_t> &_offsets)
+	{
+		size_t end = sizeof(TilesHeader);
+		TiledImage::Format format = (TiledImage::Format)_header.format;
+		uint blockSize = 1 << TiledImage::blockShift(format);
+
+		_offsets.resize(_header.levels);
+		for(uint level = 0; level < _header.levels; level++)
+		{
+			_offsets[level] = levelOffset(end);
+			size_t blocksX = (_header.sizes[level][0] + blockSize - 1) / blockSize;
+			size_t blocksY = (_header.sizes[level][1] + blockSize - 1) / blockSize;
+			end = _offsets[level] + blocksX * blocksY * blockSize * blockSize * TiledImage::texelSize(format);
+		}
+
+		return end;
+	}
+
+	//The differences of Texture::derivatives() for every texel of _level, 
+	//	wrapped at the borders. An Image or a TiledImage
+	template<class _Level>
+	void texelDifferences(const _Level &_level, Image &_ret)
+	{
+		uint width = _level.width(), height = _level.height();
+
+#pragma omp parallel for
+		for(int y = 0; y < (int)height; y++)
+			for(uint x = 0; x < width; x++)
+			{
+				float c0 = _level(x, y)[0];
+				float c1 = _level((x + 1) % width, y)[0];
+				float c2 = _level(x, (y + 1) % height)[0];
+				_ret(x, y) = float4(c1 - c0, c2 - c0, 0, 0);
+			}
+	}
+}
+
+using namespace texture_internal;
+
+bool Texture::writeTiles(const std::string &_fileName, unsigned long long _sourceStamp) const
+{
+	if(tiledLevels.empty() || tiledLevels.size() > _MAX_LEVELS)
+		return false;
+
+	TilesHeader header;
+	memset(&header, 0, sizeof(header));
+	header.magic = _TILES_MAGIC;
+	header.version = _TILES_VERSION;
+	header.format = tiledLevels[0]->format();
+	header.levels = (uint)tiledLevels.size();
+	header.sourceStamp = _sourceStamp;
+	for(uint level = 0; level < header.levels; level++)
+	{
+		header.sizes[level][0] = tiledLevels[level]->width();
+		header.sizes[level][1] = tiledLevels[level]->height();
+	}
+
+	std::vector<size_t> offsets;
+	tilesLayout(header, offsets);
+
+	//Write to a temporary file first, so that concurrent readers
+	//	never see a partially written file
+	std::string tmpFileName = _fileName + ".tmp";
+	{
+		std::ofstream output(tmpFileName.c_str(), std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+		if(output.fail())
+		{
+			std::cerr << "Could not write texture tiles " << _fileName << std::endl;
+			return false;
+		}
+
+		output.write((const char*)&header, sizeof(header));
+		size_t end = sizeof(header);
+		for(uint level = 0; level < header.levels; level++)
+		{
+			std::vector<char> padding(offsets[level] - end, 0);
+			if(!padding.empty())
+				output.write(&padding[0], padding.size());
+
+			const TiledImage &tiles = *tiledLevels[level];
+			output.write((const char*)tiles.getBlocks(), tiles.byteSize());
+			end = offsets[level] + tiles.byteSize();
+		}
+
+		if(output.fail())
+		{
+			std::cerr << "Could not write texture tiles " << _fileName << std::endl;
+			return false;
+		}
+	}
+
+	::remove(_fileName.c_str());
+	::rename(tmpFileName.c_str(), _fileName.c_str());
+	return true;
+}
+
+bool Texture::openTiles(const std::string &_fileName, unsigned long long _sourceStamp, TileCache *_cache)
+{
+	//The header is checked before mapping, a stale file stays unmapped
+	TilesHeader header;
+	{
+		std::ifstream input(_fileName.c_str(), std::ios_base::in | std::ios_base::binary);
+		input.read((char*)&header, sizeof(header));
+		if(input.fail())
+			return false;
+	}
+
+	if(header.magic != _TILES_MAGIC || header.version != _TILES_VERSION || header.sourceStamp != _sourceStamp
+		|| header.format > TiledImage::TF_RG16F || header.levels == 0 || header.levels > _MAX_LEVELS)
+		return false;
+
+	std::vector<size_t> offsets;
+	size_t expectedSize = tilesLayout(header, offsets);
+
+	size_t dataSize;
+	const byte *data = _cache->mapFile(_fileName, dataSize);
+	if(data == NULL || dataSize != expectedSize)
+		return false;
+
+	tiledLevels.clear();
+	for(uint level = 0; level < header.levels; level++)
+		tiledLevels.push_back(new TiledImage(data + offsets[level], header.sizes[level][0], header.sizes[level][1], 
+			(TiledImage::Format)header.format, _cache));
+
+	return true;
+}
+
+void Texture::bakeDerivatives(TiledImage::Format _format)
+{
+	Image derivatives(levelWidth(0), levelHeight(0));
+	if(image.data() != NULL)
+		texelDifferences(*image, derivatives);
+	else
+		texelDifferences(*tiledLevels[0], derivatives);
+
+	derivativeMap = new TiledImage(derivatives, _format);
+}
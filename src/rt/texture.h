@@ -6,39 +6,374 @@
 
 #include "../rt/texture_basics.h"
 #include "../core/image.h"
+#include "../core/tiled_image.h"
+
+#ifdef _HAS_SSE2
+#include <emmintrin.h>
+#endif
 
 //A texture class
 class Texture : public TextureBase
 {
 
 public:
+	//How the texture is filtered when a sample covers more than a texel.
+	//	Needs the mip-maps, see generateMipMaps()
+	enum MinFilterMode
+	{
+		MFM_None, //Always sample the full resolution image. Aliases in the distance
+		MFM_Trilinear, //Blend the two mip-map levels closest to the footprint
+		MFM_Anisotropic, //Average trilinear samples along the longer axis of 
+			//the footprint. Sharper at grazing angles
+	};
+
 	SmartPtr<Image> image;
+	//The image downsampled by 2, 4, 8, ... down to 1x1. Empty if 
+	//	generateMipMaps() was not called
+	std::vector<SmartPtr<Image> > mipMaps;
+	//image and the mip-maps in the tiled layout, see generateTiledLayout().
+	//	The lookups use them if they are there. image and mipMaps can then 
+	//	be released, unless the mip-maps or the tiles have to be built again
+	std::vector<SmartPtr<TiledImage> > tiledLevels;
+	//Optional, see bakeDerivatives()
+	SmartPtr<TiledImage> derivativeMap;
+	MinFilterMode minFilterMode;
+	//MFM_Anisotropic only: the maximum number of trilinear samples
+	uint maxAnisotropy;
+
 	Texture()
 	{
 		addressModeX = TAM_Wrap;
 		addressModeY = TAM_Wrap;
 		filterMode = TFM_Bilinear;
+		minFilterMode = MFM_Trilinear;
+		maxAnisotropy = 8;
+	}
+
+	//Builds the mip-maps of image, each level averages 2x2 texels of the previous one
+	void generateMipMaps()
+	{
+		mipMaps.clear();
+
+		const Image *prev = image.data();
+		while(prev->width() > 1 || prev->height() > 1)
+		{
+			uint w = std::max(prev->width() / 2, 1u), h = std::max(prev->height() / 2, 1u);
+			SmartPtr<Image> level = new Image(w, h);
+
+			for(uint y = 0; y < h; y++)
+				for(uint x = 0; x < w; x++)
+				{
+					uint x0 = std::min(2 * x, prev->width() - 1), x1 = std::min(2 * x + 1, prev->width() - 1);
+					uint y0 = std::min(2 * y, prev->height() - 1), y1 = std::min(2 * y + 1, prev->height() - 1);
+					(*level)(x, y) = ((*prev)(x0, y0) + (*prev)(x1, y0) + (*prev)(x0, y1) + (*prev)(x1, y1)) * float4::rep(0.25f);
+				}
+
+			mipMaps.push_back(level);
+			prev = level.data();
+		}
+
+		if(!tiledLevels.empty())
+			generateTiledLayout(tiledLevels[0]->format());
+	}
+
+	//Copies image and its mip-maps to the cache friendlier tiled layout. 
+	//	_format can keep the texels at the precision of the source, e.g. 
+	//	TF_RGB8 for a PNG: a quarter of the memory of float4 texels, and of 
+	//	the bandwidth of the lookups. Has to be called again if image changes.
+	//	The 8 bit tiles sample faster than the row major image, TF_RGBA32F
+	//	tiles slower (see bench/texture_sampling), so there is no default
+	void generateTiledLayout(TiledImage::Format _format)
+	{
+		tiledLevels.clear();
+		for(uint level = 0; level <= mipMaps.size(); level++)
+			tiledLevels.push_back(new TiledImage(getLevel(level), _format));
+	}
+
+	//Writes tiledLevels to a file, which openTiles() maps. _sourceStamp 
+	//	identifies where the texture came from, e.g. a hash of its image file
+	bool writeTiles(const std::string &_fileName, unsigned long long _sourceStamp) const;
+
+	//Replaces tiledLevels by the ones in a file from writeTiles(). The file is 
+	//	mapped and its blocks are paged in and out by _cache, so textures larger 
+	//	than the memory can be used. False if the file cannot be read or is for 
+	//	another _sourceStamp
+	bool openTiles(const std::string &_fileName, unsigned long long _sourceStamp, TileCache *_cache);
+
+	//Stores derivatives() of every texel of the full resolution level in 
+	//	derivativeMap (.x and .y), so that derivatives() takes one lookup 
+	//	instead of three. Has to be called again if the texels change.
+	//	Reads image if it is there, otherwise the tiles. Reading tiles of 
+	//	openTiles() pages in all of level 0, and must not overlap with 
+	//	other threads adding blocks to the same TileCache
+	void bakeDerivatives(TiledImage::Format _format = TiledImage::TF_RG16F);
+
+	//Same as TextureBase::sample, without going through lookupTexel()
+	float4 sample(const float2 &_pos) const
+	{
+		return sampleLevel(_pos, 0);
+	}
+
+	//Same as TextureBase::derivatives, without going through lookupTexel()
+	float2 derivatives(const float2 &_pos) const
+	{
+		uint width = levelWidth(0), height = levelHeight(0);
+		float2 pos = _pos * float2((float)width, (float)height);
+		if(!integerWrap(pos))
+			return TextureBase::derivatives(_pos);
+
+		int x = (int)floor(pos.x), y = (int)floor(pos.y);
+		uint x0 = wrapAddress(x, width), y0 = wrapAddress(y, height);
+		if(derivativeMap.data() != NULL)
+		{
+			float4 der = (*derivativeMap)(x0, y0);
+			return float2(der.x, der.y);
+		}
+
+		float4 c0 = levelTexel(0, x0, y0);
+		float4 c1 = levelTexel(0, wrapAddress(x + 1, width), y0);
+		float4 c2 = levelTexel(0, x0, wrapAddress(y + 1, height));
+
+		return float2(c1[0] - c0[0], c2[0] - c0[0]);
 	}
+
+	virtual float4 sample(const float2 &_pos, const float2 &_dPosdx, const float2 &_dPosdy) const
+	{
+		if(minFilterMode == MFM_None || levelCount() == 1)
+			return sample(_pos);
+
+		//The footprint in texels of the full resolution image
+		float2 size(width(), height());
+		float2 dx = _dPosdx * size, dy = _dPosdy * size;
+		float lenX = sqrtf(dx.x * dx.x + dx.y * dx.y), lenY = sqrtf(dy.x * dy.x + dy.y * dy.y);
+		float major = std::max(lenX, lenY), minor = std::min(lenX, lenY);
+
+		if(minFilterMode == MFM_Trilinear || major <= 1.f)
+			return sampleTrilinear(_pos, major);
+
+		//The level is chosen by the shorter axis, the longer one is covered by several samples
+		uint samples = (uint)std::min((float)ceil(major / std::max(minor, 1.f)), (float)maxAnisotropy);
+		samples = std::max(samples, 1u);
+		float2 majorAxis = lenX > lenY ? _dPosdx : _dPosdy;
+
+		float4 ret = float4::rep(0.f);
+		for(uint i = 0; i < samples; i++)
+			ret += sampleTrilinear(_pos + majorAxis * ((i + 0.5f) / samples - 0.5f), major / samples);
+
+		return ret / float4::rep((float)samples);
+	}
+
 private:
+	const Image& getLevel(uint _level) const
+	{
+		return _level == 0 ? *image : *mipMaps[_level - 1];
+	}
 
-	virtual float4 lookupTexel(float _x, float _y) const
+	//The full resolution image and the mip-maps
+	uint levelCount() const
+	{
+		return tiledLevels.empty() ? (uint)mipMaps.size() + 1 : (uint)tiledLevels.size();
+	}
+
+	uint levelWidth(uint _level) const
+	{
+		return _level < tiledLevels.size() ? tiledLevels[_level]->width() : getLevel(_level).width();
+	}
+
+	uint levelHeight(uint _level) const
+	{
+		return _level < tiledLevels.size() ? tiledLevels[_level]->height() : getLevel(_level).height();
+	}
+
+	//Blends the levels closest to a footprint of _size texels
+	float4 sampleTrilinear(const float2 &_pos, float _size) const
+	{
+		if(_size <= 1.f)
+			return sampleLevel(_pos, 0);
+
+		uint lastLevel = levelCount() - 1;
+		float lod = std::min(logf(_size) / logf(2.f), (float)lastLevel);
+		uint level = (uint)lod;
+		float4 ret = sampleLevel(_pos, level);
+		if(level < lastLevel && lod > level)
+		{
+			float4 weight = float4::rep(lod - level);
+			ret = (float4::rep(1.f) - weight) * ret + weight * sampleLevel(_pos, level + 1);
+		}
+
+		return ret;
+	}
+
+	//Bilinear (or point, see filterMode) sample of a mip-map level
+	float4 sampleLevel(const float2 &_pos, uint _level) const
+	{
+		uint width = levelWidth(_level), height = levelHeight(_level);
+		float2 pos = 
+			_pos * float2((float)width, (float)height)
+			+ float2(_TEXEL_CENTER_OFFS, _TEXEL_CENTER_OFFS);
+
+		if(filterMode == TFM_Point)
+			return lookupLevelTexel(_level, pos.x, pos.y);
+
+		uint x[2], y[2];
+		float2 weight;
+		bilinearAddresses(pos, width, height, x, y, weight);
+
+		if(_level < tiledLevels.size())
+			return bilinear(*tiledLevels[_level], x, y, weight);
+
+		return bilinear(getLevel(_level), x, y, weight);
+	}
+
+	//Wrapping with integers gives the same addresses as fixAddress() if both 
+	//	address modes are TAM_Wrap and the coordinates are small enough for 
+	//	x + 0.5 to be exact
+	bool integerWrap(const float2 &_pos) const
+	{
+		const float MAX_ADDRESS = (float)(1 << 22);
+		return addressModeX == TAM_Wrap && addressModeY == TAM_Wrap
+			&& fabsf(_pos.x) < MAX_ADDRESS && fabsf(_pos.y) < MAX_ADDRESS;
+	}
+
+	static uint wrapAddress(int _addr, uint _size)
+	{
+		if((_size & (_size - 1)) == 0)
+			return (uint)_addr & (_size - 1);
+
+		int ret = _addr % (int)_size;
+		return ret < 0 ? ret + _size : ret;
+	}
+
+	//The 2x2 texels around a denormalized position for the bilinear filter, 
+	//	and the weights of the second column and row
+	void bilinearAddresses(const float2 &_pos, uint _width, uint _height, uint _x[2], uint _y[2], float2 &_weight) const
+	{
+		if(!integerWrap(_pos))
+		{
+			float x_lo = floor(_pos.x), y_lo = floor(_pos.y);
+			_x[0] = texelAddress(x_lo, _width, addressModeX);
+			_x[1] = texelAddress(x_lo + 1, _width, addressModeX);
+			_y[0] = texelAddress(y_lo, _height, addressModeY);
+			_y[1] = texelAddress(y_lo + 1, _height, addressModeY);
+			_weight = float2(_pos.x - x_lo, _pos.y - y_lo);
+			return;
+		}
+
+#ifdef _HAS_SSE2
+		//All four addresses at once: x, x + 1, y, y + 1
+		__m128 pos = _mm_setr_ps(_pos.x, _pos.x, _pos.y, _pos.y);
+		__m128i truncated = _mm_cvttps_epi32(pos);
+		//The truncation rounds negative coordinates up, the floor is one less there
+		__m128 roundedUp = _mm_cmpgt_ps(_mm_cvtepi32_ps(truncated), pos);
+		__m128i lo = _mm_add_epi32(truncated, _mm_castps_si128(roundedUp));
+		__m128 weight = _mm_sub_ps(pos, _mm_cvtepi32_ps(lo));
+		__m128i addr = _mm_add_epi32(lo, _mm_setr_epi32(0, 1, 0, 1));
+
+		bool powerOfTwo = (_width & (_width - 1)) == 0 && (_height & (_height - 1)) == 0;
+		if(powerOfTwo)
+			addr = _mm_and_si128(addr, _mm_setr_epi32(_width - 1, _width - 1, _height - 1, _height - 1));
+
+		int a[4];
+		float w[4];
+		_mm_storeu_si128((__m128i*)a, addr);
+		_mm_storeu_ps(w, weight);
+		_weight = float2(w[0], w[2]);
+
+		if(powerOfTwo)
+		{
+			_x[0] = a[0]; _x[1] = a[1];
+			_y[0] = a[2]; _y[1] = a[3];
+			return;
+		}
+#else
+		float x_lo = floor(_pos.x), y_lo = floor(_pos.y);
+		int a[4] = {(int)x_lo, (int)x_lo + 1, (int)y_lo, (int)y_lo + 1};
+		_weight = float2(_pos.x - x_lo, _pos.y - y_lo);
+#endif
+
+		_x[0] = wrapAddress(a[0], _width);
+		_x[1] = wrapAddress(a[1], _width);
+		_y[0] = wrapAddress(a[2], _height);
+		_y[1] = wrapAddress(a[3], _height);
+	}
+
+	//The texels (_x[0..1], _y[0..1]), in the order of TiledImage::quad()
+	static void quad(const Image &_img, const uint _x[2], const uint _y[2], float4 _texels[4])
+	{
+		_texels[0] = _img(_x[0], _y[0]);
+		_texels[1] = _img(_x[1], _y[0]);
+		_texels[2] = _img(_x[0], _y[1]);
+		_texels[3] = _img(_x[1], _y[1]);
+	}
+
+	static void quad(const TiledImage &_img, const uint _x[2], const uint _y[2], float4 _texels[4])
+	{
+		_img.quad(_x, _y, _texels);
+	}
+
+	//Blends the texels (_x[0..1], _y[0..1]) of an Image or a TiledImage
+	template<class tImage>
+	static float4 bilinear(const tImage &_img, const uint _x[2], const uint _y[2], const float2 &_weight)
 	{
-		float realX = _x, realY = _y;
-		fixAddress(realX, width(), addressModeX);
-		fixAddress(realY, height(), addressModeY);
+		float4 texels[4];
+		quad(_img, _x, _y, texels);
+
+#ifdef _HAS_SSE2
+		__m128 xhw = _mm_set1_ps(_weight.x);
+		__m128 yhw = _mm_set1_ps(_weight.y);
+		__m128 xlw = _mm_set1_ps(1 - _weight.x);
+		__m128 ylw = _mm_set1_ps(1 - _weight.y);
+
+		__m128 top = _mm_add_ps(_mm_mul_ps(xlw, _mm_loadu_ps(&texels[0].x)), _mm_mul_ps(xhw, _mm_loadu_ps(&texels[1].x)));
+		__m128 bottom = _mm_add_ps(_mm_mul_ps(xlw, _mm_loadu_ps(&texels[2].x)), _mm_mul_ps(xhw, _mm_loadu_ps(&texels[3].x)));
+
+		float4 ret;
+		_mm_storeu_ps(&ret.x, _mm_add_ps(_mm_mul_ps(ylw, top), _mm_mul_ps(yhw, bottom)));
+		return ret;
+#else
+		float4 xhw = float4::rep(_weight.x);
+		float4 yhw = float4::rep(_weight.y);
+		float4 xlw = float4::rep(1 - xhw.x);
+		float4 ylw = float4::rep(1 - yhw.x);
+
+		return
+			ylw * (xlw * texels[0] + xhw * texels[1]) +
+			yhw * (xlw * texels[2] + xhw * texels[3]);
+#endif
+	}
 
-		uint x = (uint)floor(realX);
-		uint y = (uint)floor(realY);
-		
-		return (*image)(x, y);
+	//The texel of a level at integer coordinates, from the tiled copy if there is one
+	float4 levelTexel(uint _level, uint _x, uint _y) const
+	{
+		if(_level < tiledLevels.size())
+			return (*tiledLevels[_level])(_x, _y);
+
+		return getLevel(_level)(_x, _y);
+	}
+
+	//The texel coordinate of a denormalized address, along an axis of _size texels
+	uint texelAddress(float _addr, uint _size, TextureAddressMode _tam) const
+	{
+		fixAddress(_addr, (float)_size, _tam);
+		return std::min((uint)floor(_addr), _size - 1);
+	}
+
+	float4 lookupLevelTexel(uint _level, float _x, float _y) const
+	{
+		return levelTexel(_level, texelAddress(_x, levelWidth(_level), addressModeX), texelAddress(_y, levelHeight(_level), addressModeY));
+	}
+
+	virtual float4 lookupTexel(float _x, float _y) const
+	{
+		return lookupLevelTexel(0, _x, _y);
 	}
 	virtual float width() const
 	{
-		return (float)image->width();
+		return (float)levelWidth(0);
 	}
 	virtual float height() const
 	{
-		return (float)image->height();
+		return (float)levelHeight(0);
 	}
 };
 
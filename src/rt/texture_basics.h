@@ -89,6 +89,14 @@ public:
 		else
 			return float4::rep(0.f);
 	}
+	//Sample the texture over a footprint: _dPosdx and _dPosdy are the changes
+	//	of the normalized coordinates from one pixel to the next, see Ray::hasDifferentials.
+	//	Textures without minification filtering ignore them
+	virtual float4 sample(const float2& _pos, const float2& _dPosdx, const float2& _dPosdy) const
+	{
+		return sample(_pos);
+	}
+
 	float2 derivatives(const float2& _pos) const
 	{
 		// bilinear transformation
@@ -13,6 +13,7 @@
 #include "impl/samplers.h"
 #include "impl/fractallandscape.h"
 #include "rt/noise_textures.h"
+#include "rt/baked_texture.h"
 
 // for rotating camera
 #define PI 3.14159265
@@ -74,9 +75,16 @@ void setup_and_render()
 
 	// load scene
 	LWObject objects;
+	//The OBJ is the same from run to run, so reuse its mesh and BVH
+	objects.bvhCacheFile = "scene.bvhcache";
+	objects.meshCacheFile = "scene.meshcache";
+	objects.bakeBumpMaps = true;
+	//The architecture has many large, overlapping triangles
+	objects.bvhSettings.method = BVH::BM_SpatialSplit;
 	objects.read("models/cube.obj", true);
-	objects.addReferencesToScene(scene.primitives);	
-	scene.rebuildIndex();
+	std::vector<Primitive*> objectPrimitives;
+	objects.addReferencesToScene(objectPrimitives);
+	scene.addPrimitives(objectPrimitives);
 	
 	//apply custom shaders
 	BumpTexturePhongShader as;
@@ -87,14 +95,18 @@ void setup_and_render()
 	Texture textureGrass;
 	textureGrass.addRef();
 	textureGrass.image = &grass;
+	//The texture is repeated many times over the landscape, far away it needs the mip-maps
+	textureGrass.generateMipMaps();
+	textureGrass.generateTiledLayout(TiledImage::TF_RGB8);
 	as.diffTexture = &textureGrass;
 	as.amibientTexture = &textureGrass;
 	as.specularCoef = float4::rep(0);
 	as.specularExponent = 10000.f;
 	as.transparency = float4::rep(0.9);
 	FractalLandscape f(Point(-4419,-8000,-569), Point(3581,0, -569),9, 0.1, &as, 5.0f);
-	f.addReferencesToScene(scene.primitives);
-	scene.rebuildIndex();
+	std::vector<Primitive*> landscapePrimitives;
+	f.addHeightFieldToScene(landscapePrimitives);
+	scene.addPrimitives(landscapePrimitives);
 	
 	// my phong
 	RRPhongShader glass;
@@ -107,17 +119,20 @@ void setup_and_render()
 	glass.transparency = float4::rep(0.9);
 	glass.addRef();
 	Sphere sphere(Point(-78,1318,40), 25, &glass);;
-	scene.primitives.push_back(&sphere);
-	scene.rebuildIndex();	
+	scene.addPrimitives(std::vector<Primitive*>(1, &sphere));
 	objects.materials[objects.materialMap["Glass"]].shader = &glass;
 
 	
 	//sample shader for noise
 	ProceduralPhongShader skyShader;
 	skyShader.addRef();
-	CloudTexture nt;
+	//Gradient noise, no per-octave grids
+	CloudTexture nt(Perlin::PB_Gradient);
 	nt.addRef();
-	skyShader.amibientNoiseTexture = &nt;
+	//Baked once instead of summing six octaves of noise per lookup
+	BakedTexture bakedClouds(&nt, 2048, 2048, TiledImage::TF_RGB8);
+	bakedClouds.addRef();
+	skyShader.amibientNoiseTexture = &bakedClouds;
 	skyShader.diffuseCoef = float4::rep(0.0f);
 	skyShader.specularCoef = float4::rep(0.0f);
 
@@ -166,7 +181,15 @@ void setup_and_render()
 	r.sampler = &samp;
 
 	r.camera = &cam1;
+
+	//Build the scene index up front, so its statistics can be printed.
+	//	Otherwise it is built lazily on the first intersection
+	scene.updateIndex();
+	scene.getIndexStats().print();
+
 	r.render();
+	if(objects.textureCache.data() != NULL)
+		objects.textureCache->getStats().print();
 	img.writePNG("result.png");
 	
 }
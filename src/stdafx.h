@@ -9,10 +9,14 @@
 #include <string>
 #include <stack>
 #include <map>
+#include <algorithm>
+#include <iterator>
+#include <set>
 #include <fstream>
 #include <stdexcept>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <omp.h>
 #include <sstream>
 